@@ -118,8 +118,12 @@ paddr_t ram_getfirstfree(void);
 
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * If ts_vaddr is nonzero, the entry for user page ts_vaddr in
+	 * address space ts_asid is invalidated. Otherwise every entry
+	 * mapping physical page ts_paddr is, whatever its ASID.
 	 */
+	vaddr_t ts_vaddr;
+	unsigned ts_asid;
 	paddr_t ts_paddr;
 };
 
@@ -85,6 +85,7 @@ syscall(struct trapframe *tf)
 	int32_t retval_v1;
 	off_t pos;
 	int whence;
+	int fd;
 	int err;
 	
 
@@ -186,6 +187,35 @@ sizeof(int));
 	    	err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
 		break;
 
+	    case SYS_mmap:
+		/* The fd is the fifth argument, on the stack; the 64-bit
+		 * offset comes after it, aligned to 8 bytes */
+		err = copyin((const_userptr_t)tf->tf_sp+16, &fd, sizeof(int));
+		if (err) {
+			break;
+		}
+		err = copyin((const_userptr_t)tf->tf_sp+24, &pos,
+sizeof(off_t));
+		if (err) {
+			break;
+		}
+
+		err = sys_mmap((void*)tf->tf_a0, (size_t)tf->tf_a1, tf->tf_a2,
+tf->tf_a3, fd, pos, &retval);
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((void*)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
+	    case SYS_fsync:
+		err = sys_fsync(tf->tf_a0, &retval);
+		break;
+
+	    case SYS___vmstat:
+		err = sys___vmstat((userptr_t)tf->tf_a0);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
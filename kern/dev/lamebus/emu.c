@@ -263,12 +263,20 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 
 /*
  * Common code for read and readdir.
+ *
+ * Data headed for user space goes through a bounce buffer, and is
+ * copied out only after the device lock is released: the copy may
+ * fault, and the fault may need to page in part of an executable or
+ * mapped file that lives on this same device.
  */
 static
 int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	char *kbuf;
+	uint32_t amt;
+	off_t newoffset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
@@ -278,6 +286,14 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 		return 0;
 	}
 
+	kbuf = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		kbuf = kmalloc(len);
+		if (kbuf == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -290,12 +306,28 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	}
 
 	membar_load_load();
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
+	amt = emu_rreg(sc, REG_IOLEN);
+	newoffset = emu_rreg(sc, REG_OFFSET);
+	KASSERT(amt <= len);
 
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	if (kbuf != NULL) {
+		memcpy(kbuf, sc->e_iobuf, amt);
+	}
+	else {
+		result = uiomove(sc->e_iobuf, amt, uio);
+		uio->uio_offset = newoffset;
+	}
 
  out:
 	lock_release(sc->e_lock);
+
+	if (kbuf != NULL) {
+		if (result == 0) {
+			result = uiomove(kbuf, amt, uio);
+			uio->uio_offset = newoffset;
+		}
+		kfree(kbuf);
+	}
 	return result;
 }
 
@@ -323,12 +355,16 @@ emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
 
 /*
  * Write to a hardware-level file handle.
+ *
+ * As in emu_doread, data from user space is copied in through a bounce
+ * buffer before the device lock is taken.
  */
 static
 int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	char *kbuf;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
@@ -337,13 +373,34 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 		return EFBIG;
 	}
 
+	kbuf = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		kbuf = kmalloc(len);
+		if (kbuf == NULL) {
+			return ENOMEM;
+		}
+		result = uiomove(kbuf, len, uio);
+		if (result) {
+			kfree(kbuf);
+			return result;
+		}
+		/* uiomove advanced the offset; the device wants the old one */
+		uio->uio_offset -= len;
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
 
-	result = uiomove(sc->e_iobuf, len, uio);
+	if (kbuf != NULL) {
+		memcpy(sc->e_iobuf, kbuf, len);
+		uio->uio_offset += len;
+	}
+	else {
+		result = uiomove(sc->e_iobuf, len, uio);
+	}
 	membar_store_store();
 	if (result) {
 		goto out;
@@ -354,6 +411,9 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 
  out:
 	lock_release(sc->e_lock);
+	if (kbuf != NULL) {
+		kfree(kbuf);
+	}
 	return result;
 }
 
@@ -845,13 +905,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Mapped files are paged through VOP_READ and VOP_WRITE, so any file
+ * can be mapped.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -37,8 +37,28 @@
 #include <lib.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <kmem_cache.h>
 #include "sfsprivate.h"
 
+/*
+ * Object cache for in-memory inodes. A struct sfs_vnode is a little over
+ * half a kilobyte, which kmalloc would round up to a whole kilobyte.
+ */
+static struct kmem_cache *sfs_vnode_cache;
+
+/*
+ * Create the inode cache. Called once at boot.
+ */
+void
+sfs_bootstrap(void)
+{
+	sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+					    sizeof(struct sfs_vnode),
+					    NULL, NULL);
+	if (sfs_vnode_cache == NULL) {
+		panic("sfs: Could not create vnode cache\n");
+	}
+}
 
 /*
  * Write an on-disk inode structure back out to disk.
@@ -136,7 +156,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -184,7 +204,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +218,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -235,7 +255,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -246,7 +266,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -36,23 +36,24 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
 #include "opt-dumbvm.h"
 
-/* Define the maximum number of heap pages allowed per process */
-#define MAX_HEAPPAGES 1260
-
-/* Define the size of the stack page table.  The size of the stack page table
- * is static so the stack size per process is also limited */
-#define NSTACKPAGES 20
-
-/* Define the minimum size of the heap page table */
-#define MIN_HEAPSZ 4
-
-/* Define the types of address regions supported */
-#define AS_REGION1 0
-#define AS_REGION2 1
-#define AS_HEAP 2
-#define AS_STACK 3
+/* Page tables have two levels.  The page directory holds one pointer for
+ * every 4M of user address space, to a leaf page table which holds the page
+ * table entries of those 4M and takes up one page.  Leaf page tables are only
+ * allocated once a page in their range is touched. */
+#define PT_LEAFSHIFT 22
+#define PT_NLEAFENTRIES (PAGE_SIZE / sizeof(int))
+#define PT_NDIRENTRIES (USERSPACETOP >> PT_LEAFSHIFT)
+#define PT_DIRINDEX(vaddr) ((vaddr) >> PT_LEAFSHIFT)
+#define PT_LEAFINDEX(vaddr) (((vaddr) / PAGE_SIZE) & (PT_NLEAFENTRIES - 1))
+
+/* Page table entries are protected by PT_NLOCKS spinlocks, picked by hashing
+ * the address of the entry.  Neighbouring entries use different locks, so
+ * faults on different pages of an address space do not contend.  Each lock
+ * comes with a wait channel for threads waiting on a busy entry. */
+#define PT_NLOCKS 64
 
 /* Bitmasks for the page table entries */
 #define PG_VALID 0x80000000
@@ -60,9 +61,31 @@
 #define PG_SWAP 0x40000000
 #define PG_BUSY 0x20000000
 #define PG_DIRTY 0x10000000
+#define PG_COW 0x08000000
+
+/* Room kept free for the stack below USERSTACK.  Memory mappings are placed
+ * below it, working down towards the heap. */
+#define AS_STACKSIZE (8 * 1024 * 1024)
 
 struct vnode;
 
+/*
+ * A memory mapping made by mmap: am_npages pages at am_vbase, holding the
+ * file am_vn from file offset am_offset on, or zero-filled memory if am_vn
+ * is NULL.  Pages of a shared file mapping are the file's pages in the page
+ * cache, and writes to them go back to the file; pages of a private mapping
+ * are copied on the first write.
+ */
+struct as_mapping {
+	vaddr_t am_vbase;
+	unsigned long am_npages;
+	int am_prot;			/* PROT_* from <kern/mman.h> */
+	bool am_shared;			/* MAP_SHARED rather than MAP_PRIVATE */
+	struct vnode *am_vn;		/* referenced; NULL if anonymous */
+	off_t am_offset;
+	struct as_mapping *am_next;
+};
+
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -81,14 +104,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Address space lock */
-	struct lock *as_lock;
-
-	/* Address space cv */
-	struct cv *as_cv;
-
-	/* Pointer to the page table for address region 1 */
-        int* as_pgtable1;
+	/* Page directory for the whole user address space.  Entries are
+	 * NULL until a page in their range is touched; after that they stay
+	 * put until the address space is destroyed, so pointers to page table
+	 * entries remain valid.  Protected by as_pgdirlock.  The entries
+	 * themselves are protected by the page table entry locks. */
+	int **as_pgdir;
+	struct spinlock as_pgdirlock;
 
 	/* Virtual base address of address region 1 */
 	vaddr_t as_vbase1;
@@ -96,29 +118,52 @@ struct addrspace {
 	/* Number of pages in address region 1 */
 	unsigned long as_npages1;
 
-	/* Pointer to the page table for address region 2 */
-	int* as_pgtable2;
-
 	/* Virtual base address of address region 2 */
 	vaddr_t as_vbase2;
 
 	/* Number of pages in address region 2 */
 	unsigned long as_npages2;
 
-	/* Pointer to the stack page table */
-	int* as_stackpgtable;
+	/* Executable the address regions are loaded from, or NULL.  Pages
+	 * of a region are read from it on first touch: the as_filesz bytes
+	 * at file offset as_foffset belong at virtual address as_fvaddr, and
+	 * the rest of the region is zero-filled. */
+	struct vnode *as_vn;
+	vaddr_t as_fvaddr1;
+	off_t as_foffset1;
+	size_t as_filesz1;
+	vaddr_t as_fvaddr2;
+	off_t as_foffset2;
+	size_t as_filesz2;
+
+	/* Whether address regions 1 and 2 are read-only in the executable.
+	 * The pages of a read-only region are text, which is shared through
+	 * the page cache with other processes running the same executable. */
+	bool as_readonly1;
+	bool as_readonly2;
 
 	/* Address stack pointer */
 	vaddr_t as_stackptr;
 
-	/* Pointer to the heap page table */
-	int* as_heappgtable;
-
 	/* End address of the heap region */
 	vaddr_t as_heaptop;
 
-	/* Size of the heap page table */
-	int as_heapsz;
+	/* Memory mappings, sorted by address from the highest down.  Only
+	 * the process owning the address space changes them. */
+	struct as_mapping *as_mappings;
+
+	/* Mask of the CPUs which have run this address space, and whose
+	 * TLBs may therefore hold its mappings.  Bit n is for the CPU with
+	 * c_number n.  Protected by as_cpulock. */
+	uint32_t as_cpumask;
+	struct spinlock as_cpulock;
+
+	/* Address space ID tagging this address space's TLB entries, and
+	 * the ASID generation it was handed out in.  If as_asidgen is not
+	 * the current generation, the ASID is stale and a new one is
+	 * assigned by as_activate.  Protected by the ASID allocator lock. */
+	unsigned as_asid;
+	uint32_t as_asidgen;
 #endif
 };
 
@@ -130,35 +175,39 @@ struct addrspace {
  *                may find you want to change the argument list. May
  *                return NULL on out-of-memory error.
  *
- *    as_growheap - Doubles the size of the heap page table.
- *
- *    as_shrinkheap - Reduces the size of the heap page table by half. 
- *
- *    as_copyregion - Copies the page table for an address region.  Invokes by
- *                    as_copy.
+ *    as_getpte - returns a pointer to the page table entry for a virtual
+ *                address, allocating its leaf page table if CREATE is
+ *                set.
  *
  *    as_copy   - create a new address space that is an exact copy of
- *                an old one. Probably calls as_create to get a new
- *                empty address space and fill it in, but that's up to
- *                you.
+ *                an old one.  Resident pages are shared copy-on-write
+ *                rather than copied.
  *
  *    as_activate - make curproc's address space the one currently
- *                "seen" by the processor.
+ *                "seen" by the processor, assigning it an ASID if it
+ *                does not have a current one.
  *
  *    as_deactivate - unload curproc's address space so it isn't
  *                currently "seen" by the processor. This is used to
  *                avoid potentially "seeing" it while it's being
  *                destroyed.
- *   
- *    as_destroyregion - destroys the page table of a given address region.
- *                       Invoked by as_destroy.
  *
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_getcpumask - returns the mask of CPUs which may hold TLB entries
+ *                for an address space.
+ *
+ *    as_tlbshootdown - invalidates a batch of mappings of an address space
+ *                on every CPU which may hold them.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_filedata - record where in an executable the contents
+ *                of an address region come from.  The region is filled
+ *                in from the file as its pages are touched.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -169,28 +218,79 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_heaplimit - returns the address the heap may not grow past.
+ *
+ *    as_mmap   - adds a memory mapping of LEN bytes to the address
+ *                space, at an address of its choosing.
+ *
+ *    as_munmap - removes the memory mappings of a range of pages, writing
+ *                back the dirty pages of shared file mappings.
+ *
+ *    as_syncfile - writes back the dirty pages of the address space's
+ *                shared mappings of a file.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
 
+/*
+ * Page table entry locking, also in addrspace.c:
+ *
+ *    pt_bootstrap - creates the page table entry locks.
+ *
+ *    pte_lock, pte_unlock - acquire and release the lock protecting a
+ *                page table entry.
+ *
+ *    pte_waitbusy - with the lock held, sleeps until the entry is no
+ *                longer busy.  The lock is dropped while sleeping.
+ *
+ *    pte_setbusy - waits until the entry is no longer busy, then marks it
+ *                busy.  Whoever marks an entry busy may change it without
+ *                holding its lock until clearing the busy bit again.
+ *
+ *    pte_clearbusy - marks the entry as no longer busy and wakes up
+ *                anyone waiting on it.
+ *
+ * Page table entry locks are spinlocks: nothing which may sleep can be done
+ * while holding one.  They nest outside the coremap spinlock.
+ */
+
 struct addrspace *as_create(void);
-int		  as_growheap(struct addrspace *as);
-int		  as_shrinkheap(struct addrspace *as);
-int		  as_copyregion(struct addrspace *old, struct addrspace *new, int as_regiontype);
+int               as_getpte(struct addrspace *as, vaddr_t vaddr, bool create,
+                            int **ret);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
-void		  as_destroyregion(struct addrspace *as, int as_regiontype);
 void              as_destroy(struct addrspace *);
+uint32_t          as_getcpumask(struct addrspace *as);
+void              as_tlbshootdown(struct addrspace *as,
+                                  const struct tlbshootdown *ts,
+                                  unsigned nts);
 
 int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_filedata(struct addrspace *as, struct vnode *v,
+                                     off_t offset, vaddr_t vaddr,
+                                     size_t filesz);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+vaddr_t           as_heaplimit(struct addrspace *as);
+int               as_mmap(struct addrspace *as, size_t len, int prot,
+                          int flags, struct vnode *vn, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_syncfile(struct addrspace *as, struct vnode *vn);
+
+void              pt_bootstrap(void);
+void              pte_lock(int *pte);
+void              pte_unlock(int *pte);
+void              pte_waitbusy(int *pte);
+void              pte_setbusy(int *pte);
+void              pte_clearbusy(int *pte);
 
 
 /*
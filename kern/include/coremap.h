@@ -36,6 +36,35 @@
 /* Define the number of physical pages we reserve exclusively for the kernel.*/
 #define N_RESERVEDKPAGES 30
 
+/* Define the number of free pages the idle loop keeps zeroed in advance */
+#define COREMAP_NZEROPAGES 16
+
+/* Free physical pages are kept in blocks of 2^order contiguous pages.  Define
+ * the largest order of a free block. */
+#define COREMAP_MAXORDER 10
+
+/* Define the number of free user pages each CPU may keep in its magazine, and
+ * how many move between a magazine and the free lists at a time */
+#define COREMAP_MAGSIZE 16
+#define COREMAP_MAGBATCH 8
+
+struct vnode;
+struct pageref;
+
+/*
+ * rmap struct
+ *
+ * One mapping of a page mapped by several page tables: a page in the page
+ * cache, or an anonymous page shared copy-on-write after fork.  The coremap
+ * entry of such a page keeps a list of all of its mappings, so that the page
+ * daemon can find and unmap every one of them when it evicts the page.
+ */
+struct rmap {
+	int *rm_pgentry;		/* page table entry mapping the page */
+	struct addrspace *rm_as;	/* address space holding it */
+	struct rmap *rm_next;
+};
+
 /*
  * coremap_entry struct
  */
@@ -63,15 +92,123 @@ struct coremap_entry {
 	 * another kernel page. */
 	int ce_next;
 
+	/* ce_pageref is only meaningful if the physical page is used by the
+	 * kernel.  If kmalloc's subpage allocator carves the page into small
+	 * blocks, ce_pageref points to the pageref describing it, so that
+	 * kfree finds it without searching.  Otherwise it is NULL.  Protected
+	 * by the kmalloc spinlock. */
+	struct pageref *ce_pageref;
+
 	/* ce_pgentry is only meaningful if the physical page is used by a user
 	 * process.  The field ce_pgentry points to the page table entry
-	 * referencing it. */
+	 * referencing it.  It is NULL for a page mapped by more than one page
+	 * table entry, or in the page cache, whose mappings are listed in
+	 * ce_rmap instead. */
 	int *ce_pgentry;
 
-	/* ce_swapoffset is used if the physical page has been cleaned.  Wit our
-	 * current implementation, we assume all pages are dirty so this field
-	 * is unused. */
+	/* ce_refcount is only meaningful if the physical page is used by a
+	 * user process.  It is the number of page table entries referencing
+	 * the page.  An anonymous page with ce_refcount greater than 1 is
+	 * shared copy-on-write between a parent and child process after
+	 * fork.  Its mappings are listed in ce_rmap, and when all but one of
+	 * them are gone, the last one becomes the owner in ce_pgentry
+	 * again. */
+	unsigned ce_refcount;
+
+	/* The following fields are only meaningful if the physical page is in
+	 * the page cache, which holds the text pages of running executables.
+	 * ce_vnode and ce_foffset identify the page contents: the executable,
+	 * and the file offset the page starts at.  ce_vnode is NULL if the
+	 * page is not in the page cache.  ce_hashnext links the page into its
+	 * page cache hash chain (-1 terminates the chain). */
+	struct vnode *ce_vnode;
+	off_t ce_foffset;
+	int ce_hashnext;
+
+	/* ce_rmap lists the page table entries mapping a page in the page
+	 * cache or a shared anonymous page; there are ce_refcount of them.
+	 * It is NULL for a page with a single owner in ce_pgentry. */
+	struct rmap *ce_rmap;
+
+	/* ce_referenced is the reference bit used by the clock page
+	 * replacement algorithm.  It is set whenever vm_fault loads a TLB
+	 * entry for the page, without the coremap spinlock, and cleared when
+	 * the clock hand passes over the page. */
+	bool ce_referenced;
+
+	/* ce_readahead is set if the physical page was read in from the swap
+	 * file ahead of being needed, and has not been used yet */
+	bool ce_readahead;
+
+	/* ce_swapoffset is only meaningful if the physical page is used by a
+	 * user process.  If the page was paged in from the swap file and has
+	 * not been written since, ce_swapoffset is the offset location in the
+	 * swap file which still holds a copy of the page.  Otherwise it is -1.
+	 * A clean page with a copy in the swap file can be evicted without
+	 * writing it to disk. */
 	int ce_swapoffset;
+
+	/* The following fields are only meaningful if the physical page is
+	 * free.  If the page is the first page of a free block, ce_order is
+	 * the order of the block and ce_freeprev and ce_freenext link it into
+	 * the free list for that order (-1 terminates the list).  For all
+	 * other pages, ce_order is -1.  Free pages which have been zeroed in
+	 * advance are not on the free lists; they have ce_order -1 and are
+	 * linked through ce_freenext instead. */
+	int ce_order;
+	int ce_freeprev;
+	int ce_freenext;
+};
+
+/*
+ * coremap_pool struct
+ *
+ * A buddy allocator over a range of coremap entries.  Block addresses are
+ * aligned relative to cp_base, so the buddy of the block at offset o of order
+ * k is at offset o ^ (1 << k).
+ */
+struct coremap_pool {
+
+	/* cp_base is the index of the first coremap entry in the pool */
+	int cp_base;
+
+	/* cp_npages is the number of physical pages in the pool */
+	int cp_npages;
+
+	/* cp_nfree is the number of free physical pages in the pool */
+	unsigned cp_nfree;
+
+	/* cp_freelist[k] is the index of the first free block of order k,
+	 * or -1 if there is none */
+	int cp_freelist[COREMAP_MAXORDER + 1];
+};
+
+/*
+ * coremap_magazine struct
+ *
+ * A small stack of free user pages set aside for one CPU, so that
+ * coremap_getpage can usually find a page without taking the coremap
+ * spinlock.  The magazine is refilled from the free lists a batch at a time
+ * when it runs empty, and pages freed on the CPU go back into it until it
+ * fills up, when a batch is returned to the free lists.  Pages in a magazine
+ * are free but on no free list and, like the pages zeroed in advance, have
+ * ce_order -1 so that the buddy allocator leaves them alone.  They are not
+ * counted in c_upool.cp_nfree.
+ *
+ * cm_lock protects the magazine.  It nests inside the coremap spinlock: the
+ * coremap spinlock is never acquired with a magazine lock held.
+ */
+struct coremap_magazine {
+	struct spinlock cm_lock;
+	int cm_frames[COREMAP_MAGSIZE];
+	unsigned cm_nframes;
+
+	/* Statistics */
+	unsigned cm_nhits;		/* pages allocated from the magazine */
+	unsigned cm_nmisses;		/* allocations which found it empty */
+	unsigned cm_nfrees;		/* pages freed into the magazine */
+	unsigned cm_ndrains;		/* batches returned to the free lists */
+	unsigned cm_nzerofills;		/* pages from it zeroed on demand */
 };
 
 /*
@@ -103,6 +240,57 @@ struct coremap {
 	 * user process. The physical addresses prior to c_userpbase are used by
 	 * the kernel.*/
 	int c_userpbase;
+
+	/* c_kpool holds the free pages reserved exclusively for the kernel,
+	 * between c_kernelpbase and c_userpbase.  c_upool holds the free pages
+	 * from c_userpbase up, which can be used by the kernel and by user
+	 * processes. */
+	struct coremap_pool c_kpool;
+	struct coremap_pool c_upool;
+
+	/* c_freewchan is where threads wait for the page daemon to free pages
+	 * when there are none left.  c_nwaiters is the number of waiting
+	 * threads. */
+	struct wchan *c_freewchan;
+	unsigned c_nwaiters;
+
+	/* c_zeropage is the physical address of the shared zero page, a
+	 * kernel page which is never written.  Reads from untouched
+	 * anonymous pages map it copy-on-write, so that no page is needed
+	 * until the first write. */
+	paddr_t c_zeropage;
+
+	/* c_zerolist is the index of the first free user page which has
+	 * already been zeroed, or -1.  The idle loop keeps up to
+	 * COREMAP_NZEROPAGES of them, c_nzeroed being their number.  They are
+	 * counted in c_upool.cp_nfree, though they are not on its free
+	 * lists. */
+	int c_zerolist;
+	unsigned c_nzeroed;
+
+	/* c_clockhand is the index of the next coremap entry the clock page
+	 * replacement algorithm will consider for eviction */
+	int c_clockhand;
+
+	/* Paging statistics, protected by c_spinlock.  Events counted on the
+	 * fault path are counted per CPU instead; see vmstat.h. */
+	unsigned c_ncleanevictions;	/* evictions with no disk write */
+	unsigned c_nclocksteps;		/* entries the clock hand passed */
+	unsigned c_nsecondchances;	/* referenced pages spared */
+	unsigned c_nreadahead;		/* pages read in ahead of use */
+	unsigned c_nramisses;		/* readahead pages never used */
+	unsigned c_nprezeroed;		/* zeroed pages taken from the pool */
+	unsigned c_nzerofills;		/* pages zeroed by coremap_getpage */
+
+	/* c_rawindow is the number of pages sw_pagein currently tries to
+	 * read in at once.  It grows while pages read ahead get used and
+	 * shrinks when they are freed unused.  Pages read ahead are counted
+	 * as used on the fault path, per CPU (VMS_RAHIT), and the window
+	 * catches up with that count when sw_pagein next reads it;
+	 * c_rahitsseen is the count it last caught up with.  Protected by
+	 * c_spinlock. */
+	unsigned c_rawindow;
+	unsigned c_rahitsseen;
 };
 
 /* Declarations of coremap functions */
@@ -117,8 +305,34 @@ bool coremap_ready(void);
 
 paddr_t coremap_getkpages(unsigned long npages);
 
-int coremap_getpage(int *pg_entry, struct addrspace *as);
+int coremap_getpage(int *pg_entry, struct addrspace *as, bool zero);
 
 void coremap_freekpages(paddr_t pframe);
 
+void coremap_freeframe(int c_index);
+
+unsigned coremap_drainmagazines(void);
+
+int coremap_dirtypage(paddr_t paddr);
+
+int coremap_sharepage(paddr_t paddr, int *pg_entry, struct addrspace *as);
+
+bool coremap_claimpage(paddr_t paddr, int *pg_entry, struct addrspace *as);
+
+void coremap_freepage(paddr_t paddr, int *pg_entry);
+
+void coremap_touchpage(paddr_t paddr);
+
+uint32_t coremap_getcpumask(int c_index);
+
+bool coremap_setmapsbusy(int c_index);
+
+void coremap_clearmapsbusy(int c_index);
+
+bool coremap_zeroidle(void);
+
+void coremap_countpages(unsigned *nfree, unsigned *nuser, unsigned *nkernel);
+
+void coremap_printstats(void);
+
 #endif
@@ -88,6 +88,18 @@ struct cpu {
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Also protected by the IPI lock.
+	 *
+	 * c_shootdown_seq counts the TLB shootdown requests posted to
+	 * this cpu; c_shootdown_done is the value it had when this cpu
+	 * last finished processing them. Senders sleep on
+	 * c_shootdown_wchan until their request is done.
+	 */
+	unsigned c_shootdown_seq;
+	unsigned c_shootdown_done;
+	struct wchan *c_shootdown_wchan;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -154,6 +166,12 @@ void cpu_halt(void);
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
  *
+ * execute_tlbshootdown invalidates a batch of mappings on every CPU
+ * whose bit (1 << c_number) is set in cpumask, and waits until they
+ * are all done. The IPIs to all the target CPUs are sent before
+ * waiting on any of them. If the current CPU is in cpumask, its TLB
+ * is handled directly.
+ *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
  */
@@ -170,6 +188,11 @@ void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
-void execute_tlbshootdown(paddr_t paddr);
+/* CPU masks are 32 bits wide */
+#define TLBSHOOTDOWN_MAXCPUS	32
+
+void execute_tlbshootdown(uint32_t cpumask,
+			  const struct tlbshootdown *mappings,
+			  unsigned nmappings);
 
 #endif /* _CPU_H_ */
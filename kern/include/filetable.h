@@ -60,6 +60,8 @@ struct filetable {
 /*
  * Prototypes for file descriptor table functions
  */
+void filetable_bootstrap(void);
+
 struct file_entry *file_entry_create(void);
 
 void file_entry_destroy(struct file_entry *file_entry);
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * The vmstat structure, for returning virtual memory statistics via
+ * __vmstat().
+ *
+ * The event counters count since boot and wrap around. The page
+ * counts describe physical memory at the time of the call.
+ */
+struct vmstat {
+	/* Page faults, by type */
+	__u32 vms_faults_read;		/* reads of unmapped pages */
+	__u32 vms_faults_write;		/* writes to unmapped pages */
+	__u32 vms_faults_readonly;	/* writes to read-only mappings */
+
+	/* Other events */
+	__u32 vms_zerofills;		/* faults on untouched anonymous pages */
+	__u32 vms_pageins;		/* pages read in from swap */
+	__u32 vms_evictions;		/* pages chosen for eviction */
+	__u32 vms_swapfull;		/* evictions failed for want of swap */
+	__u32 vms_shootdowns;		/* TLB shootdowns sent to other CPUs */
+	__u32 vms_tlbrefills;		/* TLB entries loaded by vm_fault */
+	__u32 vms_zeromaps;		/* of those, for the zero page */
+	__u32 vms_rahits;		/* pages read ahead which got used */
+
+	/* Physical memory, in pages */
+	__u32 vms_totalpages;		/* all pages */
+	__u32 vms_freepages;		/* free pages */
+	__u32 vms_userpages;		/* pages in use by processes */
+	__u32 vms_kernelpages;		/* pages in use by the kernel */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+#include <types.h>
+
+/*
+ * Object caches.
+ *
+ * An object cache hands out objects of one fixed size, carved from pages
+ * that hold nothing else, instead of rounding each one up to a kmalloc
+ * block size.  It is meant for the kernel's hot fixed-size objects:
+ * threads, processes, locks and the like.
+ *
+ * Objects are kept constructed while they sit free in the cache.  The
+ * cache's constructor runs the first time an object is handed out, and
+ * sets up whatever does not change from one use of the object to the next
+ * (spinlocks, wait channels, embedded lists, ...).  Users must put an
+ * object back in that state before freeing it; the next kmem_cache_alloc
+ * may then hand it back with all of that already in place.  The
+ * destructor only runs when the cache gives a page of objects back.
+ *
+ * The constructor returns 0 or an errno value.  Both are called without
+ * any spinlock held and may sleep.  Either may be NULL.
+ *
+ * Each cache is protected by a spinlock of its own.
+ */
+
+struct kmem_cache;
+
+/*
+ * Functions in kmem_cache.c:
+ *
+ *    kmem_cache_create - creates a cache of objects of SIZE bytes, which
+ *                    must fit in a page with room to spare.  NAME is
+ *                    used for statistics and should be a string
+ *                    constant.  Returns NULL if out of memory.
+ *
+ *    kmem_cache_alloc - hands out a constructed object.  Returns NULL if
+ *                    out of memory or the constructor failed.
+ *
+ *    kmem_cache_free - puts a constructed object back in its cache.
+ *
+ *    kmem_cache_printstats - prints the pages and objects of each cache.
+ */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_CACHE_H_ */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KVA_H_
+#define _KVA_H_
+
+#include <types.h>
+
+/*
+ * Kernel virtual allocator.
+ *
+ * Multi-page kernel allocations are mapped into kseg2 a page at a time,
+ * so that they need no run of contiguous physical pages: each page is
+ * the cheapest kind the coremap hands out.  The arena has one virtual
+ * page per physical page and is described by a flat table holding the
+ * TLB entry for each of its pages.  vm_fault loads those entries, marked
+ * global so that they match whatever ASID is current.
+ *
+ * Virtual pages are handed out next-fit, like swap slots.  A freed range
+ * is not reused right away, as other CPUs may still have its pages in
+ * their TLBs.  Its physical pages go back to the coremap at once, but
+ * the range stays dirty until the arena has no room left, when the TLB
+ * of every CPU is flushed in one go and all dirty ranges become free.
+ * So kva_free never waits for other CPUs.
+ *
+ * The table is protected by a spinlock; vm_fault reads it without,
+ * since a page being faulted on is mapped until it is freed.  Flushing
+ * is serialized by a sleep lock, and kva_alloc may sleep for it and for
+ * physical pages.
+ */
+
+/*
+ * Functions in kva.c:
+ *
+ *    kva_bootstrap - sets up the arena.  Called once the coremap is up.
+ *
+ *    kva_alloc - allocates NPAGES pages mapped at consecutive addresses
+ *                in kseg2.  Returns 0 if out of memory or address space,
+ *                or if the arena is not set up yet.
+ *
+ *    kva_free - frees an allocation made by kva_alloc.
+ *
+ *    kva_owns - returns whether an address lies in the arena.
+ *
+ *    kva_fault - handles a TLB fault on an address in the arena.
+ *
+ *    kva_printstats - prints usage and flush statistics.
+ */
+
+void kva_bootstrap(void);
+vaddr_t kva_alloc(unsigned npages);
+void kva_free(vaddr_t addr);
+bool kva_owns(vaddr_t addr);
+int kva_fault(int faulttype, vaddr_t faultaddress);
+void kva_printstats(void);
+
+#endif /* _KVA_H_ */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+#include <types.h>
+
+struct vnode;
+struct addrspace;
+
+/*
+ * Page cache for the text of executables and for mapped files.
+ *
+ * A page read in from a file by vm_fault is entered in the page cache under
+ * its vnode and file offset; when another process faults on the same page,
+ * it maps the page cached there instead of reading it again.  A page cache
+ * page always holds exactly what is in the file at its offset, or will once
+ * it is written back.
+ *
+ * Text pages and pages of private mappings are mapped copy-on-write, so a
+ * process which writes to one gets a private copy.  Pages of shared
+ * mappings are mapped writable, and a write marks the writer's page table
+ * entry dirty.  The page is written back to the file when a dirty mapping
+ * goes away (munmap, or the process exiting), on fsync, or when the page
+ * daemon evicts it.
+ *
+ * A page stays in the page cache for as long as any page table maps it.
+ * The page daemon may also evict it, which unmaps it from every page table
+ * through its reverse map; the page is read from the file again on the next
+ * fault.  The page cache hash table is protected by the coremap spinlock.
+ */
+
+/* Number of hash chains in the page cache */
+#define PC_NBUCKETS 128
+
+/*
+ * Functions in pagecache.c:
+ *
+ *    pagecache_bootstrap - sets up the empty page cache.
+ *
+ *    pagecache_map - looks up the page of vnode VN at file offset FOFFSET.
+ *                    If it is in the page cache, maps it with PG_ENTRY,
+ *                    which must be busy, and returns true.
+ *
+ *    pagecache_insert - enters the page at PADDR, just read in from vnode
+ *                    VN at file offset FOFFSET and owned by PG_ENTRY, in
+ *                    the page cache.  Fails, leaving the page private, if
+ *                    another process got there first.
+ *
+ *    pagecache_share - adds a mapping of a page cache page.  Used by
+ *                    as_copy.
+ *
+ *    pagecache_remove - takes a page out of the page cache once nothing
+ *                    maps it anymore.  Called with the coremap spinlock
+ *                    held.
+ *
+ *    pagecache_writeback - for the page daemon, writes a page cache page
+ *                    being evicted back to its file if any mapping of it
+ *                    is dirty.
+ *
+ *    pagecache_finishevict - completes the eviction of a page cache page:
+ *                    clears every page table entry mapping it, so that the
+ *                    page is read in again on the next fault, and takes it
+ *                    out of the page cache.
+ *
+ *    pagecache_writepage - writes the page at PADDR to vnode VN at file
+ *                    offset FOFFSET, as far as the file extends.
+ *
+ *    pagecache_printstats - prints the page cache statistics.
+ */
+
+void pagecache_bootstrap(void);
+bool pagecache_map(struct vnode *vn, off_t foffset, int *pg_entry,
+                   struct addrspace *as);
+int pagecache_insert(struct vnode *vn, off_t foffset, paddr_t paddr,
+                     int *pg_entry, struct addrspace *as);
+int pagecache_share(paddr_t paddr, int *pg_entry, struct addrspace *as);
+void pagecache_remove(int c_index);
+int pagecache_writeback(int c_index);
+void pagecache_finishevict(int c_index);
+int pagecache_writepage(struct vnode *vn, off_t foffset, paddr_t paddr);
+void pagecache_printstats(void);
+
+#endif /* _PAGECACHE_H_ */
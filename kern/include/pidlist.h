@@ -50,6 +50,9 @@ struct pidlist {
 	struct pidnode *tail;	/* Tail of the pidlist */
 };
 
+/* Create the pidnode cache upon bootup */
+void pidlist_bootstrap(void);
+
 /* Create and initialize a pidlist */
 struct pidlist* pidlist_init(void);
 
@@ -72,6 +72,9 @@ struct procnode_list {
 	struct procnode *head;
 };
 
+/* Create the procnode cache */
+void procnode_bootstrap(void);
+
 /* Create and initialize a procnode */
 struct procnode* procnode_create(void);
 
@@ -81,6 +84,9 @@ struct procnode_list* procnode_list_create(void);
 /* Destroy a procnode */
 void procnode_destroy(struct procnode* procnode);
 
+/* Release all the procnodes in a procnode_list, leaving it empty */
+void procnode_list_clean(struct procnode_list* pn_list);
+
 /* Destroy a procnode_list */
 void procnode_list_destroy(struct procnode_list* pn_list);
 
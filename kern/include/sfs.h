@@ -71,6 +71,11 @@ struct sfs_fs {
 	bool sfs_freemapdirty;          /* true if freemap modified */
 };
 
+/*
+ * Function for setting up sfs at boot
+ */
+void sfs_bootstrap(void);
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
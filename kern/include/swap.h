@@ -32,38 +32,62 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spinlock.h>
 
-/* Define the size of the swap file */
-#define SWAPFILE_SIZE 1250
+/* The page daemon starts evicting pages once fewer than 1/SW_LOWATER_DIV of
+ * the user pages are free, and keeps going until 1/SW_HIWATER_DIV of them are
+ * free.  SW_LOWATER_MIN and SW_HIWATER_MIN are lower bounds in pages. */
+#define SW_LOWATER_DIV 32
+#define SW_HIWATER_DIV 16
+#define SW_LOWATER_MIN 4
+#define SW_HIWATER_MIN 8
+
+/* Define the maximum number of pages the page daemon evicts at once.  Dirty
+ * pages evicted together are written to the swap file with a single write. */
+#define SW_CLUSTER 8
+
+/* Define the maximum number of pages sw_pagein reads in at once, including
+ * the faulting page.  The readahead window starts at half of this and
+ * adapts to how many of the pages read ahead are actually used. */
+#define SW_READAHEAD_MAX 8
+
+/* Define the largest number of extra references a swap slot can hold */
+#define SW_MAXSLOTREFS 0xffff
 
 /*
  * swap struct
  */
 struct swap {
-	/* tlbshootdown structure */
-	struct tlbshootdown *sw_ts;
-
-	/* Semaphore used to communicate when tlbshootdown is complete */
-	struct semaphore *sw_tlbshootdown_sem;
-
-	/* Lock which protects sw_ts */
-	struct lock *sw_tlbshootdown_lock;
-
-	/* Lock which ensures that offset locations in the swap file are updated
-	 * atomically */
-	struct lock *sw_disklock;
-
 	/* Swap file vnode */
 	struct vnode *sw_vn;
 
-	/* bitmap which tracks the offset locations in the swap file */
-	struct bitmap *sw_diskoffset;
-
 	/* Flag to indicate if the disk is full */
 	bool sw_diskfull;
 
-	/* Flag to indicate if the page daemon thread has evicted the page */
-	bool sw_pgevicted;
+	/* The page daemon thread */
+	struct thread *sw_daemon;
+
+	/* Wait channel the page daemon sleeps on, protected by the coremap
+	 * spinlock */
+	struct wchan *sw_daemonwchan;
+
+	/* Free page watermarks of the page daemon */
+	unsigned sw_lowater;
+	unsigned sw_hiwater;
+
+	/* Number of evicted pages being written to the swap file, which will
+	 * be free once the writes complete, and whether an eviction has failed
+	 * since the page daemon last looked.  Protected by the coremap
+	 * spinlock. */
+	unsigned sw_nwriting;
+	bool sw_evictfailed;
+
+	/* A page shared copy-on-write is evicted to a single swap slot, which
+	 * all of its page table entries then refer to.  sw_slotrefs[i] is the
+	 * number of references to slot i beyond the first; the last holder
+	 * frees the slot.  Protected by sw_slotlock. */
+	uint16_t *sw_slotrefs;
+	struct spinlock sw_slotlock;
 };
 
 /* The kernel swap stucture */
@@ -73,11 +97,15 @@ extern struct swap *kswap;
 
 void sw_bootstrap(void);
 
-void sw_getpage(paddr_t *paddr);
+bool sw_getpage(paddr_t *paddr);
+
+void sw_wakedaemon(void);
+
+void sw_evictpages(paddr_t *paddrs, unsigned npages);
 
-int sw_evictpage(paddr_t paddr);
+void sw_freeslot(unsigned sw_offset);
 
-int sw_pagein(int *pg_entry, struct addrspace *as);
+int sw_pagein(struct addrspace *as, vaddr_t vaddr, vaddr_t vtop);
 
 void evicting (void *p, unsigned long arg);
 
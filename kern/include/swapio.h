@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAPIO_H_
+#define _SWAPIO_H_
+
+#include <types.h>
+#include <uio.h>
+
+/*
+ * Asynchronous swap I/O.
+ *
+ * Page transfers to and from the swap disk are queued as requests and
+ * carried out by a few dedicated kernel threads, so that the page daemon
+ * can go on choosing victims while its writes are under way.  A request
+ * covers a run of contiguous swap slots, with one physical page per slot.
+ *
+ * Requests come from a fixed pool, set aside at boot so that the page
+ * daemon never needs memory to free memory.  When the pool is empty,
+ * swapio_alloc sleeps until a request completes, which throttles the page
+ * daemon to the speed of the disk.
+ *
+ * Reads are queued ahead of writes, since a faulting thread is waiting for
+ * each of them, while writes only make free pages for later.
+ *
+ * When a request has a completion function, an I/O thread calls it once
+ * the transfer is done and then returns the request to the pool.
+ * Otherwise the thread which started the request waits for it.
+ */
+
+/* Define the maximum number of pages in one request, the number of requests
+ * in the pool and the number of I/O threads */
+#define SWAPIO_MAXPAGES 8
+#define SWAPIO_NREQUESTS 16
+#define SWAPIO_NTHREADS 2
+
+struct semaphore;
+
+struct swapio {
+	enum uio_rw sio_rw;			/* UIO_READ or UIO_WRITE */
+	unsigned sio_slot;			/* first swap slot */
+	unsigned sio_npages;			/* number of pages */
+	paddr_t sio_paddrs[SWAPIO_MAXPAGES];	/* page for each slot */
+	int sio_result;				/* outcome of the transfer */
+
+	/* Completion function, or NULL if someone waits on sio_sem */
+	void (*sio_done)(struct swapio *sio);
+	struct semaphore *sio_sem;
+
+	struct swapio *sio_next;		/* queue or free list link */
+};
+
+/*
+ * Functions in swapio.c:
+ *
+ *    swapio_bootstrap - sets up the request pool and starts the I/O
+ *                       threads.
+ *
+ *    swapio_alloc - gets a request for a transfer of direction RW starting
+ *                   at swap slot SLOT, sleeping until one is free.
+ *
+ *    swapio_addpage - adds the page PADDR, for the next slot, to a request.
+ *
+ *    swapio_start - queues a request.  DONE is called from an I/O thread
+ *                   when it completes, with sio_result set; the request is
+ *                   freed afterwards.
+ *
+ *    swapio_run - queues a request, waits for it, frees it and returns the
+ *                 outcome of the transfer.
+ *
+ *    swapio_printstats - prints the swap I/O statistics.
+ */
+
+void swapio_bootstrap(void);
+struct swapio *swapio_alloc(enum uio_rw rw, unsigned slot);
+void swapio_addpage(struct swapio *sio, paddr_t paddr);
+void swapio_start(struct swapio *sio, void (*done)(struct swapio *sio));
+int swapio_run(struct swapio *sio);
+void swapio_printstats(void);
+
+#endif /* _SWAPIO_H_ */
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAPMAP_H_
+#define _SWAPMAP_H_
+
+#include <types.h>
+
+/*
+ * Swap slot allocator.
+ *
+ * The swap disk is divided into page-sized slots, numbered from 0.  The
+ * slot map has one bit per slot, set if the slot is in use, packed into
+ * 32-bit words so that runs of used slots are skipped a word at a time.
+ *
+ * Runs of contiguous slots, for the clusters of pages the page daemon
+ * writes together, are handed out next-fit: each search starts where the
+ * previous one ended, so successive clusters land next to each other on
+ * disk and slots freed behind the cursor have time to coalesce before it
+ * comes round again.
+ *
+ * Single slots also go through a small cache on each CPU, refilled from
+ * and drained back to the slot map a batch at a time, so that freeing and
+ * allocating single slots rarely touches the shared slot map.  Slots in a
+ * cache count as in use in the map.  When the map runs dry, every cache is
+ * drained back into it before we give up.
+ *
+ * The slot map is protected by a spinlock, and each cache by a spinlock of
+ * its own, which nests outside the slot map lock.  Nothing here sleeps.
+ */
+
+/* Number of free slots each CPU may cache, and how many move between a
+ * cache and the slot map at a time */
+#define SM_CACHESIZE 16
+#define SM_CACHEBATCH 8
+
+/*
+ * Functions in swapmap.c:
+ *
+ *    swapmap_bootstrap - sets up the allocator for a swap disk of NSLOTS
+ *                        slots, all free.
+ *
+ *    swapmap_alloc - allocates NSLOTS contiguous slots and sets *FIRST to
+ *                    the first of them.  Returns ENOSPC if there is no
+ *                    free run long enough.
+ *
+ *    swapmap_free - frees a slot.
+ *
+ *    swapmap_printstats - prints free space, fragmentation and cache
+ *                    statistics.
+ */
+
+void swapmap_bootstrap(unsigned nslots);
+int swapmap_alloc(unsigned nslots, unsigned *first);
+void swapmap_free(unsigned slot);
+void swapmap_printstats(void);
+
+#endif /* _SWAPMAP_H_ */
@@ -37,6 +37,12 @@
 
 #include <spinlock.h>
 
+/*
+ * Set up the object caches the primitives below are allocated from.
+ * Called once at boot, after wchan_bootstrap.
+ */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -62,6 +68,12 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * Sets the count of a semaphore nobody is waiting on, so that it can be
+ * reused without destroying and recreating it.
+ */
+void sem_reset(struct semaphore *, unsigned count);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -86,6 +98,8 @@ void lock_destroy(struct lock *);
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
  *                   same time.
+ *    lock_tryacquire - Get the lock if nobody holds it, without sleeping.
+ *                   Returns true if we got it.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
@@ -94,6 +108,7 @@ void lock_destroy(struct lock *);
  * These operations must be atomic. You get to write them.
  */
 void lock_acquire(struct lock *);
+bool lock_tryacquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
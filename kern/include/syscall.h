@@ -88,4 +88,12 @@ void sys__exit(int exitcode);
 
 int sys_sbrk(intptr_t amount, void* retval);
 
+int sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset,
+	     void *retval);
+
+int sys_munmap(void *addr, size_t len);
+int sys___vmstat(userptr_t buf);
+
+int sys_fsync(int fd, int* retval);
+
 #endif /* _SYSCALL_H_ */
@@ -71,6 +71,7 @@ int malloctest(int, char **);
 int mallocstress(int, char **);
 int malloctest3(int, char **);
 int malloctest4(int, char **);
+int malloctest5(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -189,6 +189,7 @@ DEFARRAY(vnode, VFSINLINE);
  * You must remove this for the filesystem assignment.
  */
 void vfs_biglock_acquire(void);
+bool vfs_biglock_tryacquire(void);
 void vfs_biglock_release(void);
 bool vfs_biglock_do_i_hold(void);
 
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+#include <kern/vmstat.h>
+
+/*
+ * VM event counters.
+ *
+ * Each CPU counts events in counters of its own, on a cache line of its
+ * own, so that counting on the fault path shares nothing with other CPUs.
+ * The counters of all CPUs are added up when someone asks for them.
+ */
+
+/* Events, in the order of struct vmstat */
+#define VMS_FAULTREAD		0	/* read fault */
+#define VMS_FAULTWRITE		1	/* write fault */
+#define VMS_FAULTREADONLY	2	/* write to a read-only mapping */
+#define VMS_ZEROFILL		3	/* fault on an untouched anonymous page */
+#define VMS_PAGEIN		4	/* page read in from swap */
+#define VMS_EVICTION		5	/* page chosen for eviction */
+#define VMS_SWAPFULL		6	/* eviction failed for want of swap */
+#define VMS_SHOOTDOWN		7	/* TLB shootdown sent to another CPU */
+#define VMS_TLBREFILL		8	/* TLB entry loaded by vm_fault */
+#define VMS_ZEROMAP		9	/* TLB entry loaded for the zero page */
+#define VMS_RAHIT		10	/* page read ahead turned out used */
+#define VMS_NEVENTS		11
+
+/* Size of the cache line each CPU's counters sit on */
+#define VMS_CACHELINE 64
+
+/*
+ * Functions in vmstat.c:
+ *
+ *    vmstat_add - counts N occurrences of EVENT on the current CPU.
+ *
+ *    vmstat_inc - counts one occurrence of EVENT on the current CPU.
+ *
+ *    vmstat_count - returns the total count of EVENT over all CPUs.
+ *
+ *    vmstat_get - fills in a vmstat structure.
+ *
+ *    vmstat_print - prints the event counters and page counts.
+ */
+
+void vmstat_add(unsigned event, unsigned n);
+void vmstat_inc(unsigned event);
+unsigned vmstat_count(unsigned event);
+void vmstat_get(struct vmstat *vs);
+void vmstat_print(void);
+
+#endif /* _VMSTAT_H_ */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _VMTLB_H_
+#define _VMTLB_H_
+
+#include <types.h>
+#include <mips/tlb.h>
+
+/*
+ * Per-CPU TLB management.
+ *
+ * Every change to a CPU's TLB goes through these functions, so that each CPU
+ * knows which of its slots hold no translation.  New translations fill free
+ * slots first; once there are none, slots are reused round-robin.
+ *
+ * All of them work on the TLB of the current CPU and must not be preempted
+ * halfway; they disable interrupts themselves.
+ */
+
+struct vmtlb {
+	/* vt_used[i] is true if slot i holds a translation */
+	bool vt_used[NUM_TLB];
+
+	/* Stack of the slots which hold no translation */
+	unsigned vt_free[NUM_TLB];
+	unsigned vt_nfree;
+
+	/* Next slot to replace once the TLB is full */
+	unsigned vt_hand;
+
+	/* Statistics */
+	unsigned vt_nrefills;		/* translations loaded */
+	unsigned vt_nevictions;		/* valid translations replaced */
+	unsigned vt_nduplicates;	/* loads which found an old entry */
+};
+
+/*
+ * Functions in vmtlb.c:
+ *
+ *    vmtlb_bootstrap - marks every slot of every CPU free.  The TLB of each
+ *                      CPU is already cleared by start.S.
+ *
+ *    vmtlb_load - loads a translation.  If the TLB already has an entry for
+ *                 the same page and ASID it is replaced in place; otherwise
+ *                 a free slot is used, or failing that the next one in
+ *                 round-robin order.
+ *
+ *    vmtlb_invalidate - removes the entry for a page and ASID, if any.
+ *
+ *    vmtlb_invalidate_paddr - removes every entry mapping a physical page.
+ *
+ *    vmtlb_flush - removes every entry.
+ *
+ *    vmtlb_printstats - prints the counters of every CPU.
+ */
+
+void vmtlb_bootstrap(void);
+void vmtlb_load(uint32_t ehi, uint32_t elo);
+void vmtlb_invalidate(uint32_t ehi);
+void vmtlb_invalidate_paddr(paddr_t paddr);
+void vmtlb_flush(void);
+void vmtlb_printstats(void);
+
+#endif /* _VMTLB_H_ */
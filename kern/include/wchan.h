@@ -38,6 +38,11 @@
 struct spinlock; /* in spinlock.h */
 struct wchan; /* Opaque */
 
+/*
+ * Set up the wait channel system. Called once, first thing at boot.
+ */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -50,6 +55,12 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Change the symbolic name of a wait channel, as for an object that
+ * keeps its wchan between uses under different names.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
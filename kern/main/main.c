@@ -43,16 +43,19 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <swap.h>
 #include <coremap.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <sfs.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-sfs.h"
 
 
 /*
@@ -109,11 +112,16 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	wchan_bootstrap();
+	synch_bootstrap();
 	pidtable_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+#if OPT_SFS
+	sfs_bootstrap();
+#endif
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
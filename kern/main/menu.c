@@ -43,6 +43,14 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <coremap.h>
+#include <vmtlb.h>
+#include <pagecache.h>
+#include <swapmap.h>
+#include <swapio.h>
+#include <vmstat.h>
+#include <kmem_cache.h>
+#include <kva.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -397,6 +405,36 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
+	kva_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstat_print();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+	vmtlb_printstats();
+	pagecache_printstats();
+	swapmap_printstats();
+	swapio_printstats();
 
 	return 0;
 }
@@ -493,6 +531,7 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc contention test       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -534,8 +573,10 @@ static const char *mainmenu[] = {
 	"[sp1] Air Balloon                   ",
 #endif
 	"[kh] Kernel heap stats              ",
+	"[vmstat] VM event counters          ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vm] VM paging and TLB stats        ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -588,8 +629,10 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vmstat",     cmd_vmstat },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vm",         cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -599,6 +642,7 @@ static struct {
 	{ "km2",	mallocstress },
 	{ "km3",	malloctest3 },
 	{ "km4",	malloctest4 },
+	{ "km5",	malloctest5 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
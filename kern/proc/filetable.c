@@ -36,6 +36,56 @@
 #include <filetable.h>
 #include <kern/fcntl.h>
 #include <kern/errno.h>
+#include <kmem_cache.h>
+
+/* Object cache for file table entries */
+static struct kmem_cache *file_entry_cache;
+
+/*
+ * file_entry_ctor
+ *
+ * Constructor for the file table entry cache.  A file table entry keeps its
+ * lock while it sits in the cache between uses.
+ */
+static
+int
+file_entry_ctor(void *obj) {
+	struct file_entry *file_entry = obj;
+
+	file_entry->f_lock = lock_create("file entry lock");
+	if (file_entry->f_lock == NULL) {
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * file_entry_dtor
+ *
+ * Destructor for the file table entry cache
+ */
+static
+void
+file_entry_dtor(void *obj) {
+	struct file_entry *file_entry = obj;
+
+	lock_destroy(file_entry->f_lock);
+}
+
+/*
+ * filetable_bootstrap
+ *
+ * filetable_bootstrap creates the file table entry cache upon bootup.
+ */
+void
+filetable_bootstrap(void) {
+	file_entry_cache = kmem_cache_create("file_entry",
+	sizeof(struct file_entry), file_entry_ctor, file_entry_dtor);
+	if (file_entry_cache == NULL) {
+		panic("filetable_bootstrap: could not create file entry cache\n");
+	}
+}
 
 /*
  * file_entry_create
@@ -46,7 +96,7 @@ struct file_entry *
 file_entry_create(void) {
 	/* Allocate a file table entry struct */
 	struct file_entry *file_entry;
-	file_entry = kmalloc(sizeof(*file_entry));
+	file_entry = kmem_cache_alloc(file_entry_cache);
 	
 	if (file_entry == NULL) {
 		return NULL;
@@ -56,11 +106,6 @@ file_entry_create(void) {
 	file_entry->vn = NULL;
 	file_entry->openflags = 0;
 	file_entry->f_refcount = 0;
-	
-	file_entry->f_lock = lock_create("file entry lock");
-	if (file_entry->f_lock == NULL) {
-		panic("lock_create in file_entry_create failed\n");
-	}
 
 	return file_entry;
 }
@@ -74,8 +119,7 @@ void
 file_entry_destroy(struct file_entry *file_entry) {
 	KASSERT(file_entry != NULL);
 
-	lock_destroy(file_entry->f_lock);
-	kfree(file_entry);
+	kmem_cache_free(file_entry_cache, file_entry);
 }
 
 /*
@@ -44,6 +44,8 @@ struct pidtable *pidtable;
  */
 void
 pidtable_bootstrap(void) {
+	pidlist_bootstrap();
+
 	pidtable = kmalloc(sizeof(*pidtable));
 	if (pidtable == NULL) {
 		panic("pidtable_bootstrap failed\n");
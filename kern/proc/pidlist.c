@@ -33,6 +33,24 @@
 #include <current.h>
 #include <kern/errno.h>
 #include <pidlist.h>
+#include <kmem_cache.h>
+
+/* Object cache for pidnodes */
+static struct kmem_cache *pidnode_cache;
+
+/*
+ * pidlist_bootstrap
+ *
+ * Creates the pidnode cache upon bootup
+ */
+void
+pidlist_bootstrap(void) {
+	pidnode_cache = kmem_cache_create("pidnode", sizeof(struct pidnode),
+	NULL, NULL);
+	if (pidnode_cache == NULL) {
+		panic("pidlist_bootstrap: could not create pidnode cache\n");
+	}
+}
 
 /*
  * pidlist_init
@@ -123,7 +141,7 @@ pidlist_remhead(struct pidlist* plist) {
 	p_head = plist->head;
 	pid = p_head->pid;
 	plist->head = p_head->next;
-	kfree(p_head);
+	kmem_cache_free(pidnode_cache, p_head);
 
 	if (plist->head == NULL) {
 		plist->tail = NULL;
@@ -148,7 +166,7 @@ pidlist_addtail(struct pidlist* plist, int pid) {
 	if (p_tail == NULL) {
 		KASSERT(plist->head == NULL);
 
-		p_tail = kmalloc(sizeof(*p_tail));
+		p_tail = kmem_cache_alloc(pidnode_cache);
 		if (p_tail == NULL) {
 			return ENOMEM;
 		}
@@ -158,7 +176,7 @@ pidlist_addtail(struct pidlist* plist, int pid) {
 		plist->head = p_tail;
 		plist->tail = p_tail;
 	} else {
-		p_tail->next = kmalloc(sizeof(*p_tail));
+		p_tail->next = kmem_cache_alloc(pidnode_cache);
 		if (p_tail->next == NULL) {
 			return ENOMEM;
 		}
@@ -190,7 +208,7 @@ pidlist_clean(struct pidlist* plist) {
 	while (itvar != NULL) {
 		p_rem = itvar;
 		itvar = itvar->next;
-		kfree(p_rem);
+		kmem_cache_free(pidnode_cache, p_rem);
 	}
 
 	plist->head = NULL;
@@ -54,11 +54,52 @@
 #include <limits.h>
 #include <procnode_list.h>
 #include <filetable.h>
+#include <kmem_cache.h>
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Object cache for proc structures.
+ */
+static struct kmem_cache *proc_cache;
+
+/*
+ * Constructor for the proc cache. A proc keeps its thread array,
+ * spinlock and (empty) list of children while it sits in the cache
+ * between uses.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_children = procnode_list_create();
+	if (proc->p_children == NULL) {
+		return ENOMEM;
+	}
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+/*
+ * Destructor for the proc cache.
+ */
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+	procnode_list_destroy(proc->p_children);
+}
+
 /*
  * Create a proc structure.
  */
@@ -68,18 +109,18 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(procnode_list_isempty(proc->p_children));
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -89,11 +130,6 @@ proc_create(const char *name)
 
 	proc->p_filetable = NULL;
 
-	proc->p_children = procnode_list_create();
-	if (proc->p_children == NULL) {
-		return NULL;
-	}
-
 	proc->p_parent = NULL;
 
 	proc->p_pid = PID_MIN - 1;
@@ -181,22 +217,31 @@ proc_destroy(struct proc *proc)
 		as_destroy(as);
 	}
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	/* The thread array, spinlock and children list go back to the cache */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	filetable_destroy(proc->p_filetable);
-	procnode_list_destroy(proc->p_children);
+	procnode_list_clean(proc->p_children);
 	
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
- * Create the process structure for the kernel.
+ * Create the object caches for processes, and the process structure
+ * for the kernel.
  */
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: could not create proc cache\n");
+	}
+	procnode_bootstrap();
+	filetable_bootstrap();
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -216,7 +261,8 @@ proc_create_user(const char *name, struct proc **proc)
 
 	result = get_pid(&uproc->p_pid);
 	if (result) {
-		kfree(uproc);
+		kfree(uproc->p_name);
+		kmem_cache_free(proc_cache, uproc);
 		*proc = NULL;
 		return result;
 	}
@@ -35,6 +35,63 @@
 #include <synch.h>
 #include <kern/errno.h>
 #include <procnode_list.h>
+#include <kmem_cache.h>
+
+/* Object cache for procnodes */
+static struct kmem_cache *procnode_cache;
+
+/*
+ * procnode_ctor
+ *
+ * Constructor for the procnode cache.  A procnode keeps its lock and wait
+ * semaphore while it sits in the cache between uses.
+ */
+static
+int
+procnode_ctor(void *obj) {
+	struct procnode *procnode = obj;
+
+	procnode->waitsem = sem_create("wait semaphore", 0);
+	if (procnode->waitsem == NULL) {
+		return ENOMEM;
+	}
+
+	procnode->pn_lock = lock_create("procnode lock");
+	if (procnode->pn_lock == NULL) {
+		sem_destroy(procnode->waitsem);
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * procnode_dtor
+ *
+ * Destructor for the procnode cache
+ */
+static
+void
+procnode_dtor(void *obj) {
+	struct procnode *procnode = obj;
+
+	lock_destroy(procnode->pn_lock);
+	sem_destroy(procnode->waitsem);
+}
+
+/*
+ * procnode_bootstrap
+ *
+ * Creates the procnode cache upon bootup
+ */
+void
+procnode_bootstrap(void) {
+	procnode_cache = kmem_cache_create("procnode", sizeof(struct procnode),
+	procnode_ctor, procnode_dtor);
+	if (procnode_cache == NULL) {
+		panic("procnode_bootstrap: could not create procnode cache\n");
+	}
+}
 
 /*
  * procnode_create
@@ -45,23 +102,11 @@ struct procnode *
 procnode_create(void) {
 	struct procnode *procnode;
 
-	procnode = kmalloc(sizeof(*procnode));
+	procnode = kmem_cache_alloc(procnode_cache);
 	if (procnode == NULL) {
 		return NULL;
 	}
 
-        procnode->waitsem = sem_create("wait semaphore", 0);
-        if (procnode->waitsem == NULL) {
-		kfree(procnode);
-                return NULL;
-        }
-
-	procnode->pn_lock = lock_create("procnode lock");
-	if (procnode->pn_lock == NULL) {
-		kfree(procnode);
-		return NULL;
-	}
-
 	/* Set the reference count to be 2 since the parent process and the
 	 * child process initially both point to it. */
 	procnode->pn_refcount = 2;
@@ -113,12 +158,13 @@ procnode_list_isempty(struct procnode_list* pn_list) {
 }
 
 /*
- * procnode_list_desetroy
+ * procnode_list_clean
  *
- * Destroys the procnode_list
+ * Drops the procnode_list's references to all of its procnodes and leaves it
+ * empty
  */
 void
-procnode_list_destroy(struct procnode_list* pn_list) {
+procnode_list_clean(struct procnode_list* pn_list) {
 	KASSERT(pn_list != NULL);
 
 	struct procnode *itvar;
@@ -165,6 +211,18 @@ procnode_list_destroy(struct procnode_list* pn_list) {
 		}
 	}
 
+	pn_list->head = NULL;
+}
+
+/*
+ * procnode_list_desetroy
+ *
+ * Destroys the procnode_list
+ */
+void
+procnode_list_destroy(struct procnode_list* pn_list) {
+	procnode_list_clean(pn_list);
+
 	/* Free the procnode_list */
 	kfree(pn_list);
 }
@@ -176,9 +234,11 @@ procnode_list_destroy(struct procnode_list* pn_list) {
  */
 void
 procnode_destroy(struct procnode* procnode) {
-	lock_destroy(procnode->pn_lock);
-	sem_destroy(procnode->waitsem);
-	kfree(procnode);
+	/* If the parent never waited, the wait semaphore is still up.  Put it
+	 * back down, as the cache constructed it. */
+	sem_reset(procnode->waitsem, 0);
+
+	kmem_cache_free(procnode_cache, procnode);
 }
 
 /*
@@ -259,8 +319,6 @@ procnode_list_remove(struct procnode_list* pn_list, struct procnode* procnode) {
 		procnode->next->previous = procnode->previous;
 	}
 
-	lock_destroy(procnode->pn_lock);
-	sem_destroy(procnode->waitsem);
-	kfree(procnode);
+	procnode_destroy(procnode);
 }
 
@@ -43,6 +43,8 @@
 #include <kern/fcntl.h>
 #include <uio.h>
 #include <filetable.h>
+#include <vnode.h>
+#include <addrspace.h>
 
 /*
  * sys_open
@@ -108,6 +110,11 @@ sys_open(const_userptr_t filename, int flags, mode_t mode, int* retval)
 	}
 	/* Create a new file table entry */
 	curproc->p_filetable->entries[fd] = file_entry_create();
+	if (curproc->p_filetable->entries[fd] == NULL) {
+		vfs_close(v);
+		kfree(k_filename);
+		return ENOMEM;
+	}
 	curproc->p_filetable->entries[fd]->vn = v;
 	curproc->p_filetable->entries[fd]->openflags = flags & O_ACCMODE;
 	curproc->p_filetable->entries[fd]->seek = 0;
@@ -580,3 +587,41 @@ sys_chdir(const_userptr_t pathname, int* retval)
 	*retval = 0;
 	return 0;
 }
+
+/*
+ * sys_fsync
+ *
+ * sys_fsync writes back the pages of the file specified by fd which the
+ * process has written through shared memory mappings, then forces any dirty
+ * buffers of the file to stable storage.
+ */
+int
+sys_fsync(int fd, int* retval)
+{
+	int last_fd;
+	int result;
+	struct vnode *vn;
+
+	*retval = -1;
+	last_fd = curproc->p_filetable->last_fd;
+
+	if (fd < 0 || fd > last_fd || curproc->p_filetable->entries[fd] == NULL) {
+		/* Return EBADF if fd is not a valid file descriptor */
+		return EBADF;
+	}
+
+	vn = curproc->p_filetable->entries[fd]->vn;
+
+	result = as_syncfile(proc_getas(), vn);
+	if (result) {
+		return result;
+	}
+
+	result = VOP_FSYNC(vn);
+	if (result) {
+		return result;
+	}
+
+	*retval = 0;
+	return 0;
+}
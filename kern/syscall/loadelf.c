@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -60,6 +61,9 @@
 #include <vnode.h>
 #include <elf.h>
 
+#include "opt-dumbvm.h"
+
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -145,6 +149,64 @@ load_segment(struct addrspace *as, struct vnode *v,
 	return result;
 }
 
+#else /* !OPT_DUMBVM */
+
+/*
+ * Load a segment at virtual address VADDR. The segment in memory
+ * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
+ * segment on disk is located at file offset OFFSET and has length
+ * FILESIZE.
+ *
+ * FILESIZE may be less than MEMSIZE; if so the remaining portion of
+ * the in-memory segment is zero-filled.
+ *
+ * Nothing is read here: the segment is recorded in the address space,
+ * and vm_fault reads each page from the file when it is first touched
+ * and zero-fills the bss. Since uiomove no longer gets to check the
+ * load address, we check explicitly that the segment lies in user
+ * space, and that the file is long enough, so that a bad executable
+ * fails now rather than at some later page fault.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr,
+	     size_t memsize, size_t filesize,
+	     int is_executable)
+{
+	struct stat st;
+	int result;
+
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
+	if (offset + (off_t)filesize > st.st_size) {
+		/* short file; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_filedata(as, v, offset, vaddr, filesize);
+}
+
+#endif /* OPT_DUMBVM */
+
 /*
  * Load an ELF executable user program into the current address space.
  *
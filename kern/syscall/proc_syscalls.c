@@ -45,10 +45,13 @@
 #include <bitmap.h>
 #include <swap.h>
 #include <proc.h>
+#include <vnode.h>
 #include <kern/wait.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/mman.h>
 #include <filetable.h>
+#include <vmstat.h>
 
 /*
  * sys_fork
@@ -709,16 +712,18 @@ void sys__exit(int exitcode) {
  */
 int
 sys_sbrk(intptr_t amount, void *retval)  {
-	int npages;
-	int c_index;
 	int result;
 	vaddr_t hbase;
 	vaddr_t old_htop;
 	vaddr_t new_htop;
-	vaddr_t htop_limit;
 	vaddr_t h_ptr;
 	paddr_t paddr;
-//	struct tlbshootdown *ts;
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	int *batch[TLBSHOOTDOWN_MAX];
+	vaddr_t batch_vaddr[TLBSHOOTDOWN_MAX];
+	int *pte;
+	int nbatch;
+	unsigned nts;
 	struct addrspace *as;
 	unsigned sw_offset;
 
@@ -733,17 +738,6 @@ sys_sbrk(intptr_t amount, void *retval)  {
 	hbase = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
 	new_htop = as->as_heaptop + amount;
 
-	/* In our implementation, our heap is limited in size.  Calculate the
-	 * maximum address of the heap */
-	htop_limit = hbase + MAX_HEAPPAGES * PAGE_SIZE;
-
-	/* Calculate how many pages the heap takes up now that the heap size has
-	 * changed */
-	npages = (int)(((new_htop & PAGE_FRAME) - hbase)/PAGE_SIZE);
-	if (new_htop & ~PAGE_FRAME) {
-		npages++;
-	}
-	
 	if (new_htop < hbase) {
 		
 		/* If the request moves the heap below its initial value, return
@@ -752,166 +746,98 @@ sys_sbrk(intptr_t amount, void *retval)  {
 		*(vaddr_t *)retval = -1;
 		return EINVAL;
 
-	} else if (new_htop <= as->as_stackptr && new_htop < htop_limit) {
-
-		if (amount == 0) {
-
-			/* If the amount requested equals 0, do nothing and
-			 * return the end address of the heap */
-
-			*(vaddr_t *)retval = old_htop;
-			return 0;
-
-		} else if (amount > 0) {
-
-			/* If amount is greater than 0, the heap size needs to
-			 * increase */
+	} else if (new_htop <= as_heaplimit(as)) {
 
-			if (as->as_heappgtable == NULL) {
+		/* Growing the heap needs no work: its pages and leaf page
+		 * tables are created as they are touched.  Only shrinking it
+		 * does. */
 
-				/* Create a heap page table if it has not been
-				 * created already */
+		if (amount < 0) {
 
-				as->as_heappgtable =
-				kmalloc(MIN_HEAPSZ*sizeof(int));
-				if (as->as_heappgtable == NULL) {
-					*(vaddr_t *)retval = -1;
-					return ENOMEM;
-				}
+			/* If amount is less than 0, the heap size needs to be
+			 * decreased.  Starting from the first page wholly above
+			 * the new end address of the heap, free the pages until
+			 * we reach the old end address of the heap.  We work on
+			 * batches of up to TLBSHOOTDOWN_MAX pages so that the
+			 * TLB entries of a whole batch can be invalidated at
+			 * once. */
 
-				/* Initialize the heap page table entries with values of
-				 * 0 */ 
-				for (int i=0; i<MIN_HEAPSZ; i++) {
-					as->as_heappgtable[i] = 0;
-				}
-			}
-
-			/* If the total number of heap pages exceeds the current
-			 * size of the heap page table, increase the heap page
-			 * table size until the heap fits */
-			while (npages > as->as_heapsz) {
-				result = as_growheap(as);
-				if (result) {
-					*(vaddr_t *)retval = -1;
-					return result;
-				}		
-			}
-
-		} else {
-
-			/* If amount is less than 0, the heap size needs to be decreased */
-
-			h_ptr = new_htop;
+			h_ptr = (new_htop + PAGE_SIZE - 1) & PAGE_FRAME;
 			
 			while (h_ptr < old_htop) {
 
-
-				/* Starting from the new end address of the heap
-				 * page table, free the page table entries until
-				 * we reach the old end address of the heap page
-				 * table */
-
-				/* Mark the page table entry as being busy */
-				lock_acquire(as->as_lock);
-				int index = (int)((h_ptr - hbase)/PAGE_SIZE);
-
-				while (as->as_heappgtable[index] & PG_BUSY) {
-					cv_wait(as->as_cv, as->as_lock);
+				/* Mark the page table entries in the batch as
+				 * being busy.  Pages whose leaf page table was
+				 * never created were never touched. */
+				nbatch = 0;
+				while (h_ptr < old_htop &&
+				nbatch < TLBSHOOTDOWN_MAX) {
+					result = as_getpte(as, h_ptr, false,
+					&pte);
+					KASSERT(result == 0);
+
+					if (pte != NULL) {
+						pte_setbusy(pte);
+						batch_vaddr[nbatch] = h_ptr;
+						batch[nbatch++] = pte;
+					}
+					h_ptr += PAGE_SIZE;
 				}
 
-				as->as_heappgtable[index] |= PG_BUSY;
-				lock_release(as->as_lock);
-
-				if (as->as_heappgtable[index] & PG_VALID) {
-
-					/* If the page table entry is marked as
-					 * valid, then the page contents are in
-					 * memory.  We need to invalidate the
-					 * physical address in the TLB */
-
-					paddr = (as->as_heappgtable[index] & PG_FRAME)
-					<< 12;
-					c_index = (int)(paddr/PAGE_SIZE);
-			
-					execute_tlbshootdown(paddr);
-
-					/* Although we marked the page table
-					 * entry as being busy, the page daemon
-					 * or some other process could still
-					 * attempt to evict the page.  Because
-					 * the page table entry is marked as
-					 * busy, they cannot evict the page but
-					 * they could still temporarily mark the
-					 * coremap entry as being busy.  So we
-					 * wait until the coremap entry is not
-					 * marked as busy */
-
-					spinlock_acquire(&coremap->c_spinlock);
-					while (coremap->c_entries[c_index].ce_busy) {
-						spinlock_release(&coremap->c_spinlock);
-						thread_yield();
-						spinlock_acquire(&coremap->c_spinlock);
+				/* If a page table entry is marked as valid,
+				 * then the page contents are in memory.  We
+				 * need to invalidate its virtual address in
+				 * the TLB.  Only our own ASID's entries go,
+				 * so processes still sharing the page keep
+				 * theirs. */
+				nts = 0;
+				for (int i=0; i<nbatch; i++) {
+					if (*batch[i] & PG_VALID) {
+						ts[nts].ts_vaddr = batch_vaddr[i];
+						ts[nts].ts_asid = as->as_asid;
+						ts[nts].ts_paddr =
+						(*batch[i] & PG_FRAME) << 12;
+						nts++;
 					}
+				}
+				as_tlbshootdown(as, ts, nts);
 
-					KASSERT(coremap->c_entries[c_index].ce_pgentry
-					== &as->as_heappgtable[index]);
-
-					/* Mark the coremap entry as being free
-					 */ 
-
-					coremap->c_entries[c_index].ce_addrspace
-					= NULL;
-					coremap->c_entries[c_index].ce_allocated
-					= false;
-					coremap->c_entries[c_index].ce_pgentry =
-					NULL;
-					coremap->c_entries[c_index].ce_swapoffset
-					= -1;
-
-					spinlock_release(&coremap->c_spinlock);
+				for (int i=0; i<nbatch; i++) {
+					pte = batch[i];
 
-				} else if (as->as_heappgtable[index] & PG_SWAP) {
+					if (*pte & PG_VALID) {
 
-					/* If the page contents are on disk,
-					 * then simply mark the offset location
-					 * in the swap file as being free */
+						/* Drop our reference to the
+						 * page.  The page is freed
+						 * unless it is still shared
+						 * copy-on-write with another
+						 * process. */
 
-					sw_offset =
-					(unsigned)(as->as_heappgtable[index] &
-					PG_FRAME);
-					lock_acquire(kswap->sw_disklock);
-					bitmap_unmark(kswap->sw_diskoffset,
-					sw_offset);
-					lock_release(kswap->sw_disklock);
+						paddr = (*pte & PG_FRAME) << 12;
+						coremap_freepage(paddr, pte);
 
-				} else {
-					KASSERT(as->as_heappgtable[index] ==
-					PG_BUSY);
-				}
+					} else if (*pte & PG_SWAP) {
 
-				/* Set the page table entry as being 0 */
-				as->as_heappgtable[index] = 0;
-			
-				h_ptr += PAGE_SIZE;	
-			}
-			
+						/* If the page contents are on
+						 * disk, then simply mark the
+						 * offset location in the swap
+						 * file as being free */
 
-			/* Adjust the size of the heap page table now that heap
-			 * pages have been freed */
+						sw_offset =
+						(unsigned)(*pte & PG_FRAME);
+						sw_freeslot(sw_offset);
 
-			while (npages <  as->as_heapsz/2) {
+					} else {
+						KASSERT(*pte == PG_BUSY);
+					}
 
-				if (as->as_heapsz == MIN_HEAPSZ) {
-					break;
+					/* Set the page table entry as being 0
+					 * and wake up anyone who faulted on it
+					 * in the meantime */
+					*pte = PG_BUSY;
+					pte_clearbusy(pte);
 				}
-
-				result = as_shrinkheap(as);
-				if (result) {
-					*(vaddr_t *)retval = -1;
-					return result;
-				}			
-			}					
-
+			}
 		}
 	
 		/* Set retval to equal the old end address of the heap */
@@ -923,8 +849,115 @@ sys_sbrk(intptr_t amount, void *retval)  {
 		return 0;
 
 	} else {
-		/* If the heap size exceeds its maximum limit, return ENOMEM */
+		/* If the heap would run into the stack or a memory mapping,
+		 * return ENOMEM */
 		*(vaddr_t *)retval = -1;
 		return ENOMEM;
 	}	
 }
+
+/*
+ * sys_mmap
+ *
+ * Maps len bytes of the file fd, starting at file offset offset, into the
+ * address space, or zero-filled memory if MAP_ANON is set in flags.  The
+ * address is chosen by the kernel; addr is only a hint, and is ignored.
+ * Pages are read from the file as they are touched, and shared with every
+ * other process mapping the same pages through the page cache.
+ */
+int
+sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset,
+	 void *retval) {
+	int last_fd;
+	int openflags;
+	int maptype;
+	int result;
+	vaddr_t vaddr;
+	struct vnode *vn;
+
+	*(vaddr_t *)retval = -1;
+
+	(void)addr;
+
+	/* Check the protection and flags.  Exactly one of MAP_SHARED and
+	 * MAP_PRIVATE must be given. */
+	maptype = flags & (MAP_SHARED | MAP_PRIVATE);
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0 ||
+	(flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON)) != 0 ||
+	(maptype != MAP_SHARED && maptype != MAP_PRIVATE)) {
+		return EINVAL;
+	}
+
+	vn = NULL;
+
+	if (flags & MAP_ANON) {
+		/* Anonymous memory is only ever private.  After fork its pages
+		 * are shared copy-on-write, and each process reads its own
+		 * copy back in once they have been evicted, so writes could
+		 * not be seen by the other processes. */
+		if (maptype == MAP_SHARED) {
+			return EINVAL;
+		}
+		offset = 0;
+	} else {
+		/* Pages are read from the file at page-aligned offsets */
+		if (offset < 0 || offset % PAGE_SIZE != 0) {
+			return EINVAL;
+		}
+
+		last_fd = curproc->p_filetable->last_fd;
+		if (fd < 0 || fd > last_fd ||
+		curproc->p_filetable->entries[fd] == NULL) {
+			return EBADF;
+		}
+
+		/* The file must be open for reading, and for writing as well
+		 * if writes to the mapping go back to it */
+		openflags = curproc->p_filetable->entries[fd]->openflags;
+		if (openflags == O_WRONLY) {
+			return EACCES;
+		}
+		if (maptype == MAP_SHARED && (prot & PROT_WRITE) &&
+		openflags != O_RDWR) {
+			return EACCES;
+		}
+
+		vn = curproc->p_filetable->entries[fd]->vn;
+		result = VOP_MMAP(vn);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = as_mmap(proc_getas(), len, prot, flags, vn, offset, &vaddr);
+	if (result) {
+		return result;
+	}
+
+	*(vaddr_t *)retval = vaddr;
+	return 0;
+}
+
+/*
+ * sys_munmap
+ *
+ * Removes the memory mappings of the pages from addr up to addr + len.  Dirty
+ * pages of shared file mappings are written back to the file.
+ */
+int
+sys_munmap(void *addr, size_t len) {
+	return as_munmap(proc_getas(), (vaddr_t)addr, len);
+}
+
+/*
+ * sys___vmstat
+ *
+ * Copies the VM event counters and page counts out to the user buffer
+ */
+int
+sys___vmstat(userptr_t buf) {
+	struct vmstat vs;
+
+	vmstat_get(&vs);
+	return copyout(&vs, buf, sizeof(vs));
+}
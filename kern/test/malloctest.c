@@ -33,6 +33,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
@@ -378,3 +379,120 @@ malloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * kmalloc contention benchmark. Each thread allocates and frees small
+ * blocks as fast as it can, keeping KM5_LIVE of them allocated at a
+ * time, so that all the threads hammer the allocator at once. The
+ * time per kmalloc/kfree pair is printed at the end; compare a run
+ * with one thread to one with a thread per CPU or more.
+ *
+ * Each block is stamped with the number of its thread and checked
+ * before being freed, to catch the same block being handed out twice.
+ *
+ * The optional argument is the number of threads.
+ */
+
+#define KM5_ITERATIONS 20000
+#define KM5_LIVE 8
+
+static
+void
+kmalloctest5thread(void *sm, unsigned long num)
+{
+#define NUM_KM5_SIZES 6
+	static const unsigned sizes[NUM_KM5_SIZES] = { 8, 24, 40, 100, 16, 60 };
+
+	struct semaphore *sem = sm;
+	unsigned long *ptrs[KM5_LIVE];
+	unsigned i, slot;
+
+	for (i=0; i<KM5_LIVE; i++) {
+		ptrs[i] = NULL;
+	}
+
+	for (i=0; i<KM5_ITERATIONS; i++) {
+		slot = i % KM5_LIVE;
+		if (ptrs[slot] != NULL) {
+			if (*ptrs[slot] != num) {
+				panic("kmalloctest5: thread %lu: block %p "
+				      "was changed to %lu\n",
+				      num, ptrs[slot], *ptrs[slot]);
+			}
+			kfree(ptrs[slot]);
+		}
+		ptrs[slot] = kmalloc(sizes[i % NUM_KM5_SIZES]);
+		if (ptrs[slot] == NULL) {
+			panic("kmalloctest5: thread %lu: "
+			      "allocating %u bytes failed\n",
+			      num, sizes[i % NUM_KM5_SIZES]);
+		}
+		*ptrs[slot] = num;
+	}
+
+	for (i=0; i<KM5_LIVE; i++) {
+		kfree(ptrs[i]);
+	}
+
+	V(sem);
+}
+
+int
+malloctest5(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct timespec before, after;
+	unsigned nthreads;
+	unsigned long npairs, usecs;
+	unsigned i;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("malloctest5: usage: km5 [nthreads]\n");
+		return EINVAL;
+	}
+	nthreads = nargs == 2 ? (unsigned)atoi(args[1]) : NTHREADS;
+	if (nthreads == 0) {
+		kprintf("malloctest5: need at least one thread\n");
+		return EINVAL;
+	}
+
+	kprintf("Starting kmalloc contention test (%u threads)...\n",
+		nthreads);
+
+	sem = sem_create("malloctest5", 0);
+	if (sem == NULL) {
+		panic("malloctest5: sem_create failed\n");
+	}
+
+	gettime(&before);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("malloctest5", NULL,
+				     kmalloctest5thread, sem, i);
+		if (result) {
+			panic("malloctest5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+
+	sem_destroy(sem);
+
+	/* KM5_ITERATIONS is a multiple of 1000, so this is ns per pair */
+	npairs = (unsigned long)nthreads * KM5_ITERATIONS;
+	usecs = (unsigned long)after.tv_sec * 1000000 + after.tv_nsec / 1000;
+	kprintf("malloctest5: %lu kmalloc/kfree pairs, %lu ns per pair\n",
+		npairs, usecs / (npairs / 1000));
+	kprintf("kmalloc contention test done\n");
+	return 0;
+}
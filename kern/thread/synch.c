@@ -33,41 +33,95 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
+
+/* Object caches for semaphores, locks and CVs. */
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+/*
+ * Give a synchronization object the name NAME. An object keeps its name
+ * while it sits in its cache, and often gets the same one back (every
+ * file entry lock is "file entry lock"), so a matching old copy is kept.
+ * Returns false if out of memory.
+ */
+static
+bool
+synch_setname(char **namep, const char *name)
+{
+	char *newname;
+
+	if (*namep != NULL && strcmp(*namep, name) == 0) {
+		return true;
+	}
+
+	newname = kstrdup(name);
+	if (newname == NULL) {
+		return false;
+	}
+	kfree(*namep);
+	*namep = newname;
+	return true;
+}
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+/*
+ * Constructor for the semaphore cache: a semaphore keeps its wchan and
+ * spinlock, and its name, while it sits in the cache between uses.
+ */
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_name = NULL;
+	sem->sem_wchan = wchan_create("semaphore");
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+	kfree(sem->sem_name);
+}
+
 struct semaphore *
 sem_create(const char *name, unsigned initial_count)
 {
         struct semaphore *sem;
 
-        sem = kmalloc(sizeof(*sem));
+        sem = kmem_cache_alloc(sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
-        sem->sem_name = kstrdup(name);
-        if (sem->sem_name == NULL) {
-                kfree(sem);
-                return NULL;
-        }
-
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
+	if (!synch_setname(&sem->sem_name, name)) {
+		kmem_cache_free(sem_cache, sem);
 		return NULL;
 	}
+	wchan_setname(sem->sem_wchan, sem->sem_name);
 
-	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
 
         return sem;
@@ -78,11 +132,12 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
-        kfree(sem->sem_name);
-        kfree(sem);
+	/* Nobody may be waiting on it */
+	spinlock_acquire(&sem->sem_lock);
+	KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+	spinlock_release(&sem->sem_lock);
+
+        kmem_cache_free(sem_cache, sem);
 }
 
 void
@@ -134,34 +189,70 @@ V(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+void
+sem_reset(struct semaphore *sem, unsigned count)
+{
+        KASSERT(sem != NULL);
+
+	spinlock_acquire(&sem->sem_lock);
+
+	/* Nobody may be waiting on it */
+	KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+        sem->sem_count = count;
+
+	spinlock_release(&sem->sem_lock);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Lock.
 
+/*
+ * Constructor for the lock cache, as for semaphores.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_name = NULL;
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+	kfree(lock->lk_name);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(*lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
-        lock->lk_name = kstrdup(name);
-        if (lock->lk_name == NULL) {
-                kfree(lock);
-                return NULL;
-        }
-
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
+	if (!synch_setname(&lock->lk_name, name)) {
+		kmem_cache_free(lock_cache, lock);
 		return NULL;
 	}
-	spinlock_init(&lock->lk_lock);
-	lock->lk_holder = NULL;
+	wchan_setname(lock->lk_wchan, lock->lk_name);
+	KASSERT(lock->lk_holder == NULL);
 
         return lock;
 }
@@ -172,11 +263,13 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
 
-        kfree(lock->lk_name);
-        kfree(lock);
+	/* Nobody may be waiting on it */
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(wchan_isempty(lock->lk_wchan, &lock->lk_lock));
+	spinlock_release(&lock->lk_lock);
+
+        kmem_cache_free(lock_cache, lock);
 }
 
 void
@@ -196,6 +289,24 @@ lock_acquire(struct lock *lock)
 	spinlock_release(&lock->lk_lock);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool ret;
+
+	DEBUGASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(lock->lk_holder != curthread);
+	ret = lock->lk_holder == NULL;
+	if (ret) {
+		lock->lk_holder = curthread;
+	}
+	spinlock_release(&lock->lk_lock);
+
+	return ret;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -227,30 +338,51 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+/*
+ * Constructor for the CV cache, as for semaphores.
+ */
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_name = NULL;
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&cv->cv_wchanlock);
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	spinlock_cleanup(&cv->cv_wchanlock);
+	wchan_destroy(cv->cv_wchan);
+	kfree(cv->cv_name);
+}
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(*cv));
+        cv = kmem_cache_alloc(cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
-        cv->cv_name = kstrdup(name);
-        if (cv->cv_name==NULL) {
-                kfree(cv);
-                return NULL;
-        }
-
-	cv->cv_wchan = wchan_create(cv->cv_name);
-	if (cv->cv_wchan == NULL) {
-		kfree(cv->cv_name);
-		kfree(cv);
+	if (!synch_setname(&cv->cv_name, name)) {
+		kmem_cache_free(cv_cache, cv);
 		return NULL;
 	}
+	wchan_setname(cv->cv_wchan, cv->cv_name);
 
-	spinlock_init(&cv->cv_wchanlock);
         return cv;
 }
 
@@ -259,11 +391,12 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-	spinlock_cleanup(&cv->cv_wchanlock);
-	wchan_destroy(cv->cv_wchan);
+	/* Nobody may be waiting on it */
+	spinlock_acquire(&cv->cv_wchanlock);
+	KASSERT(wchan_isempty(cv->cv_wchan, &cv->cv_wchanlock));
+	spinlock_release(&cv->cv_wchanlock);
 
-        kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(cv_cache, cv);
 }
 
 void
@@ -301,3 +434,25 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Bootstrap.
+
+/*
+ * Create the object caches for semaphores, locks and CVs. Called at
+ * boot right after wchan_bootstrap, before anything makes any.
+ */
+void
+synch_bootstrap(void)
+{
+	sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+				      sem_ctor, sem_dtor);
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       lock_ctor, lock_dtor);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv),
+				     cv_ctor, cv_dtor);
+	if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Could not create object caches\n");
+	}
+}
@@ -49,8 +49,11 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <swap.h>
+#include <coremap.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <vmstat.h>
+#include <kmem_cache.h>
 
 #include "opt-synchprobs.h"
 
@@ -76,6 +79,10 @@ DEFARRAY(wchan, static __UNUSED inline);
 static struct spinlock allwchans_lock;
 static struct wchanarray allwchans;
 
+/* Object caches for threads and wchans. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
@@ -118,6 +125,20 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor for the thread cache: set up the parts of a thread that
+ * stay the same while it sits in the cache between uses.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -130,14 +151,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -145,7 +166,6 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -197,6 +217,13 @@ cpu_create(unsigned hardware_number)
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
 
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
+	c->c_shootdown_wchan = wchan_create("tlbshootdown");
+	if (c->c_shootdown_wchan == NULL) {
+		panic("cpu_create: wchan_create failed\n");
+	}
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
@@ -267,7 +294,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -359,6 +386,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Could not create thread cache\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -388,10 +421,6 @@ thread_bootstrap(void)
 	/* cpu_create() should have set t_proc. */
 	KASSERT(curthread->t_proc != NULL);
 
-	/* Initialize allwchans */
-	spinlock_init(&allwchans_lock);
-	wchanarray_init(&allwchans);
-
 	/* Done */
 }
 
@@ -645,7 +674,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Put idle time to use zeroing free pages, one at
+			 * a time so as to notice new threads soon, and only
+			 * idle for real once there are enough of them. */
+			if (!coremap_zeroidle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -968,25 +1002,18 @@ thread_consider_migration(void)
  */
 
 /*
- * Create a wait channel. NAME is a symbolic string name for it.
- * This is what's displayed by ps -alx in Unix.
- *
- * NAME should generally be a string constant. If it isn't, alternate
- * arrangements should be made to free it after the wait channel is
- * destroyed.
+ * Constructor for the wchan cache. A wchan stays on allwchans[] with
+ * an empty thread list while it sits in the cache between uses.
  */
-struct wchan *
-wchan_create(const char *name)
+static
+int
+wchan_ctor(void *obj)
 {
-	struct wchan *wc;
+	struct wchan *wc = obj;
 	int result;
 
-	wc = kmalloc(sizeof(*wc));
-	if (wc == NULL) {
-		return NULL;
-	}
 	threadlist_init(&wc->wc_threads);
-	wc->wc_name = name;
+	wc->wc_name = "FREE";
 
 	/* add to allwchans[] */
 	spinlock_acquire(&allwchans_lock);
@@ -995,20 +1022,20 @@ wchan_create(const char *name)
 	if (result) {
 		KASSERT(result == ENOMEM);
 		threadlist_cleanup(&wc->wc_threads);
-		kfree(wc);
-		return NULL;
+		return result;
 	}
 
-	return wc;
+	return 0;
 }
 
 /*
- * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * Destructor for the wchan cache.
  */
+static
 void
-wchan_destroy(struct wchan *wc)
+wchan_dtor(void *obj)
 {
+	struct wchan *wc = obj;
 	unsigned num;
 	struct wchan *wc2;
 
@@ -1026,7 +1053,68 @@ wchan_destroy(struct wchan *wc)
 	spinlock_release(&allwchans_lock);
 
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+}
+
+/*
+ * Set up allwchans[] and the wchan cache. This comes first of all, as
+ * everything else makes locks and so wchans.
+ */
+void
+wchan_bootstrap(void)
+{
+	spinlock_init(&allwchans_lock);
+	wchanarray_init(&allwchans);
+
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Could not create wchan cache\n");
+	}
+}
+
+/*
+ * Create a wait channel. NAME is a symbolic string name for it.
+ * This is what's displayed by ps -alx in Unix.
+ *
+ * NAME should generally be a string constant. If it isn't, alternate
+ * arrangements should be made to free it after the wait channel is
+ * destroyed.
+ */
+struct wchan *
+wchan_create(const char *name)
+{
+	struct wchan *wc;
+
+	wc = kmem_cache_alloc(wchan_cache);
+	if (wc == NULL) {
+		return NULL;
+	}
+	wc->wc_name = name;
+
+	return wc;
+}
+
+/*
+ * Destroy a wait channel. Must be empty and unlocked.
+ * (The corresponding cleanup functions require this.)
+ */
+void
+wchan_destroy(struct wchan *wc)
+{
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+
+	wc->wc_name = "FREE";
+	kmem_cache_free(wchan_cache, wc);
+}
+
+/*
+ * Change the name of a wait channel. The same rules apply to NAME as
+ * in wchan_create.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 
 /*
@@ -1227,6 +1315,10 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+
+		/* Let the senders know their shootdowns are done */
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
+		wchan_wakeall(curcpu->c_shootdown_wchan, &curcpu->c_ipi_lock);
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -1234,23 +1326,73 @@ interprocessor_interrupt(void)
 }
 
 void
-execute_tlbshootdown(paddr_t paddr) {
-	unsigned i;
+execute_tlbshootdown(uint32_t cpumask, const struct tlbshootdown *mappings,
+		     unsigned nmappings)
+{
+	unsigned tickets[TLBSHOOTDOWN_MAXCPUS];
+	unsigned i, j, ncpus, self;
 	struct cpu *c;
+	int n, spl;
 
-	lock_acquire(kswap->sw_tlbshootdown_lock);
+	ncpus = cpuarray_num(&allcpus);
+	KASSERT(ncpus <= TLBSHOOTDOWN_MAXCPUS);
 
-	kswap->sw_ts->ts_paddr = paddr;
+	/* Stay on this cpu while we decide which cpus are remote. */
+	spl = splhigh();
+	self = curcpu->c_number;
 
-	for (i=0; i<cpuarray_num(&allcpus); i++) {
-		
+	/* Post the mappings to each remote target and poke it. */
+	for (i=0; i<ncpus; i++) {
+		if (i == self || (cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
 		c = cpuarray_get(&allcpus, i);
-		ipi_tlbshootdown(c, kswap->sw_ts);
-		P(kswap->sw_tlbshootdown_sem);
 
+		spinlock_acquire(&c->c_ipi_lock);
+		n = c->c_numshootdown;
+		if (n != TLBSHOOTDOWN_ALL) {
+			if (n + nmappings > TLBSHOOTDOWN_MAX) {
+				c->c_numshootdown = TLBSHOOTDOWN_ALL;
+			}
+			else {
+				for (j=0; j<nmappings; j++) {
+					c->c_shootdown[n+j] = mappings[j];
+				}
+				c->c_numshootdown = n + nmappings;
+			}
+		}
+		tickets[i] = ++c->c_shootdown_seq;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+		vmstat_inc(VMS_SHOOTDOWN);
+	}
+
+	/* Meanwhile, take care of our own TLB. */
+	if (cpumask & ((uint32_t)1 << self)) {
+		if (nmappings > TLBSHOOTDOWN_MAX) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (j=0; j<nmappings; j++) {
+				vm_tlbshootdown(&mappings[j]);
+			}
+		}
 	}
 
-	lock_release(kswap->sw_tlbshootdown_lock);
-	
+	splx(spl);
 
+	/* Wait for the remote targets to finish. */
+	for (i=0; i<ncpus; i++) {
+		if (i == self || (cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+
+		spinlock_acquire(&c->c_ipi_lock);
+		while ((int)(c->c_shootdown_done - tickets[i]) < 0) {
+			wchan_sleep(c->c_shootdown_wchan, &c->c_ipi_lock);
+		}
+		spinlock_release(&c->c_ipi_lock);
+	}
 }
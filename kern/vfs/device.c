@@ -42,6 +42,7 @@
 #include <synch.h>
 #include <vnode.h>
 #include <device.h>
+#include <vm.h>
 
 /*
  * Called for each open().
@@ -237,15 +238,21 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mapped pages are read and written a page at a time
+ * through dev_read and dev_write, which only makes sense for block
+ * devices whose blocks evenly divide a page. Character devices
+ * cannot be mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
-	(void)v;
-	return ENOSYS;
+	struct device *d = v->vn_data;
+
+	if (d->d_blocks == 0 || PAGE_SIZE % d->d_blocksize != 0) {
+		return ENODEV;
+	}
+	return 0;
 }
 
 /*
@@ -129,6 +129,23 @@ vfs_biglock_acquire(void)
 	vfs_biglock_depth++;
 }
 
+/*
+ * Like vfs_biglock_acquire, but gives up instead of sleeping if some
+ * other thread holds the lock. For the page daemon, which must not
+ * wait for threads that may be waiting for it in turn.
+ */
+bool
+vfs_biglock_tryacquire(void)
+{
+	if (!lock_do_i_hold(vfs_biglock)) {
+		if (!lock_tryacquire(vfs_biglock)) {
+			return false;
+		}
+	}
+	vfs_biglock_depth++;
+	return true;
+}
+
 void
 vfs_biglock_release(void)
 {
@@ -29,19 +29,28 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <array.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <synch.h>
+#include <wchan.h>
+#include <thread.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
 #include <uio.h>
 #include <vnode.h>
 #include <bitmap.h>
 #include <swap.h>
+#include <swapio.h>
 #include <coremap.h>
+#include <pagecache.h>
+#include <vmtlb.h>
+#include <vmstat.h>
+#include <kva.h>
 #include <addrspace.h>
 #include <vm.h>
 
@@ -50,6 +59,33 @@
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+/*
+ * Address space ID allocator.  ASIDs 1 through NUM_ASID-1 are handed out in
+ * order; when they run out, a new generation is started and the ASIDs of all
+ * existing address spaces become stale.  An ASID is never reused within a
+ * generation, so the TLB entries of a destroyed or retired address space can
+ * never be matched by a live one.  Each CPU remembers the generation its TLB
+ * was last flushed for and flushes it before running an ASID from a newer
+ * one.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static unsigned asid_next = 1;
+
+/* The ASID generation for each CPU's TLB.  Only touched by the CPU itself,
+ * with interrupts off. */
+static uint32_t asid_cpugen[TLBSHOOTDOWN_MAXCPUS];
+
+/*
+ * Page table entry locks.  An entry is protected by ptlocks[PT_LOCKINDEX(pte)].
+ */
+#define PT_LOCKINDEX(pte) (((uintptr_t)(pte) / sizeof(int)) % PT_NLOCKS)
+
+static struct ptlock {
+	struct spinlock pl_lock;
+	struct wchan *pl_wchan;		/* threads waiting for a busy entry */
+} ptlocks[PT_NLOCKS];
+
 /*
  * vm_bootstrap
  *
@@ -60,6 +96,10 @@ vm_bootstrap(void)
 {
 	/* Set up the coremap and kernel swap structure in bootup */
 	coremap_bootstrap();
+	vmtlb_bootstrap();
+	kva_bootstrap();
+	pt_bootstrap();
+	pagecache_bootstrap();
 	sw_bootstrap();
 }
 
@@ -134,46 +174,434 @@ free_kpages(vaddr_t addr)
 	coremap_freekpages(pframe);
 }
 
+/*
+ * vm_tlbshootdown_all
+ *
+ * Invalidates every entry in the TLB of the current CPU
+ */
 void
 vm_tlbshootdown_all(void)
 {
-	panic("vm_tlbshootdown_all not used\n");
+	vmtlb_flush();
 }
 
 /*
  * vm_tlbshootdown
  *
- * Shoots down entries in the TLB
+ * Shoots down entries in the TLB.  A shootdown naming a virtual page only
+ * removes that page's entry for the given ASID, which takes a single probe;
+ * otherwise every entry mapping the physical page goes.
  */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	int i;
-	int spl;
-	uint32_t ehi, elo;
-	paddr_t paddr = ts->ts_paddr;
+	if (ts->ts_vaddr != 0) {
+		vmtlb_invalidate((ts->ts_vaddr & TLBHI_VPAGE) |
+		(ts->ts_asid << TLBHI_PIDSHIFT));
+	} else {
+		vmtlb_invalidate_paddr(ts->ts_paddr);
+	}
+}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+/*
+ * pt_bootstrap
+ *
+ * Creates the page table entry locks
+ */
+void
+pt_bootstrap(void)
+{
+	for (unsigned i=0; i<PT_NLOCKS; i++) {
+		spinlock_init(&ptlocks[i].pl_lock);
+		ptlocks[i].pl_wchan = wchan_create("pte");
+		if (ptlocks[i].pl_wchan == NULL) {
+			panic("pt_bootstrap: Out of memory\n");
+		}
+	}
+}
 
-	for (i=0; i<NUM_TLB; i++) {
+/*
+ * pte_lock
+ *
+ * Acquires the lock protecting a page table entry
+ */
+void
+pte_lock(int *pte)
+{
+	spinlock_acquire(&ptlocks[PT_LOCKINDEX(pte)].pl_lock);
+}
 
-		/* Read a TLB entry */
-		tlb_read(&ehi, &elo, i);
+/*
+ * pte_unlock
+ *
+ * Releases the lock protecting a page table entry
+ */
+void
+pte_unlock(int *pte)
+{
+	spinlock_release(&ptlocks[PT_LOCKINDEX(pte)].pl_lock);
+}
 
-		if ((elo & TLBLO_PPAGE) == paddr) {
-			/* If the TLB low entry contains paddr, invalidate it */
-			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-		}
+/*
+ * pte_waitbusy
+ *
+ * Sleeps until a page table entry is no longer busy.  Called with its lock
+ * held, and returns with it held.
+ */
+void
+pte_waitbusy(int *pte)
+{
+	struct ptlock *pl = &ptlocks[PT_LOCKINDEX(pte)];
+
+	KASSERT(spinlock_do_i_hold(&pl->pl_lock));
 
+	while (*pte & PG_BUSY) {
+		wchan_sleep(pl->pl_wchan, &pl->pl_lock);
 	}
+}
 
-	splx(spl);
+/*
+ * pte_setbusy
+ *
+ * Waits until a page table entry is no longer busy, then marks it as busy
+ */
+void
+pte_setbusy(int *pte)
+{
+	pte_lock(pte);
+	pte_waitbusy(pte);
+	*pte |= PG_BUSY;
+	pte_unlock(pte);
+}
+
+/*
+ * pte_clearbusy
+ *
+ * Marks a page table entry as no longer busy and wakes up anyone waiting on
+ * it.  Threads waiting on other entries which share its lock are woken too,
+ * and go back to sleep.
+ */
+void
+pte_clearbusy(int *pte)
+{
+	struct ptlock *pl = &ptlocks[PT_LOCKINDEX(pte)];
+
+	spinlock_acquire(&pl->pl_lock);
+	*pte &= ~PG_BUSY;
+	wchan_wakeall(pl->pl_wchan, &pl->pl_lock);
+	spinlock_release(&pl->pl_lock);
+}
+
+/*
+ * as_getcpumask
+ *
+ * Returns the mask of CPUs whose TLBs may hold entries for the address space.
+ * CPUs are never removed from the mask, so it may include CPUs which no longer
+ * hold any; the worst this does is send them a needless shootdown.
+ */
+uint32_t
+as_getcpumask(struct addrspace *as)
+{
+	uint32_t mask;
+
+	spinlock_acquire(&as->as_cpulock);
+	mask = as->as_cpumask;
+	spinlock_release(&as->as_cpulock);
+
+	return mask;
+}
+
+/*
+ * as_tlbshootdown
+ *
+ * Invalidates the TLB entries for the nts physical pages in ts on every CPU
+ * which has run the address space.  All the pages are handled with a single
+ * round of IPIs.
+ */
+void
+as_tlbshootdown(struct addrspace *as, const struct tlbshootdown *ts,
+unsigned nts)
+{
+	if (nts == 0) {
+		return;
+	}
+
+	execute_tlbshootdown(as_getcpumask(as), ts, nts);
+}
+
+/*
+ * vm_cowfault
+ *
+ * Handles a write to a page which is shared copy-on-write.  Called from
+ * vm_fault with the lock of the page table entry held, and returns with it
+ * held.  On success the page table entry for vaddr refers to a private,
+ * writable page.
+ */
+static
+int
+vm_cowfault(struct addrspace *as, int *pg_entry, vaddr_t vaddr)
+{
+	int result;
+	int saved_entry;
+	bool zero;
+	paddr_t old_paddr;
+	paddr_t new_paddr;
+	struct tlbshootdown ts;
+
+	KASSERT(*pg_entry & PG_VALID);
+	KASSERT(*pg_entry & PG_COW);
+
+	/* Mark the page table entry as busy and release its lock while we
+	 * deal with the coremap */
+	*pg_entry |= PG_BUSY;
+	saved_entry = *pg_entry;
+	old_paddr = (paddr_t)((*pg_entry & PG_FRAME) << 12);
+	pte_unlock(pg_entry);
+
+	if (coremap_claimpage(old_paddr, pg_entry, as)) {
+
+		/* Every other process sharing the page has already made its
+		 * own copy, so we can simply take the page over */
+
+		pte_lock(pg_entry);
+		*pg_entry &= ~PG_COW;
+		return 0;
+	}
+
+	/* Get a new page and copy the contents of the shared page into it.
+	 * The shared page cannot be freed or evicted underneath us because we
+	 * still hold a reference to it.  A copy of the zero page is just a
+	 * zeroed page. */
+	zero = old_paddr == coremap->c_zeropage;
+	result = coremap_getpage(pg_entry, as, zero);
+	if (result) {
+		*pg_entry = saved_entry;
+		pte_clearbusy(pg_entry);
+		pte_lock(pg_entry);
+		return result;
+	}
+
+	new_paddr = (paddr_t)((*pg_entry & PG_FRAME) << 12);
+	if (!zero) {
+		memmove((void *)PADDR_TO_KVADDR(new_paddr),
+		(const void *)PADDR_TO_KVADDR(old_paddr), PAGE_SIZE);
+	} else {
+		vmstat_inc(VMS_ZEROFILL);
+	}
+
+	/* Other CPUs may still map vaddr to the shared page read-only, and
+	 * would keep reading it after its other users start writing to it.
+	 * Only our own ASID's entry needs to go. */
+	ts.ts_vaddr = vaddr;
+	ts.ts_asid = as->as_asid;
+	ts.ts_paddr = old_paddr;
+	as_tlbshootdown(as, &ts, 1);
+
+	/* Drop our reference to the shared page */
+	coremap_freepage(old_paddr, pg_entry);
+
+	/* The private copy is no longer shared */
+	pte_lock(pg_entry);
+	*pg_entry &= ~PG_COW;
+	*pg_entry |= PG_DIRTY;
+
+	return 0;
+}
+
+/*
+ * vm_readfile
+ *
+ * Reads the part of the page at vaddr, whose physical address is paddr, that
+ * overlaps the filesz bytes of the executable at file offset foffset which
+ * belong at virtual address fvaddr.
+ */
+static
+int
+vm_readfile(struct vnode *vn, vaddr_t vaddr, paddr_t paddr, vaddr_t fvaddr,
+	    off_t foffset, size_t filesz)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	start = vaddr > fvaddr ? vaddr : fvaddr;
+	end = vaddr + PAGE_SIZE;
+	if (end > fvaddr + filesz) {
+		end = fvaddr + filesz;
+	}
+	if (start >= end) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+		  end - start, foffset + (start - fvaddr), UIO_READ);
+	result = VOP_READ(vn, &ku);
+	if (result) {
+		return result;
+	}
+
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("vm: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	return 0;
+}
+
+/*
+ * vm_hasfiledata
+ *
+ * Returns whether any part of the page at vaddr is read from the executable
+ */
+static
+bool
+vm_hasfiledata(struct addrspace *as, vaddr_t vaddr)
+{
+	if (as->as_vn == NULL) {
+		return false;
+	}
+
+	if (vaddr + PAGE_SIZE > as->as_fvaddr1 &&
+	vaddr < as->as_fvaddr1 + as->as_filesz1) {
+		return true;
+	}
+
+	return vaddr + PAGE_SIZE > as->as_fvaddr2 &&
+	vaddr < as->as_fvaddr2 + as->as_filesz2;
+}
+
+/*
+ * vm_fillpage
+ *
+ * Fills in a new page at vaddr, whose physical address is paddr.  Whatever
+ * of it lies in the file data of a loaded segment is read from the
+ * executable; the rest (bss, heap and stack) is zero.  The page table entry
+ * must be busy, as this may sleep.
+ */
+static
+int
+vm_fillpage(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	int result;
+
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+	if (as->as_vn == NULL) {
+		return 0;
+	}
+
+	result = vm_readfile(as->as_vn, vaddr, paddr, as->as_fvaddr1,
+			     as->as_foffset1, as->as_filesz1);
+	if (result) {
+		return result;
+	}
+
+	return vm_readfile(as->as_vn, vaddr, paddr, as->as_fvaddr2,
+			   as->as_foffset2, as->as_filesz2);
+}
+
+/*
+ * vm_textoffset
+ *
+ * Returns whether the page at vaddr is a text page, which can be shared
+ * through the page cache, and if so sets *foffset to the file offset in the
+ * executable the page starts at.  That is only well defined if the segment's
+ * file offset and address agree modulo the page size, as the ELF standard
+ * requires them to.  Only pages lying wholly within the file data qualify,
+ * since a page cache page must hold exactly what is in the file: the same
+ * page of the executable may also be mapped with mmap.
+ */
+static
+bool
+vm_textoffset(struct addrspace *as, vaddr_t vaddr, off_t *foffset)
+{
+	vaddr_t fvaddr;
+	off_t foff;
+	size_t filesz;
+
+	if (as->as_vn == NULL) {
+		return false;
+	}
 
-	/* Increment the kswap tlbshootdown semaphore to indicate that the
-	 * tlbshootdown is complete */
-	V(kswap->sw_tlbshootdown_sem);
+	if (as->as_readonly1 && vaddr >= as->as_vbase1 &&
+	vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		fvaddr = as->as_fvaddr1;
+		foff = as->as_foffset1;
+		filesz = as->as_filesz1;
+	} else if (as->as_readonly2 && vaddr >= as->as_vbase2 &&
+	vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		fvaddr = as->as_fvaddr2;
+		foff = as->as_foffset2;
+		filesz = as->as_filesz2;
+	} else {
+		return false;
+	}
+
+	if (fvaddr % PAGE_SIZE != (vaddr_t)(foff % PAGE_SIZE)) {
+		return false;
+	}
+
+	/* The first and last pages of the file data may be partly zero-filled,
+	 * and stay private */
+	if (vaddr < fvaddr || vaddr + PAGE_SIZE > fvaddr + filesz) {
+		return false;
+	}
 
+	*foffset = foff + ((off_t)vaddr - (off_t)fvaddr);
+	return true;
+}
+
+/*
+ * vm_readpage
+ *
+ * Reads the page of a mapped file vn at file offset foffset into the page at
+ * paddr.  Whatever of the page lies past the end of the file is zero.  The
+ * page table entry must be busy, as this may sleep.
+ */
+static
+int
+vm_readpage(struct vnode *vn, off_t foffset, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE, foffset,
+		  UIO_READ);
+	result = VOP_READ(vn, &ku);
+	if (result) {
+		return result;
+	}
+
+	bzero((void *)(PADDR_TO_KVADDR(paddr) + PAGE_SIZE - ku.uio_resid),
+	      ku.uio_resid);
+	return 0;
+}
+
+/*
+ * as_findmapping
+ *
+ * Returns the memory mapping containing vaddr, or NULL if there is none
+ */
+static
+struct as_mapping *
+as_findmapping(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_mapping *m;
+
+	for (m = as->as_mappings; m != NULL; m = m->am_next) {
+		if (vaddr >= m->am_vbase + m->am_npages * PAGE_SIZE) {
+			/* The rest are all lower down */
+			return NULL;
+		}
+		if (vaddr >= m->am_vbase) {
+			return m;
+		}
+	}
+
+	return NULL;
 }
 
 /*
@@ -184,15 +612,21 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	int tlb_index;
-	int *pgtable;
+	int *pte;
 	int result;
-	signed long index;
-	unsigned long npages;
+	int sw_slot;
+	bool busy;
+	bool anon;
+	bool cached;
+	bool cow;
+	off_t foffset;
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stacktop, heaptop, stacklimit;
+	vaddr_t vtop;
 	paddr_t paddr;
 	uint32_t ehi, elo;
 	struct addrspace *as;
+	struct as_mapping *m;
+	struct vnode *vn;
 	int spl;
 
 	/* Align the fault address to 4K boundaries */
@@ -206,6 +640,23 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EINVAL;
 	}
 
+	/* Faults on the kernel's own mappings in kseg2 */
+	if (faultaddress >= MIPS_KSEG2) {
+		return kva_fault(faulttype, faultaddress);
+	}
+
+	switch (faulttype) {
+	    case VM_FAULT_READ:
+		vmstat_inc(VMS_FAULTREAD);
+		break;
+	    case VM_FAULT_WRITE:
+		vmstat_inc(VMS_FAULTWRITE);
+		break;
+	    case VM_FAULT_READONLY:
+		vmstat_inc(VMS_FAULTREADONLY);
+		break;
+	}
+
 	if (curproc == NULL) {
 		/*
 		 * No process. This is probably a kernel fault early
@@ -226,178 +677,298 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	/* Determine the base address and top address of each address region.
 	 * Note that the top address of address region 2 is the same as the base
-	 * address for the heap. */
+	 * address for the heap.  The stack may grow down until it meets
+	 * whatever lies below it, the highest memory mapping included. */
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
 	vbase2 = as->as_vbase2;
 	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+	heaptop = (as->as_heaptop + PAGE_SIZE - 1) & PAGE_FRAME;
 	stacktop = USERSTACK;
-	stacklimit = USERSTACK - NSTACKPAGES * PAGE_SIZE;
-	heaptop = as->as_heaptop;
+	stacklimit = heaptop;
+	if (stacklimit < vtop1) {
+		stacklimit = vtop1;
+	}
+	if (stacklimit < vtop2) {
+		stacklimit = vtop2;
+	}
+	m = as->as_mappings;
+	if (m != NULL && stacklimit < m->am_vbase + m->am_npages * PAGE_SIZE) {
+		stacklimit = m->am_vbase + m->am_npages * PAGE_SIZE;
+	}
 
-	/* Determine which address region the faultaddress lies and which page
-	 * table entry we should be accessing. */
+	/* Determine which address region the faultaddress lies in.  vtop is
+	 * the end of the region, past which sw_pagein does not read ahead. */
+	m = NULL;
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		index = (signed long)((faultaddress - vbase1) / PAGE_SIZE);
-		npages = as->as_npages1;
-		pgtable = as->as_pgtable1;
-		goto fetchpaddr;
+		vtop = vtop1;
 
 	} else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		index = (signed long)((faultaddress - vbase2) / PAGE_SIZE);
-		npages = as->as_npages2;
-		pgtable = as->as_pgtable2;
-		goto fetchpaddr;
+		vtop = vtop2;
 
-	} else if (faultaddress >= stacklimit && faultaddress < stacktop) {
+	} else if (faultaddress >= vtop2 && faultaddress < heaptop) {
+		vtop = heaptop;
 
-		index = (signed long)(((stacktop - faultaddress) / PAGE_SIZE) -
-		1);
+	} else if ((m = as_findmapping(as, faultaddress)) != NULL) {
 
-		/* Adjust the stackptr if necessary */
-
-		if (stacktop - (index+1)*PAGE_SIZE < as->as_stackptr) {
-			as->as_stackptr = stacktop - (index+1)*PAGE_SIZE;
+		/* The page is in a memory mapping.  Check the access against
+		 * its protection; PROT_WRITE and PROT_EXEC imply PROT_READ, as
+		 * the MMU cannot tell them apart. */
+		if (m->am_prot == PROT_NONE ||
+		(faulttype != VM_FAULT_READ && !(m->am_prot & PROT_WRITE))) {
+			return EFAULT;
 		}
+		vtop = m->am_vbase + m->am_npages * PAGE_SIZE;
 
-		npages = (unsigned long)((stacktop - as->as_stackptr) / PAGE_SIZE);
-		pgtable = as->as_stackpgtable;
-		goto fetchpaddr;
-
-	} else if (faultaddress >= vtop2 && faultaddress < heaptop) {  
-
-		index = (signed long)((faultaddress - vtop2) / PAGE_SIZE);
+	} else if (faultaddress >= stacklimit && faultaddress < stacktop) {
 
-		npages = (unsigned long)(((heaptop & PAGE_FRAME) - vtop2) / PAGE_SIZE);
-		if (heaptop & ~PAGE_FRAME) {
-			npages++;
+		/* Adjust the stackptr if necessary */
+		if (faultaddress < as->as_stackptr) {
+			as->as_stackptr = faultaddress;
 		}
+		vtop = stacktop;
 
-		pgtable = as->as_heappgtable;
-		goto fetchpaddr;
-		
 	} else {
-	
+
 		/* If faultaddress does not lie in any of the address regions,
 		 * return EFAULT */
 
 		return EFAULT;
-	}		
-	
-fetchpaddr:
-
-	/* Now that we know which address region faultaddress belongs to, look
-	 * up the matching page table entry */
-	
-	if (index >= (signed long)npages) {
+	}
 
-		return EFAULT;
+	/* Look up the page table entry, creating its leaf page table if this
+	 * is the first page touched in its range */
+	result = as_getpte(as, faultaddress, true, &pte);
+	if (result) {
+		return result;
+	}
 
-	} 
-	
-	/* Acquire the address space lock */
-	lock_acquire(as->as_lock);
+	/* Acquire the page table entry lock */
+	sw_slot = -1;
+	pte_lock(pte);
 
 	/* If the page table entry is marked as busy, the physical page is being
-	 * evicted.  Wait until the page table entry is not busy before
-	 * proceeding. */
-	while (pgtable[index] & PG_BUSY) {
-		cv_wait(as->as_cv, as->as_lock);
-	}
+	 * evicted or paged in.  Wait until the page table entry is not busy
+	 * before proceeding. */
+	pte_waitbusy(pte);
 
-	if (pgtable[index] & PG_VALID) {
+	if (*pte & PG_VALID) {
 
 		/* If the page table entry is marked as valid, get the physical
-		 * address */
+		 * address.  A write to a page shared copy-on-write requires a
+		 * private copy of the page first. */
 
-		if (faulttype == VM_FAULT_READONLY && !(pgtable[index] & PG_DIRTY)) {
-			pgtable[index] |= PG_DIRTY;
+		if (faulttype != VM_FAULT_READ && (*pte & PG_COW)) {
+			result = vm_cowfault(as, pte, faultaddress);
+			if (result) {
+				pte_unlock(pte);
+				return result;
+			}
 		}
 
-		paddr = (paddr_t)((pgtable[index] & PG_FRAME) << 12);
+		paddr = (paddr_t)((*pte & PG_FRAME) << 12);
 
-	} else if (pgtable[index] & PG_SWAP) { 
+		/* Pages are mapped read-only until they are first written.
+		 * On the first write, mark the page as dirty.  Its copy in the
+		 * swap file, if any, is now stale and is freed once we have
+		 * let go of the lock. */
+		if (faulttype != VM_FAULT_READ && !(*pte & PG_DIRTY)) {
+			*pte |= PG_DIRTY;
+			sw_slot = coremap_dirtypage(paddr);
+		}
+
+	} else if (*pte & PG_SWAP) { 
 
 		/* If the page has been swapped out, mark the page table entry
-		 * as busy, release the address space lock, and perform a page
-		 * in */
+		 * as busy, release its lock, and perform a page in */
 
-		pgtable[index] |= PG_BUSY;
+		*pte |= PG_BUSY;
 		
-		lock_release(as->as_lock);
+		pte_unlock(pte);
 	
-		result = sw_pagein(&pgtable[index], as);
+		result = sw_pagein(as, faultaddress, vtop);
 		if (result) {
-			pgtable[index] &= ~PG_BUSY;
-			lock_release(as->as_lock);
+			pte_clearbusy(pte);
 			return result;
 		}
 
-		/* Acquire the address space lock again */
-		lock_acquire(as->as_lock);
+		/* Acquire the page table entry lock again */
+		pte_lock(pte);
 
 		/* Get the physical address from the page table entry */
-		paddr = (paddr_t)((pgtable[index] & PG_FRAME) << 12);
+		paddr = (paddr_t)((*pte & PG_FRAME) << 12);
 		
-	} else if (pgtable[index] == 0) {
+	} else if (*pte == 0) {
 
 		/* If the page table entry is 0, then we need to request a new
-		 * physical page.  We first mark the page table entry as being valid,
-		 * dirty, and busy. We then release the address space lock and
-		 * call coremap_getpage to get a new page.*/
+		 * physical page.  We first mark the page table entry as being
+		 * valid and busy, and also dirty if this is a write. We then
+		 * release the page table entry lock and call coremap_getpage
+		 * to get a new page.*/
+
+		*pte = PG_VALID | PG_BUSY;
+		if (faulttype != VM_FAULT_READ) {
+			*pte |= PG_DIRTY;
+		}
 
-		pgtable[index] = PG_VALID | PG_DIRTY | PG_BUSY;
+		pte_unlock(pte);
+
+		/* Work out where the contents of the page come from.  A page of
+		 * a memory mapping holds the mapped file, or is anonymous.
+		 * Otherwise, whatever of the page lies in the file data of a
+		 * loaded segment comes from the executable, and a page with
+		 * none of it is anonymous.  Text pages which are being read,
+		 * and pages of mapped files, are shared with other processes
+		 * through the page cache; a write to a private mapping gets
+		 * its own copy straight away.  Page cache pages are mapped
+		 * copy-on-write, except in a shared mapping, whose writes
+		 * must reach the page everyone else sees. */
+		if (m != NULL) {
+			vn = m->am_vn;
+			foffset = m->am_offset +
+			(off_t)(faultaddress - m->am_vbase);
+			anon = vn == NULL;
+			cached = !anon &&
+			(m->am_shared || faulttype == VM_FAULT_READ);
+			cow = !m->am_shared;
+		} else {
+			vn = as->as_vn;
+			anon = !vm_hasfiledata(as, faultaddress);
+			cached = faulttype == VM_FAULT_READ &&
+			vm_textoffset(as, faultaddress, &foffset);
+			cow = true;
+		}
 
-		lock_release(as->as_lock);
+		/* An anonymous page is all zeros.  Until it is first written,
+		 * reading it can just as well map the shared zero page,
+		 * copy-on-write. */
+		if (anon && faulttype == VM_FAULT_READ) {
+			vmstat_inc(VMS_ZEROFILL);
+			paddr = coremap->c_zeropage;
+			*pte &= ~PG_FRAME;
+			*pte |= PG_COW | (int)(paddr >> 12);
+			pte_lock(pte);
+			goto mapped;
+		}
+
+retry:
+		/* The page may already be in the page cache, if another
+		 * process is running the same executable or mapping the same
+		 * file */
+		if (cached && pagecache_map(vn, foffset, pte, as)) {
+			paddr = (paddr_t)((*pte & PG_FRAME) << 12);
+			if (cow) {
+				*pte |= PG_COW;
+			}
+			pte_lock(pte);
+			goto mapped;
+		}
 
-		result = coremap_getpage(&pgtable[index], as);
+		/* An anonymous page comes zeroed, most likely by the idle
+		 * loop */
+		result = coremap_getpage(pte, as, anon);
 		if (result) {
-			pgtable[index] = 0;
+			*pte = PG_BUSY;
+			pte_clearbusy(pte);
 			return result;
 		}
+		if (anon) {
+			vmstat_inc(VMS_ZEROFILL);
+		}
 
-		/* Re-acquire the address space lock */
-		lock_acquire(as->as_lock);
-		
-		/* Get the physical address from the page table entry and zero
-		 * any data in the new page */
-		paddr = (paddr_t)((pgtable[index] & PG_FRAME) << 12);
-		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		/* Get the physical address from the page table entry and fill
+		 * in the new page from the file.  The entry is still busy, so
+		 * nobody else touches the page while we do. */
+		paddr = (paddr_t)((*pte & PG_FRAME) << 12);
+		if (!anon) {
+			if (m != NULL) {
+				result = vm_readpage(vn, foffset, paddr);
+			} else {
+				result = vm_fillpage(as, faultaddress, paddr);
+			}
+			if (result) {
+				coremap_freepage(paddr, pte);
+				*pte = PG_BUSY;
+				pte_clearbusy(pte);
+				return result;
+			}
+		}
+
+		if (cached) {
+			result = pagecache_insert(vn, foffset, paddr, pte, as);
+			if (result && !cow) {
+
+				/* A private copy will not do for a shared
+				 * mapping.  If someone else entered the page
+				 * first, map theirs. */
+				coremap_freepage(paddr, pte);
+				if (result != EEXIST) {
+					*pte = PG_BUSY;
+					pte_clearbusy(pte);
+					return result;
+				}
+				thread_yield();
+				goto retry;
+			}
+			if (cow) {
+				*pte |= PG_COW;
+			}
+		}
+
+		/* Re-acquire the page table entry lock */
+		pte_lock(pte);
 
 	} else {
 		panic("vm_fault should not get to here!\n");
 	}
 	
+mapped:
 	/* make sure the physical address is page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+	/* Record the access for the page replacement algorithm */
+	coremap_touchpage(paddr);
+
+	/* Disable interrupts on this CPU while frobbing the TLB, so that we
+	 * cannot be switched to another CPU (and possibly another ASID) in
+	 * the middle. */
 	spl = splhigh();
 
-	/* Randomly select a place in the TLB to add a new TLB entry */
-	tlb_index = random() % NUM_TLB;
-	ehi = faultaddress;
+	ehi = faultaddress | (as->as_asid << TLBHI_PIDSHIFT);
 
-	/* In our implementation, TLB entries are always marked as dirty */
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	/* Clean pages and pages shared copy-on-write are mapped read-only so
+	 * that the first write traps.  Only dirty private pages are mapped
+	 * writable. */
+	elo = paddr | TLBLO_VALID;
+	if ((*pte & PG_DIRTY) && !(*pte & PG_COW)) {
+		elo |= TLBLO_DIRTY;
+	}
 
 	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
 
-	/* Add a new TLB entry */
-	tlb_write(ehi, elo, tlb_index);
+	/* Add a new TLB entry, replacing any old one for faultaddress (a write
+	 * to a read-only mapping) */
+	vmtlb_load(ehi, elo);
+	vmstat_inc(VMS_TLBREFILL);
 
 	splx(spl);
 
-	if (pgtable[index] & PG_BUSY) {
+	busy = (*pte & PG_BUSY) != 0;
+
+	/* Release the page table entry lock */
+	pte_unlock(pte);
+
+	if (busy) {
 
 		/* If the page table entry was marked as busy, mark it as no
-		 * longer being busy */
-		pgtable[index] &= ~PG_BUSY;
+		 * longer being busy and wake up anyone waiting on it */
+		pte_clearbusy(pte);
 	}
 
-	/* Release the address space lock */
-	lock_release(as->as_lock);
+	if (sw_slot >= 0) {
+		sw_freeslot((unsigned)sw_slot);
+	}
 
 	return 0;
 }
@@ -416,207 +987,272 @@ as_create(void)
 		return NULL;
 	}
 
-	/* Create the address space lock */
-	as->as_lock = lock_create("as lock");
-	if (as->as_lock == NULL) {
+	/* Create the page directory.  No leaf page tables exist yet. */
+	as->as_pgdir = kmalloc(PT_NDIRENTRIES * sizeof(int *));
+	if (as->as_pgdir == NULL) {
+		kfree(as);
 		return NULL;
 	}
+	for (unsigned i=0; i<PT_NDIRENTRIES; i++) {
+		as->as_pgdir[i] = NULL;
+	}
+	spinlock_init(&as->as_pgdirlock);
+
+	/* Initialize the rest of the address space fields.  Except for the
+	 * stackptr, all of the fields are either NULL or 0 */
+	as->as_vbase1 = 0;
+	as->as_npages1 = 0;
+	as->as_vbase2 = 0;
+	as->as_npages2 = 0;
+	as->as_vn = NULL;
+	as->as_fvaddr1 = 0;
+	as->as_foffset1 = 0;
+	as->as_filesz1 = 0;
+	as->as_fvaddr2 = 0;
+	as->as_foffset2 = 0;
+	as->as_filesz2 = 0;
+	as->as_readonly1 = false;
+	as->as_readonly2 = false;
+	as->as_stackptr = USERSTACK;
+	as->as_heaptop = 0;
+	as->as_mappings = NULL;
+	as->as_cpumask = 0;
+	spinlock_init(&as->as_cpulock);
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+
+	/* Return the new address space */ 
+	return as;
+}
+
+/*
+ * as_getpte
+ *
+ * Returns in *ret a pointer to the page table entry for vaddr.  If the leaf
+ * page table covering vaddr does not exist yet, it is created if create is
+ * set; otherwise *ret is NULL.  The pointer stays valid until the address
+ * space is destroyed.
+ */
+int
+as_getpte(struct addrspace *as, vaddr_t vaddr, bool create, int **ret)
+{
+	unsigned dirindex;
+	int *leaf;
+	int *newleaf;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	dirindex = PT_DIRINDEX(vaddr);
+
+	spinlock_acquire(&as->as_pgdirlock);
+	leaf = as->as_pgdir[dirindex];
+	spinlock_release(&as->as_pgdirlock);
+
+	if (leaf == NULL) {
+
+		if (!create) {
+			*ret = NULL;
+			return 0;
+		}
+
+		/* Allocate the leaf page table without holding the page
+		 * directory lock, since kmalloc may have to wait for the page
+		 * daemon to free up memory */
+		newleaf = kmalloc(PAGE_SIZE);
+		if (newleaf == NULL) {
+			return ENOMEM;
+		}
+		bzero(newleaf, PAGE_SIZE);
+
+		/* Someone else may have created the leaf page table in the
+		 * meantime, in which case we use theirs */
+		spinlock_acquire(&as->as_pgdirlock);
+		leaf = as->as_pgdir[dirindex];
+		if (leaf == NULL) {
+			as->as_pgdir[dirindex] = newleaf;
+			leaf = newleaf;
+			newleaf = NULL;
+		}
+		spinlock_release(&as->as_pgdirlock);
+
+		if (newleaf != NULL) {
+			kfree(newleaf);
+		}
+	}
+
+	*ret = &leaf[PT_LEAFINDEX(vaddr)];
+	return 0;
+}
+
+/*
+ * as_writeback
+ *
+ * Writes the page at vaddr, whose page table entry is pte, back to the file
+ * if it belongs to the shared file mapping m and has been written to.  The
+ * caller must have marked pte as busy.
+ */
+static
+int
+as_writeback(struct as_mapping *m, vaddr_t vaddr, int *pte)
+{
+	KASSERT(*pte & PG_BUSY);
 
-	/* Create the address space conditional variable */
-	as->as_cv = cv_create("as cv");
-	if (as->as_cv == NULL) {
-		return NULL;
+	if (!m->am_shared || m->am_vn == NULL ||
+	(*pte & (PG_VALID | PG_DIRTY)) != (PG_VALID | PG_DIRTY)) {
+		return 0;
 	}
 
-	/* Initialize the rest of the address space fields.  Except for the
-	 * stackptr, all of the fields are either NULL or 0 */
-	as->as_pgtable1 = NULL;
-	as->as_vbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_pgtable2 = NULL;
-	as->as_vbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_stackpgtable = NULL;
-	as->as_stackptr = USERSTACK;
-	as->as_heappgtable = NULL;
-	as->as_heaptop = 0;
-	as->as_heapsz = MIN_HEAPSZ;
-
-	/* Return the new address space */ 
-	return as;
+	return pagecache_writepage(m->am_vn,
+				   m->am_offset + (off_t)(vaddr - m->am_vbase),
+				   (paddr_t)((*pte & PG_FRAME) << 12));
 }
 
 /*
- * as_destroyregion
+ * as_freepte
  *
- * Destroys the page table for a given address region
+ * Frees the page or the offset location in the swap file that a page table
+ * entry refers to
  */
+static
 void
-as_destroyregion(struct addrspace *as, int as_regiontype)
+as_freepte(int *pte)
 {
-	KASSERT(as != NULL);
-
-	int *pgtable;
-	int npages;
-	int c_index;
 	unsigned sw_offset;
 
-	/* Select the page table to destroy based on as_regiontype */
+	/* Wait until the page table entry is no longer marked as busy, then
+	 * mark it as being busy ourselves.  Nobody else can be waiting for it
+	 * once we have it, as the address space is going away. */
+	pte_setbusy(pte);
 
-	switch (as_regiontype) {
-		case AS_REGION1:
-			pgtable = as->as_pgtable1;
-			npages = (int)(as->as_npages1);
-			break;
-		case AS_REGION2:
-			pgtable = as->as_pgtable2;
-			npages = (int)(as->as_npages2);
-			break;
-		case AS_HEAP:
-			pgtable = as->as_heappgtable;
-			npages = (int)(as->as_heapsz);
-			break;
-		case AS_STACK:
-			pgtable = as->as_stackpgtable;
-			npages = NSTACKPAGES;
-			break;
-		default:
-			panic("Address region unsupported\n");
-	}
+	if (*pte & PG_VALID) {
 
-	if (pgtable == NULL) {
+		/* If the page table entry is valid, we must drop our reference
+		 * to the user page.  The page is freed once no other address
+		 * space shares it copy-on-write. */
 
-		/* If there is no page table, do nothing */
-		
-		return;
-	}
+		coremap_freepage((paddr_t)((*pte & PG_FRAME) << 12), pte);
 
-	for (int i=0; i<npages; i++) {
+	} else if (*pte & PG_SWAP) {
 
-		/* Go through the page table entries and either free pages or
-		 * free the page contents in the swap file */
+		/* If the page table entry is marked as swap, we simply mark the
+		 * offset location in the swap file as free */
 
-		if (pgtable[i] == 0) {
+		sw_offset = (unsigned)(*pte & PG_FRAME);
+		sw_freeslot(sw_offset);
 
-			/* If the page table entry is zero, examine the next
-			 * page table entry */
+	} else {
 
-			continue;
+		/* The page was evicted clean while we waited, and nothing
+		 * is left to free */
+		KASSERT(*pte == PG_BUSY);
+	}
 
-		} else {
+	*pte = 0;
+}
+
+/*
+ * as_destroy
+ *
+ * Destroys the address space
+ */
+void
+as_destroy(struct addrspace *as) {
 
-			/* Acquire the address space lock */
-			lock_acquire(as->as_lock);
+	int *leaf;
+	int *pte;
+	int result;
+	vaddr_t vaddr;
+	struct as_mapping *m;
 
-			/* Wait until the page table entry is no longer marked
-			 * as busy */
-			while (pgtable[i] & PG_BUSY) {
-				cv_wait(as->as_cv, as->as_lock);
+	/* Write back the dirty pages of shared file mappings before they are
+	 * freed below.  Nobody is left to report an error to. */
+	for (m = as->as_mappings; m != NULL; m = m->am_next) {
+		if (!m->am_shared || m->am_vn == NULL) {
+			continue;
+		}
+		for (unsigned long i=0; i<m->am_npages; i++) {
+			vaddr = m->am_vbase + i * PAGE_SIZE;
+			result = as_getpte(as, vaddr, false, &pte);
+			KASSERT(result == 0);
+			if (pte == NULL) {
+				continue;
 			}
+			pte_setbusy(pte);
+			(void)as_writeback(m, vaddr, pte);
+			pte_clearbusy(pte);
+		}
+	}
 
-			/* Mark the page table entry as being busy */
-			pgtable[i] |= PG_BUSY;
-
-			/* Release the address space lock */
-			lock_release(as->as_lock);
-
-			/* Acquire the coremap spinlock */
-			spinlock_acquire(&coremap->c_spinlock);
-
-			if (pgtable[i] & PG_VALID) {
-
-				/* If the page table entry is valid, we must
-				 * free the user page */
-				
-				c_index = (int)(((pgtable[i] & PG_FRAME) << 12)
-				/ PAGE_SIZE);
-
-				/* There is a possibility that a page daemon or
-				 * some other process is attempting to evict the
-				 * page.  We must wait until that is no longer
-				 * the case. Once we acquire the spinlock and
-				 * the coremap entry is no longer marked as
-				 * busy, nothing can swap out the page. */
-				while (coremap->c_entries[c_index].ce_busy) {
-					spinlock_release(&coremap->c_spinlock);
-					thread_yield();
-					spinlock_acquire(&coremap->c_spinlock);
-				}
+	/* Free every page in use, then the leaf page tables and the page
+	 * directory */
+	for (unsigned i=0; i<PT_NDIRENTRIES; i++) {
+		leaf = as->as_pgdir[i];
+		if (leaf == NULL) {
+			continue;
+		}
 
-				/* Check that we have the right coremap entry */
-				KASSERT((paddr_t)((*coremap->c_entries[c_index].ce_pgentry
-				& PG_FRAME) << 12) ==
-				(paddr_t)(c_index*PAGE_SIZE));
-
-				/* Check that the page table entry is no longer
-				 * marked as busy */
-				KASSERT(!coremap->c_entries[c_index].ce_busy);
-
-				/* Free the physical page */
-				coremap->c_entries[c_index].ce_addrspace = NULL;
-				coremap->c_entries[c_index].ce_allocated =
-				false;
-				coremap->c_entries[c_index].ce_foruser = true;
-				coremap->c_entries[c_index].ce_next = 0;
-				coremap->c_entries[c_index].ce_pgentry = NULL;
-				coremap->c_entries[c_index].ce_swapoffset = -1;
-
-				/* Release the coremap spinlock */
-				spinlock_release(&coremap->c_spinlock);
-
-			} else if (pgtable[i] & PG_SWAP) {
-			
-				/* If the page table entry is marked as swap, we
-				 * simply mark the offset location in the swap
-				 * file as free */
-
-				spinlock_release(&coremap->c_spinlock);	
-				sw_offset = (unsigned)(pgtable[i] & PG_FRAME);
-				lock_acquire(kswap->sw_disklock);
-				bitmap_unmark(kswap->sw_diskoffset, sw_offset);
-				lock_release(kswap->sw_disklock);
-			
-			} else {
-				panic("as_destroy should not get to here\n");
+		for (unsigned j=0; j<PT_NLEAFENTRIES; j++) {
+			if (leaf[j] != 0) {
+				as_freepte(&leaf[j]);
 			}
-
 		}
 
+		as->as_pgdir[i] = NULL;
+		kfree(leaf);
+	}
+	kfree(as->as_pgdir);
+
+	/* Drop our reference to the executable */
+	if (as->as_vn != NULL) {
+		VOP_DECREF(as->as_vn);
+	}
+
+	/* Free the memory mappings and drop their references to the mapped
+	 * files */
+	while ((m = as->as_mappings) != NULL) {
+		as->as_mappings = m->am_next;
+		if (m->am_vn != NULL) {
+			VOP_DECREF(m->am_vn);
+		}
+		kfree(m);
 	}
+
+	spinlock_cleanup(&as->as_pgdirlock);
+	spinlock_cleanup(&as->as_cpulock);
+
+	/* Free the address space */
+	kfree(as);
 }
+
 /*
- * as_destroy
+ * as_retireasid
  *
- * Destroys the address space
+ * Makes the ASID of an address space stale, so that it gets a fresh one the
+ * next time it is activated.  Since ASIDs are not reused within a
+ * generation, this disposes of all of its TLB entries on every CPU at once.
  */
+static
 void
-as_destroy(struct addrspace *as) {
-	
-	/*Destroy the page tables for all address regions */
-	as_destroyregion(as, AS_REGION1);
-	as_destroyregion(as, AS_REGION2);
-	as_destroyregion(as, AS_HEAP);
-	as_destroyregion(as, AS_STACK);
-	
-	/* Destroy the address space lock */
-	lock_destroy(as->as_lock);
-	
-	/* Destroy the address space cv */
-	cv_destroy(as->as_cv);
-
-	/* Free the address space */
-	kfree(as);
+as_retireasid(struct addrspace *as)
+{
+	spinlock_acquire(&asid_lock);
+	as->as_asidgen = 0;
+	spinlock_release(&asid_lock);
 }
 
 /*
  * as_activate
  *
- * Activates the address space
+ * Activates the address space.  The TLB is not flushed: entries are tagged
+ * with the ASID of their address space, so we only need to load ours into
+ * the processor.
  */
 void
 as_activate(void)
 {
-	int i, spl;
+	int spl;
+	unsigned asid;
+	uint32_t gen;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -627,13 +1263,36 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-
-		/* Invalidate the TLB entry */
-
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	/* From now on this CPU may hold TLB entries for the address space, so
+	 * it must be included in TLB shootdowns for it */
+	spinlock_acquire(&as->as_cpulock);
+	as->as_cpumask |= (uint32_t)1 << curcpu->c_number;
+	spinlock_release(&as->as_cpulock);
+
+	/* Assign a new ASID if ours is from an old generation, starting a new
+	 * generation if they have all been used */
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_ASID) {
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+	}
+	asid = as->as_asid;
+	gen = asid_generation;
+	spinlock_release(&asid_lock);
+
+	/* If our TLB still holds entries from an older generation, their
+	 * ASIDs may now belong to someone else */
+	if (asid_cpugen[curcpu->c_number] != gen) {
+		vm_tlbshootdown_all();
+		asid_cpugen[curcpu->c_number] = gen;
 	}
 
+	tlb_setasid(asid);
+
 	splx(spl);
 }
 
@@ -663,9 +1322,10 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
-	/* We don't use these - all pages are read-write */
+	/* We don't use these - all pages are read-write.  Pages of a region
+	 * which is not writeable are shared with other processes through the
+	 * page cache, though, and get copied if they are written to. */
 	(void)readable;
-	(void)writeable;
 	(void)executable;
 
 	if (as->as_vbase1 == 0) {
@@ -674,6 +1334,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 		as->as_vbase1 = vaddr;
 		as->as_npages1 = npages;
+		as->as_readonly1 = !writeable;
 		return 0;
 	} 
 	
@@ -683,6 +1344,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 		as->as_vbase2 = vaddr;
 		as->as_npages2 = npages;
+		as->as_readonly2 = !writeable;
 		as->as_heaptop = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
 		return 0;
 	}
@@ -691,41 +1353,57 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 }
 
 /*
- * as_prepare_load
+ * as_define_filedata
  *
- * Called before actually loading from an executable into the address space
+ * Records that the filesz bytes at file offset offset in the executable v
+ * belong at virtual address vaddr, within a region already defined with
+ * as_define_region.  Nothing is read here; vm_fault reads each page from the
+ * file when it is first touched.
  */
 int
-as_prepare_load(struct addrspace *as)
+as_define_filedata(struct addrspace *as, struct vnode *v, off_t offset,
+		   vaddr_t vaddr, size_t filesz)
 {
-
-	/* Create the page table for address region 1 */
-	as->as_pgtable1 = kmalloc(as->as_npages1 * sizeof(int));
-	if (as->as_pgtable1 == NULL) {
-		as_destroy(as);
-		return ENOMEM;
+	vaddr_t vtop1, vtop2;
+
+	vtop1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	vtop2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+
+	if (vaddr >= as->as_vbase1 && vaddr + filesz <= vtop1) {
+		as->as_fvaddr1 = vaddr;
+		as->as_foffset1 = offset;
+		as->as_filesz1 = filesz;
+	} else if (vaddr >= as->as_vbase2 && vaddr + filesz <= vtop2) {
+		as->as_fvaddr2 = vaddr;
+		as->as_foffset2 = offset;
+		as->as_filesz2 = filesz;
+	} else {
+		return EFAULT;
 	}
 
-	/* Initialize the page table entries for the address region 1 page table
-	 */
-	for (unsigned long i=0; i<as->as_npages1; i++) {
-		as->as_pgtable1[i] = 0;
+	/* Hold a reference to the executable for as long as its pages may
+	 * still have to be read */
+	if (as->as_vn == NULL) {
+		VOP_INCREF(v);
+		as->as_vn = v;
 	}
+	KASSERT(as->as_vn == v);
 
-	/* Create the page table for address region 2 */
-	as->as_pgtable2 = kmalloc(as->as_npages2 * sizeof(int));
-	if (as->as_pgtable2 == NULL) {
-		as_destroy(as);
-		return ENOMEM;
-	}
+	return 0;
+}
 
-	/* Initialize the page table entries for the address region 2 page table
-	 */
-	for (unsigned long i=0; i<as->as_npages2; i++) {
-		as->as_pgtable2[i] = 0;
-	}
-	
-	return 0;	
+/*
+ * as_prepare_load
+ *
+ * Called before actually loading from an executable into the address space.
+ * Leaf page tables are created as the pages are touched, so there is nothing
+ * to do.
+ */
+int
+as_prepare_load(struct addrspace *as)
+{
+	(void)as;
+	return 0;
 }
 
 /*
@@ -744,407 +1422,436 @@ as_complete_load(struct addrspace *as)
 /*
  * as_define_stack
  *
- * Defines the stack region in the address space
+ * Defines the stack region in the address space.  The stack grows on demand,
+ * so we only hand back the initial stack pointer.
  */
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
 	*stackptr = as->as_stackptr;
 
-	/* Create the stack page table */
-	as->as_stackpgtable = kmalloc(NSTACKPAGES * sizeof(int));
-	if (as->as_stackpgtable == NULL) {
-		as_destroy(as);
-		return ENOMEM;
-	}
+	return 0;
+}
 
-	/* Initialize the page table entries in the stack page table */
-	for (unsigned long i=0; i<NSTACKPAGES; i++) {
-		as->as_stackpgtable[i] = 0;
+/*
+ * as_heaplimit
+ *
+ * Returns the address the heap may not grow past: the lowest memory mapping,
+ * or the stack if there are none
+ */
+vaddr_t
+as_heaplimit(struct addrspace *as)
+{
+	vaddr_t limit;
+	struct as_mapping *m;
+
+	limit = as->as_stackptr;
+	for (m = as->as_mappings; m != NULL; m = m->am_next) {
+		if (m->am_vbase < limit) {
+			limit = m->am_vbase;
+		}
 	}
 
-	return 0;
+	return limit;
 }
 
 /*
- * as_growheap
+ * as_mmap
  *
- * Doubles the size of the heap region
+ * Adds a memory mapping of len bytes to the address space and returns its
+ * address in *ret.  The mapping holds the file vn from file offset offset on,
+ * or zero-filled memory if vn is NULL; prot and flags are as for mmap, and
+ * have been checked by the caller.  Nothing is mapped yet: vm_fault brings
+ * the pages in as they are touched.
+ *
+ * Mappings are placed as high as possible below the room kept for the stack,
+ * in the highest gap big enough, so that the heap has as much room to grow
+ * as we can give it.
  */
 int
-as_growheap(struct addrspace *as) {
+as_mmap(struct addrspace *as, size_t len, int prot, int flags,
+	struct vnode *vn, off_t offset, vaddr_t *ret)
+{
+	struct as_mapping *newm;
+	struct as_mapping **mp;
+	vaddr_t top, bottom, mtop;
+	size_t sz;
 
-	int *heap_temp;
-	int c_index;
-	paddr_t paddr;
+	if (len == 0 || len > USERSTACK) {
+		return EINVAL;
+	}
+	sz = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	/* The mapping may go anywhere between the end of the heap and the
+	 * room kept for the stack, unless the stack has already grown below
+	 * that */
+	top = USERSTACK - AS_STACKSIZE;
+	if (top > (as->as_stackptr & PAGE_FRAME)) {
+		top = as->as_stackptr & PAGE_FRAME;
+	}
+	bottom = (as->as_heaptop + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (bottom < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		bottom = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	}
 
-	/* Create heap_temp which is double the size of the current heap page
-	 * table */
-	heap_temp = kmalloc(2*as->as_heapsz*sizeof(int));
-	if (heap_temp == NULL) {
+	/* Walk down the existing mappings looking for a gap above one of them
+	 * which is big enough.  If there is none, the mapping goes below the
+	 * lowest of them. */
+	for (mp = &as->as_mappings; *mp != NULL; mp = &(*mp)->am_next) {
+		mtop = (*mp)->am_vbase + (*mp)->am_npages * PAGE_SIZE;
+		if (mtop <= top && top - mtop >= sz) {
+			break;
+		}
+		if ((*mp)->am_vbase < top) {
+			top = (*mp)->am_vbase;
+		}
+	}
+	if (*mp == NULL && (top < bottom || top - bottom < sz)) {
 		return ENOMEM;
 	}
 
-	/* Initialize the page table entries in heap_temp */
-	for (int i=0; i<2*as->as_heapsz; i++) {
-		heap_temp[i] = 0;
+	newm = kmalloc(sizeof(struct as_mapping));
+	if (newm == NULL) {
+		return ENOMEM;
+	}
+	newm->am_vbase = top - sz;
+	newm->am_npages = sz / PAGE_SIZE;
+	newm->am_prot = prot;
+	newm->am_shared = (flags & MAP_SHARED) != 0;
+	newm->am_vn = vn;
+	newm->am_offset = offset;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
 	}
 
-	/* Copy the current heap page table over to heap_temp */ 
+	newm->am_next = *mp;
+	*mp = newm;
 
-	for (int i=0; i<as->as_heapsz; i++) {
+	*ret = newm->am_vbase;
+	return 0;
+}
 
-		/* Acquire the address space lock */
-		lock_acquire(as->as_lock);
+/*
+ * as_unmaprange
+ *
+ * Unmaps the pages from start up to end, which lie in the memory mapping m.
+ * Dirty pages of a shared file mapping are written back to the file first.
+ * We work on batches of up to TLBSHOOTDOWN_MAX pages, as sys_sbrk does, so
+ * that the TLB entries of a whole batch can be invalidated at once.
+ */
+static
+void
+as_unmaprange(struct addrspace *as, struct as_mapping *m, vaddr_t start,
+	      vaddr_t end)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	int *batch[TLBSHOOTDOWN_MAX];
+	vaddr_t batch_vaddr[TLBSHOOTDOWN_MAX];
+	unsigned nbatch;
+	unsigned nts;
+	vaddr_t vaddr;
+	int *pte;
+	int result;
 
-		/* Wait until the page table entry is no longer marked as busy
-		 */
-		while (as->as_heappgtable[i] & PG_BUSY) {
-			cv_wait(as->as_cv, as->as_lock);
+	vaddr = start;
+	while (vaddr < end) {
+
+		/* Mark the page table entries in the batch as busy.  Pages
+		 * whose leaf page table was never created were never
+		 * touched. */
+		nbatch = 0;
+		while (vaddr < end && nbatch < TLBSHOOTDOWN_MAX) {
+			result = as_getpte(as, vaddr, false, &pte);
+			KASSERT(result == 0);
+
+			if (pte != NULL) {
+				pte_setbusy(pte);
+				batch_vaddr[nbatch] = vaddr;
+				batch[nbatch++] = pte;
+			}
+			vaddr += PAGE_SIZE;
 		}
 
-		/* Mark the page table entry as being busy */
-		as->as_heappgtable[i] |= PG_BUSY;
-
-		/* Release the address space lock */
-		lock_release(as->as_lock);
-		
-		if (as->as_heappgtable[i] & PG_VALID) {
-
-			/* If the page table entry is marked as valid, copy the
-			 * page table entry contents from the current heap page
-			 * table to heap_temp.  Also, make sure
-			 * that ce_pgentry of the corresponding coremap entry is
-			 * pointing to the page table entry in heap_temp */
-
-			paddr = (paddr_t)((as->as_heappgtable[i]
-			& PG_FRAME) << 12);
-			c_index = (int)(paddr/PAGE_SIZE);
-			spinlock_acquire(&coremap->c_spinlock);
-			KASSERT(coremap->c_entries[c_index].ce_addrspace
-			== as);
-			KASSERT(coremap->c_entries[c_index].ce_pgentry
-			== &as->as_heappgtable[i]);
-			memcpy(&heap_temp[i],
-			&as->as_heappgtable[i], sizeof(int));
-			coremap->c_entries[c_index].ce_pgentry =
-			&heap_temp[i];
-			spinlock_release(&coremap->c_spinlock);
-				
-		} else if (as->as_heappgtable[i] & PG_SWAP) {
-
-			/* If the page table entry is marked as swap, just copy
-			 * the page table entry contents from the current heap
-			 * page table to heap_temp */
-
-			memcpy(&heap_temp[i],
-			&as->as_heappgtable[i], sizeof(int));
-
-		} else {
-			KASSERT(as->as_heappgtable[i] == PG_BUSY);
+		/* Nothing may write to the pages once we start writing them
+		 * back, so their TLB entries go first */
+		nts = 0;
+		for (unsigned i=0; i<nbatch; i++) {
+			if (*batch[i] & PG_VALID) {
+				ts[nts].ts_vaddr = batch_vaddr[i];
+				ts[nts].ts_asid = as->as_asid;
+				ts[nts].ts_paddr = (*batch[i] & PG_FRAME) << 12;
+				nts++;
+			}
 		}
+		as_tlbshootdown(as, ts, nts);
 
-		/* Because we marked the page table entry of the original heap
-		 * page table as being busy and copied the entry contents over
-		 * to heap_temp, we must now mark the page table entry in
-		 * heap_temp as no longer busy */
-		heap_temp[i] &= ~PG_BUSY;
+		for (unsigned i=0; i<nbatch; i++) {
+			pte = batch[i];
 
-		/* We acquire the address space lock, mark the page table entry
-		 * in the original heap page table as no longer being busy, and
-		 * release the address space lock */
+			/* munmap has no way to report that a page could not
+			 * be written back; its changes are lost, as they would
+			 * be if it failed on eviction */
+			(void)as_writeback(m, batch_vaddr[i], pte);
 
-		lock_acquire(as->as_lock);
-		as->as_heappgtable[i] &= ~PG_BUSY;
-		cv_signal(as->as_cv, as->as_lock);
-		lock_release(as->as_lock);
+			if (*pte & PG_VALID) {
+				coremap_freepage((paddr_t)((*pte & PG_FRAME) << 12),
+						 pte);
+			} else if (*pte & PG_SWAP) {
+				sw_freeslot((unsigned)(*pte & PG_FRAME));
+			} else {
+				KASSERT(*pte == PG_BUSY);
+			}
 
+			/* Set the page table entry to 0 and wake up anyone
+			 * who faulted on it in the meantime */
+			*pte = PG_BUSY;
+			pte_clearbusy(pte);
+		}
 	}
-
-	/* Free the original heap page table */
-	kfree(as->as_heappgtable);
-	
-	/* Set heap_temp as the new heap page table */
-	as->as_heappgtable = heap_temp;
-
-	/* Indicate that the size of the heap page table is now doubled */
-	as->as_heapsz *= 2;
-
-	return 0;
 }
 
 /*
- * as_shrinkheap
+ * as_munmap
  *
- * Decreases the size of the heap page table by half.  Works similarly to
- * as_growheap.
+ * Removes the memory mappings of the pages from vaddr up to vaddr + len.
+ * Mappings partly in the range are trimmed, or split in two if the range
+ * lies in the middle of one.  Pages in the range which are not in a memory
+ * mapping are left alone.
  */
 int
-as_shrinkheap(struct addrspace *as) {
-
-	int *heap_temp;
-	int c_index;
-	paddr_t paddr;
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct as_mapping *m;
+	struct as_mapping **mp;
+	struct as_mapping *split;
+	vaddr_t start, end, mstart, mend;
 
-	if (as->as_heapsz == MIN_HEAPSZ) {
-		return 0;
+	if (vaddr % PAGE_SIZE != 0 || len == 0 || vaddr >= USERSPACETOP ||
+	len > USERSPACETOP - vaddr) {
+		return EINVAL;
 	}
+	start = vaddr;
+	end = start + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
 
-	heap_temp = kmalloc(as->as_heapsz/2*sizeof(int));
-	if (heap_temp == NULL) {
+	/* Allocate the second half of a split mapping up front, so that
+	 * nothing can fail once we have started unmapping pages */
+	split = kmalloc(sizeof(struct as_mapping));
+	if (split == NULL) {
 		return ENOMEM;
 	}
 
-	for (int i=0; i<as->as_heapsz/2; i++) {
-		heap_temp[i] = 0;
-	}
+	mp = &as->as_mappings;
+	while ((m = *mp) != NULL) {
+		mstart = m->am_vbase;
+		mend = mstart + m->am_npages * PAGE_SIZE;
+		if (mend <= start || mstart >= end) {
+			mp = &m->am_next;
+			continue;
+		}
 
-	for (int i=0; i<as->as_heapsz/2; i++) {
+		as_unmaprange(as, m, start > mstart ? start : mstart,
+			      end < mend ? end : mend);
 
-		lock_acquire(as->as_lock);
-		while (as->as_heappgtable[i] & PG_BUSY) {
-			cv_wait(as->as_cv, as->as_lock);
-		}
-		as->as_heappgtable[i] |= PG_BUSY;
-		lock_release(as->as_lock);
-		
-		if (as->as_heappgtable[i] & PG_VALID) {
-			paddr = (paddr_t)((as->as_heappgtable[i]
-			& PG_FRAME) << 12);
-			c_index = (int)(paddr/PAGE_SIZE);
-			spinlock_acquire(&coremap->c_spinlock);
-			KASSERT(coremap->c_entries[c_index].ce_addrspace
-			== as);
-			KASSERT(coremap->c_entries[c_index].ce_pgentry
-			== &as->as_heappgtable[i]);
-			memcpy(&heap_temp[i],
-			&as->as_heappgtable[i], sizeof(int));
-			coremap->c_entries[c_index].ce_pgentry =
-			&heap_temp[i];
-			spinlock_release(&coremap->c_spinlock);
-				
-		} else if (as->as_heappgtable[i] & PG_SWAP) {
-			memcpy(&heap_temp[i],
-			&as->as_heappgtable[i], sizeof(int));
+		if (start <= mstart && end >= mend) {
 
-		} else {
-			KASSERT(as->as_heappgtable[i] == PG_BUSY);
-		}
+			/* The whole mapping goes */
+			*mp = m->am_next;
+			if (m->am_vn != NULL) {
+				VOP_DECREF(m->am_vn);
+			}
+			kfree(m);
+
+		} else if (start > mstart && end < mend) {
+
+			/* The range is in the middle of the mapping.  The part
+			 * above it becomes a mapping of its own, which goes
+			 * before m in the list.  Nothing else can overlap the
+			 * range. */
+			*split = *m;
+			split->am_vbase = end;
+			split->am_npages = (mend - end) / PAGE_SIZE;
+			split->am_offset = m->am_offset + (off_t)(end - mstart);
+			split->am_next = m;
+			if (split->am_vn != NULL) {
+				VOP_INCREF(split->am_vn);
+			}
+			m->am_npages = (start - mstart) / PAGE_SIZE;
+			*mp = split;
+			split = NULL;
+			break;
 
-		heap_temp[i] &= ~PG_BUSY;
+		} else if (start <= mstart) {
 
-		lock_acquire(as->as_lock);
-		as->as_heappgtable[i] &= ~PG_BUSY;
-		cv_signal(as->as_cv, as->as_lock);
-		lock_release(as->as_lock);
+			/* The bottom of the mapping goes */
+			m->am_offset += (off_t)(end - mstart);
+			m->am_npages = (mend - end) / PAGE_SIZE;
+			m->am_vbase = end;
+			mp = &m->am_next;
+
+		} else {
+
+			/* The top of the mapping goes */
+			m->am_npages = (start - mstart) / PAGE_SIZE;
+			mp = &m->am_next;
+		}
+	}
 
+	if (split != NULL) {
+		kfree(split);
 	}
 
-	kfree(as->as_heappgtable);
-	as->as_heappgtable = heap_temp;
-	as->as_heapsz /= 2;
 	return 0;
 }
 
 /*
- * as_copyregion
+ * as_syncfile
  *
- * Copies the page table of a given address region
+ * Writes back the dirty pages of the shared mappings of the file vn in the
+ * address space, and marks them clean.  Their TLB entries go first, so that
+ * the next write marks them dirty again.  Returns the first error, after
+ * trying every page.
  */
 int
-as_copyregion(struct addrspace *old, struct addrspace *new, int as_regiontype) {
-	
-	int *old_pgtable;
-	int *new_pgtable;
-	int old_npages;
-	paddr_t old_paddr;
-	paddr_t new_paddr;
+as_syncfile(struct addrspace *as, struct vnode *vn)
+{
+	struct as_mapping *m;
+	struct tlbshootdown ts;
+	vaddr_t vaddr;
+	int *pte;
 	int result;
-	off_t sw_offset;
-	struct uio ku;
-	struct iovec iov;
-
-	/* Determine which page table needs to be copied and create a new page
-	 * table in the new address space */
-	switch (as_regiontype) {
-		case AS_REGION1:
-			old_pgtable = old->as_pgtable1;
-			old_npages = (int)(old->as_npages1);
+	int err;
 
-			new->as_pgtable1 = kmalloc(old_npages * sizeof(int));
-			if (new->as_pgtable1 == NULL) {
-				return ENOMEM;
-			}
-
-			new_pgtable = new->as_pgtable1;
-			break;
-		case AS_REGION2:
-			old_pgtable = old->as_pgtable2;
-			old_npages = (int)(old->as_npages2);
-
-			new->as_pgtable2 = kmalloc(old_npages * sizeof(int));
-			if (new->as_pgtable2 == NULL) {
-				return ENOMEM;
-			}
-
-			new_pgtable = new->as_pgtable2;
-			break;
-		case AS_HEAP:
-			old_pgtable = old->as_heappgtable;
-			old_npages = (int)(old->as_heapsz);
-
-			if (old_pgtable == NULL) {
+	err = 0;
 
-				/* If there is no heap page table in the old
-				 * address space, then we simply return 0 */
+	for (m = as->as_mappings; m != NULL; m = m->am_next) {
+		if (m->am_vn != vn || !m->am_shared) {
+			continue;
+		}
 
-				return 0;
+		for (unsigned long i=0; i<m->am_npages; i++) {
+			vaddr = m->am_vbase + i * PAGE_SIZE;
+			result = as_getpte(as, vaddr, false, &pte);
+			KASSERT(result == 0);
+			if (pte == NULL) {
+				continue;
 			}
 
-			new->as_heappgtable = kmalloc(old_npages * sizeof(int));
-			if (new->as_heappgtable == NULL) {
-				return ENOMEM;
-			}
+			pte_setbusy(pte);
 
-			new_pgtable = new->as_heappgtable;
-			break;
-		case AS_STACK:
-			old_pgtable = old->as_stackpgtable;
-			old_npages = NSTACKPAGES;
+			if ((*pte & (PG_VALID | PG_DIRTY)) ==
+			(PG_VALID | PG_DIRTY)) {
+				ts.ts_vaddr = vaddr;
+				ts.ts_asid = as->as_asid;
+				ts.ts_paddr = (*pte & PG_FRAME) << 12;
+				as_tlbshootdown(as, &ts, 1);
 
-			new->as_stackpgtable = kmalloc(old_npages * sizeof(int));
-			if (new->as_stackpgtable == NULL) {
-				return ENOMEM;
+				result = as_writeback(m, vaddr, pte);
+				if (result == 0) {
+					*pte &= ~PG_DIRTY;
+				} else if (err == 0) {
+					err = result;
+				}
 			}
 
-			new_pgtable = new->as_stackpgtable;
-			break;
-		default:
-			panic("Address region unsupported\n");
-	}
-
-	/* Initialize the page table in the new address space */
-	for (int i=0; i<old_npages; i++) {
-		new_pgtable[i] = 0;
+			pte_clearbusy(pte);
+		}
 	}
 
+	return err;
+}
 
-	/* Go through each page table entry in the old address space */
-	for (int i=0; i<old_npages; i++) {
+/*
+ * as_copypte
+ *
+ * Copies the page table entry old_pte of the old address space into new_pte.
+ * Resident pages are shared copy-on-write rather than copied, unless shared
+ * is set: the page belongs to a shared file mapping, and both address spaces
+ * keep writing to the same page.
+ */
+static
+int
+as_copypte(int *old_pte, struct addrspace *new, int *new_pte, bool shared)
+{
 
-		/* Acquire the old address space lock */
-		lock_acquire(old->as_lock);
+	paddr_t old_paddr;
+	paddr_t new_paddr;
+	int result;
+	unsigned sw_slot;
+	struct swapio *sio;
 
-		/* Wait until the old page table entry is no longer marked as busy
-		 */
-		while (old_pgtable[i] & PG_BUSY) {
-			cv_wait(old->as_cv, old->as_lock);
-		}
+	/* Wait until the old page table entry is no longer marked as busy,
+	 * then mark it as busy */
+	pte_setbusy(old_pte);
 
-		/* Mark the old page table entry as busy */
-		old_pgtable[i] |= PG_BUSY;
+	result = 0;
 
-		/* Release the old address space lock */
-		lock_release(old->as_lock);
+	if (*old_pte & PG_VALID) {
 
-		if (old_pgtable[i] & PG_VALID) {
+		/* If the old page table entry is marked as valid, the page is
+		 * shared copy-on-write between the two address spaces instead
+		 * of being copied.  Both page table entries are marked as
+		 * copy-on-write so that whichever process writes to the page
+		 * first gets its own copy. */
 
-			/* If the old page table entry is marked as valid, get a
-			 * new page for the new page table entry */
+		old_paddr = (paddr_t)((*old_pte & PG_FRAME) << 12);
+		result = coremap_sharepage(old_paddr, new_pte, new);
+		if (result) {
+			goto out;
+		}
 
-			old_paddr = (paddr_t)((old_pgtable[i] & PG_FRAME) << 12);
+		if (shared) {
+			/* The new address space has not written to the page
+			 * yet, and has nothing to write back */
+			*new_pte = *old_pte & ~(PG_BUSY | PG_DIRTY);
+		} else {
+			*old_pte |= PG_COW;
+			*new_pte = *old_pte & ~PG_BUSY;
+		}
 
-			/* Mark the new page table entry as being valid, busy,
-			 * and dirty.  We mark the new page table entry as being
-			 * busy so that the new page does not get evicted too soon. */
-			new_pgtable[i] = PG_VALID | PG_BUSY | PG_DIRTY;
+	} else if (*old_pte & PG_SWAP) {
 
-			/* Get a new page for the new page table entry */
-			result = coremap_getpage(&new_pgtable[i], new);
-			if (result) {
-				lock_acquire(old->as_lock);
-				old_pgtable[i] &= ~PG_BUSY;
-				cv_signal(old->as_cv, old->as_lock);
-				lock_release(old->as_lock);
-				as_destroy(new);
-				return result;
-			}
+		/* If the old page table entry is marked as swap, the contents
+		 * are in the swap file */
 
-			new_paddr = (paddr_t)((new_pgtable[i] & PG_FRAME) << 12);
-
-			/* Copy the contents of the old page into the new page
-			 */
-			memmove((void *)PADDR_TO_KVADDR(new_paddr), (const void
-			*)PADDR_TO_KVADDR(old_paddr), PAGE_SIZE);
-			
-			/* Acquire the new address space lock, mark the new page
-			 * table entry as not busy, and release the new address
-			 * space lock */
-			lock_acquire(new->as_lock);
-			new_pgtable[i] &= ~PG_BUSY;
-			lock_release(new->as_lock);
-			
-		} else if (old_pgtable[i] & PG_SWAP) {
-
-			/* If the old page table entry is marked as swap, the
-			 * contents are in the swap file */
-
-			/* Mark the new page table entry as being valid, busy,
-			 * and dirty.  We mark the new page table entry as being
-			 * busy so the new page does not get evicted too soon */
-			new_pgtable[i] = PG_VALID | PG_BUSY | PG_DIRTY;
-
-			/* Get a new page for the new page table entry */
-			result = coremap_getpage(&new_pgtable[i], new);
-			if (result) {
-				lock_acquire(old->as_lock);
-				old_pgtable[i] &= ~PG_BUSY;
-				cv_signal(old->as_cv, old->as_lock);
-				lock_release(old->as_lock);
-				as_destroy(new);
-				return result;
-			}
+		/* Mark the new page table entry as being valid, busy, and
+		 * dirty.  We mark the new page table entry as being busy so the
+		 * new page does not get evicted too soon */
+		*new_pte = PG_VALID | PG_BUSY | PG_DIRTY;
 
-			/* Get the address of the new physical page */
-			new_paddr = (paddr_t)((new_pgtable[i] & PG_FRAME) << 12);
+		/* Get a new page for the new page table entry */
+		result = coremap_getpage(new_pte, new, false);
+		if (result) {
+			*new_pte = 0;
+			goto out;
+		}
 
-			/* Get the offset location of the page data stored in
-			 * the swap file.  This information is contained in the
-			 * old page table entry. */
-			sw_offset = (off_t)((old_pgtable[i] & PG_FRAME) *
-			PAGE_SIZE);
+		/* Get the address of the new physical page */
+		new_paddr = (paddr_t)((*new_pte & PG_FRAME) << 12);
 
-			/* Read the contents of the data from the swap file to
-			 * the new physical page */
-			uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(new_paddr), PAGE_SIZE,
-			sw_offset, UIO_READ);
-			result = kswap->sw_vn->vn_ops->vop_read(kswap->sw_vn, &ku);
-			if (result) {
-				lock_acquire(old->as_lock);
-				old_pgtable[i] &= ~PG_BUSY;
-				cv_signal(old->as_cv, old->as_lock);
-				lock_release(old->as_lock);
-				as_destroy(new);
-				return result;
-			}
+		/* Get the swap slot holding the page data.  This information
+		 * is contained in the old page table entry. */
+		sw_slot = (unsigned)(*old_pte & PG_FRAME);
 
-			/* Mark the new page table entry as not busy */
-			lock_acquire(new->as_lock);
-			new_pgtable[i] &= ~PG_BUSY;
-			lock_release(new->as_lock);
-		
-		} else {
-			KASSERT(old_pgtable[i] == PG_BUSY);
-		}
+		/* Read the contents of the data from the swap file to the new
+		 * physical page through the swap I/O threads, like any other
+		 * page-in.  Even on failure, the page now belongs to the new
+		 * address space, which frees it when it is destroyed. */
+		sio = swapio_alloc(UIO_READ, sw_slot);
+		swapio_addpage(sio, new_paddr);
+		result = swapio_run(sio);
 
-		/* Mark the old page table entry as not being busy */ 
-		lock_acquire(old->as_lock);
-		old_pgtable[i] &= ~PG_BUSY;
-		lock_release(old->as_lock);
+		/* Mark the new page table entry as not busy */
+		pte_clearbusy(new_pte);
 
+	} else {
+		KASSERT(*old_pte == PG_BUSY);
 	}
 
-	return 0;
+out:
+	/* Mark the old page table entry as not being busy */
+	pte_clearbusy(old_pte);
+
+	return result;
 }
 
 /*
@@ -1156,6 +1863,11 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	int result;
+	int *old_leaf;
+	int *new_leaf;
+	vaddr_t vaddr;
+	struct as_mapping *m;
+	struct as_mapping **mp;
 	struct addrspace *new;
 
 	/* Create a new address space */
@@ -1170,33 +1882,81 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_npages1 = old->as_npages1;
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
+	new->as_fvaddr1 = old->as_fvaddr1;
+	new->as_foffset1 = old->as_foffset1;
+	new->as_filesz1 = old->as_filesz1;
+	new->as_fvaddr2 = old->as_fvaddr2;
+	new->as_foffset2 = old->as_foffset2;
+	new->as_filesz2 = old->as_filesz2;
+	new->as_readonly1 = old->as_readonly1;
+	new->as_readonly2 = old->as_readonly2;
 	new->as_stackptr = old->as_stackptr;
 	new->as_heaptop = old->as_heaptop;
-	new->as_heapsz = old->as_heapsz;
-
-	/* Use as_copyregion to copy the page table of each region to the new
-	 * address space */
 
-	result = as_copyregion(old, new, AS_REGION1);
-	if (result) {
-		return result;
+	/* Pages of the new address space which have never been touched are
+	 * read from the same executable */
+	if (old->as_vn != NULL) {
+		VOP_INCREF(old->as_vn);
+		new->as_vn = old->as_vn;
 	}
 
-	result = as_copyregion(old, new, AS_REGION2);
-	if (result) {
-		return result;
+	/* Copy the memory mappings, keeping their order */
+	mp = &new->as_mappings;
+	for (m = old->as_mappings; m != NULL; m = m->am_next) {
+		*mp = kmalloc(sizeof(struct as_mapping));
+		if (*mp == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		**mp = *m;
+		(*mp)->am_next = NULL;
+		if (m->am_vn != NULL) {
+			VOP_INCREF(m->am_vn);
+		}
+		mp = &(*mp)->am_next;
 	}
 
-	result = as_copyregion(old, new, AS_STACK);
-	if (result) {
-		return result;
-	}
+	/* Copy every leaf page table of the old address space.  Only the
+	 * old process can create leaf page tables, and it is busy in here,
+	 * so the page directory does not change under us. */
+	for (unsigned i=0; i<PT_NDIRENTRIES; i++) {
+		old_leaf = old->as_pgdir[i];
+		if (old_leaf == NULL) {
+			continue;
+		}
 
-	result = as_copyregion(old, new, AS_HEAP);
-	if (result) {
-		return result;
+		result = as_getpte(new, (vaddr_t)i << PT_LEAFSHIFT, true,
+		&new_leaf);
+		if (result) {
+			as_destroy(new);
+			return result;
+		}
+
+		for (unsigned j=0; j<PT_NLEAFENTRIES; j++) {
+			if (old_leaf[j] == 0) {
+				continue;
+			}
+
+			vaddr = ((vaddr_t)i << PT_LEAFSHIFT) + j * PAGE_SIZE;
+			m = as_findmapping(old, vaddr);
+
+			result = as_copypte(&old_leaf[j], new, &new_leaf[j],
+			m != NULL && m->am_shared && m->am_vn != NULL);
+			if (result) {
+				as_destroy(new);
+				return result;
+			}
+		}
 	}
 
+	/* The pages of the old address space are now shared copy-on-write,
+	 * so any writable TLB entries still mapping them must go, on every
+	 * CPU.  Rather than hunting them down, give the old address space a
+	 * new ASID; it is the one currently loaded in the MMU. */
+	KASSERT(old == proc_getas());
+	as_retireasid(old);
+	as_activate();
+
 	*ret = new;
 	return 0;
 
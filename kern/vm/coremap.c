@@ -30,8 +30,11 @@
 #include <types.h>
 #include <current.h>
 #include <lib.h>
+#include <cpu.h>
+#include <membar.h>
 #include <clock.h>
 #include <spinlock.h>
+#include <wchan.h>
 #include <synch.h>
 #include <vm.h>
 #include <proc.h>
@@ -40,9 +43,14 @@
 #include <bitmap.h>
 #include <swap.h>
 #include <coremap.h>
+#include <pagecache.h>
+#include <vmstat.h>
 
 struct coremap *coremap;
 
+/* The page magazine of each CPU, indexed by c_number */
+static struct coremap_magazine coremap_magazines[TLBSHOOTDOWN_MAXCPUS];
+
 
 /*
  * coremap_entry_init
@@ -61,8 +69,393 @@ coremap_entry_init(struct coremap_entry *coremap_entry) {
 	coremap_entry->ce_foruser = true;
 	coremap_entry->ce_busy = false;
 	coremap_entry->ce_next = 0;
+	coremap_entry->ce_pageref = NULL;
 	coremap_entry->ce_pgentry = NULL;
+	coremap_entry->ce_refcount = 0;
+	coremap_entry->ce_vnode = NULL;
+	coremap_entry->ce_foffset = 0;
+	coremap_entry->ce_hashnext = -1;
+	coremap_entry->ce_rmap = NULL;
+	coremap_entry->ce_referenced = false;
+	coremap_entry->ce_readahead = false;
 	coremap_entry->ce_swapoffset = -1;
+	coremap_entry->ce_order = -1;
+	coremap_entry->ce_freeprev = -1;
+	coremap_entry->ce_freenext = -1;
+}
+
+/*
+ * coremap_pool_init
+ *
+ * Initializes an empty pool of free pages covering the coremap entries from
+ * base to base+npages-1
+ */
+static
+void
+coremap_pool_init(struct coremap_pool *pool, int base, int npages) {
+
+	pool->cp_base = base;
+	pool->cp_npages = npages;
+	pool->cp_nfree = 0;
+
+	for (int i=0; i<=COREMAP_MAXORDER; i++) {
+		pool->cp_freelist[i] = -1;
+	}
+}
+
+/*
+ * coremap_pool_of
+ *
+ * Returns the pool a physical page belongs to
+ */
+static
+struct coremap_pool *
+coremap_pool_of(int c_index) {
+
+	KASSERT(c_index >= coremap->c_kernelpbase);
+
+	if (c_index < coremap->c_userpbase) {
+		return &coremap->c_kpool;
+	} else {
+		return &coremap->c_upool;
+	}
+}
+
+/*
+ * coremap_pushfree
+ *
+ * Adds the free block starting at c_index to the free list for its order.
+ * Called with the coremap spinlock held.
+ */
+static
+void
+coremap_pushfree(struct coremap_pool *pool, int c_index, int order) {
+	struct coremap_entry *ce;
+
+	ce = &coremap->c_entries[c_index];
+	KASSERT(!ce->ce_allocated);
+	KASSERT(ce->ce_order == -1);
+
+	ce->ce_order = order;
+	ce->ce_freeprev = -1;
+	ce->ce_freenext = pool->cp_freelist[order];
+	if (ce->ce_freenext >= 0) {
+		coremap->c_entries[ce->ce_freenext].ce_freeprev = c_index;
+	}
+	pool->cp_freelist[order] = c_index;
+}
+
+/*
+ * coremap_removefree
+ *
+ * Removes the free block starting at c_index from its free list.  Called with
+ * the coremap spinlock held.
+ */
+static
+void
+coremap_removefree(struct coremap_pool *pool, int c_index) {
+	struct coremap_entry *ce;
+
+	ce = &coremap->c_entries[c_index];
+	KASSERT(!ce->ce_allocated);
+	KASSERT(ce->ce_order >= 0);
+
+	if (ce->ce_freeprev >= 0) {
+		coremap->c_entries[ce->ce_freeprev].ce_freenext =
+		ce->ce_freenext;
+	} else {
+		pool->cp_freelist[ce->ce_order] = ce->ce_freenext;
+	}
+
+	if (ce->ce_freenext >= 0) {
+		coremap->c_entries[ce->ce_freenext].ce_freeprev =
+		ce->ce_freeprev;
+	}
+
+	ce->ce_order = -1;
+	ce->ce_freeprev = -1;
+	ce->ce_freenext = -1;
+}
+
+/*
+ * coremap_allocblock
+ *
+ * Takes a block of 2^order pages out of the pool, splitting a larger block if
+ * no block of the right order is free.  Returns the index of the first page
+ * of the block, or -1 if the pool has no block large enough.  Called with the
+ * coremap spinlock held.
+ */
+static
+int
+coremap_allocblock(struct coremap_pool *pool, int order) {
+	int c_index;
+	int k;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	/* Find the smallest free block which is large enough */
+	for (k=order; k<=COREMAP_MAXORDER; k++) {
+		if (pool->cp_freelist[k] >= 0) {
+			break;
+		}
+	}
+
+	if (k > COREMAP_MAXORDER) {
+		return -1;
+	}
+
+	c_index = pool->cp_freelist[k];
+	coremap_removefree(pool, c_index);
+
+	/* Split the block in halves until it has the right order, putting the
+	 * upper halves back on the free lists */
+	while (k > order) {
+		k--;
+		coremap_pushfree(pool, c_index + (1 << k), k);
+	}
+
+	pool->cp_nfree -= 1 << order;
+
+	return c_index;
+}
+
+/*
+ * coremap_freeblock
+ *
+ * Returns a block of 2^order pages starting at c_index to the pool, merging
+ * it with its buddy for as long as the buddy is free too.  The coremap
+ * entries of the block must already be marked as free.  Called with the
+ * coremap spinlock held.
+ */
+static
+void
+coremap_freeblock(struct coremap_pool *pool, int c_index, int order) {
+	int offset;
+	int buddy;
+	struct coremap_entry *ce;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	pool->cp_nfree += 1 << order;
+	offset = c_index - pool->cp_base;
+
+	while (order < COREMAP_MAXORDER) {
+
+		/* The buddy must lie within the pool and be the head of a
+		 * free block of the same order */
+		buddy = offset ^ (1 << order);
+		if (buddy + (1 << order) > pool->cp_npages) {
+			break;
+		}
+
+		ce = &coremap->c_entries[pool->cp_base + buddy];
+		if (ce->ce_allocated || ce->ce_order != order) {
+			break;
+		}
+
+		coremap_removefree(pool, pool->cp_base + buddy);
+		offset &= ~(1 << order);
+		order++;
+	}
+
+	coremap_pushfree(pool, pool->cp_base + offset, order);
+}
+
+/*
+ * coremap_freerange
+ *
+ * Returns npages contiguous free pages starting at c_index to the pool, as
+ * the largest aligned blocks that fit.  Called with the coremap spinlock
+ * held, except during bootup.
+ */
+static
+void
+coremap_freerange(struct coremap_pool *pool, int c_index, int npages) {
+	int offset;
+	int order;
+
+	while (npages > 0) {
+		offset = c_index - pool->cp_base;
+
+		order = 0;
+		while (order < COREMAP_MAXORDER &&
+		(offset & (1 << order)) == 0 &&
+		(1 << (order + 1)) <= npages) {
+			order++;
+		}
+
+		coremap_freeblock(pool, c_index, order);
+		c_index += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+/*
+ * coremap_takezeroed
+ *
+ * Takes a page out of the pool of pages zeroed in advance.  Returns its
+ * index, or -1 if the pool is empty.  Called with the coremap spinlock held.
+ */
+static
+int
+coremap_takezeroed(void) {
+	int c_index;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	c_index = coremap->c_zerolist;
+	if (c_index < 0) {
+		return -1;
+	}
+
+	coremap->c_zerolist = coremap->c_entries[c_index].ce_freenext;
+	coremap->c_entries[c_index].ce_freenext = -1;
+	coremap->c_nzeroed--;
+	coremap->c_upool.cp_nfree--;
+
+	return c_index;
+}
+
+/*
+ * coremap_drainzeroed
+ *
+ * Returns the pages zeroed in advance to the free lists, so that they can be
+ * merged into larger blocks.  Called with the coremap spinlock held when a
+ * block cannot be found otherwise.
+ */
+static
+void
+coremap_drainzeroed(void) {
+	int c_index;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	while ((c_index = coremap_takezeroed()) >= 0) {
+		coremap_freeblock(&coremap->c_upool, c_index, 0);
+	}
+}
+
+/*
+ * coremap_getmagazine
+ *
+ * Returns the page magazine of the current CPU.  We may be moved to another
+ * CPU right after, but then we simply use that CPU's magazine, under its
+ * lock.
+ */
+static
+struct coremap_magazine *
+coremap_getmagazine(void) {
+	unsigned num = curcpu->c_number;
+
+	KASSERT(num < TLBSHOOTDOWN_MAXCPUS);
+	return &coremap_magazines[num];
+}
+
+/*
+ * coremap_plenty
+ *
+ * Returns whether there are enough free user pages for the magazines to hold
+ * on to some.  Below the page daemon's high watermark, pages are better left
+ * on the free lists where the page daemon and waiting threads count them.
+ * Called with the coremap spinlock held.
+ */
+static
+bool
+coremap_plenty(void) {
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	return kswap == NULL ||
+	coremap->c_upool.cp_nfree >= kswap->sw_hiwater + COREMAP_MAGBATCH;
+}
+
+/*
+ * coremap_refill
+ *
+ * Moves a batch of free user pages into the current CPU's magazine, if there
+ * are pages to spare.  Called with the coremap spinlock held.
+ */
+static
+void
+coremap_refill(void) {
+	struct coremap_magazine *cm;
+	int c_index;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	cm = coremap_getmagazine();
+	spinlock_acquire(&cm->cm_lock);
+
+	while (cm->cm_nframes < COREMAP_MAGBATCH && coremap_plenty()) {
+		c_index = coremap_allocblock(&coremap->c_upool, 0);
+		if (c_index < 0) {
+			break;
+		}
+		cm->cm_frames[cm->cm_nframes++] = c_index;
+	}
+
+	spinlock_release(&cm->cm_lock);
+}
+
+/*
+ * coremap_drainmagazines
+ *
+ * Returns the pages in the magazines of all CPUs to the free lists, so that
+ * they can be counted, merged into larger blocks and handed out.  Returns the
+ * number of pages drained.  Called with the coremap spinlock held, when free
+ * pages run short.
+ */
+unsigned
+coremap_drainmagazines(void) {
+	struct coremap_magazine *cm;
+	unsigned ndrained;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	ndrained = 0;
+	for (unsigned c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		cm = &coremap_magazines[c];
+		spinlock_acquire(&cm->cm_lock);
+		if (cm->cm_nframes > 0) {
+			ndrained += cm->cm_nframes;
+			while (cm->cm_nframes > 0) {
+				coremap_freeblock(&coremap->c_upool,
+				cm->cm_frames[--cm->cm_nframes], 0);
+			}
+			cm->cm_ndrains++;
+		}
+		spinlock_release(&cm->cm_lock);
+	}
+
+	return ndrained;
+}
+
+/*
+ * coremap_waitfree
+ *
+ * Called when there are no free pages left.  Wakes up the page daemon and
+ * sleeps until it frees a page.  Returns false without sleeping if the page
+ * daemon cannot help, because it is not running yet, because the swap disk is
+ * full, or because the caller is the page daemon itself.  Called with the
+ * coremap spinlock held.
+ */
+static
+bool
+coremap_waitfree(void) {
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	if (kswap == NULL || kswap->sw_daemon == NULL ||
+	kswap->sw_daemon == curthread || kswap->sw_diskfull) {
+		return false;
+	}
+
+	coremap->c_nwaiters++;
+	sw_wakedaemon();
+	wchan_sleep(coremap->c_freewchan, &coremap->c_spinlock);
+	coremap->c_nwaiters--;
+
+	return true;
 }
 
 /*
@@ -93,6 +486,28 @@ coremap_bootstrap(void) {
 	/* Initialise the coremap spinlock */
 	spinlock_init(&coremap->c_spinlock);
 
+	/* Create the wait channel for threads waiting for free pages */
+	coremap->c_freewchan = wchan_create("coremap free pages");
+	if (coremap->c_freewchan == NULL) {
+		panic("wchan_create failed in coremap_bootstrap\n");
+	}
+	coremap->c_nwaiters = 0;
+
+	/* No pages have been zeroed in advance yet */
+	coremap->c_zerolist = -1;
+	coremap->c_nzeroed = 0;
+
+	/* The magazines start out empty */
+	for (unsigned c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		spinlock_init(&coremap_magazines[c].cm_lock);
+		coremap_magazines[c].cm_nframes = 0;
+		coremap_magazines[c].cm_nhits = 0;
+		coremap_magazines[c].cm_nmisses = 0;
+		coremap_magazines[c].cm_nfrees = 0;
+		coremap_magazines[c].cm_ndrains = 0;
+		coremap_magazines[c].cm_nzerofills = 0;
+	}
+
 	/* Allocate the array of coremap entries.  The number of coremap entries
 	 * equals the number of physical pages in the system. */
 	coremap->c_entries = (struct coremap_entry*)kmalloc(total_npages * sizeof(struct
@@ -142,6 +557,39 @@ coremap_bootstrap(void) {
 	/* The address after the block of reserved kernel physical pages is the
 	 * first address which can be used by the user process. */
 	coremap->c_userpbase = (int)(firstpaddr/PAGE_SIZE + N_RESERVEDKPAGES);
+
+	/* Put the free pages in each region on the free lists */
+	coremap_pool_init(&coremap->c_kpool, coremap->c_kernelpbase,
+	coremap->c_userpbase - coremap->c_kernelpbase);
+	coremap_pool_init(&coremap->c_upool, coremap->c_userpbase,
+	(int)total_npages - coremap->c_userpbase);
+
+	spinlock_acquire(&coremap->c_spinlock);
+	coremap_freerange(&coremap->c_kpool, coremap->c_kpool.cp_base,
+	coremap->c_kpool.cp_npages);
+	coremap_freerange(&coremap->c_upool, coremap->c_upool.cp_base,
+	coremap->c_upool.cp_npages);
+	spinlock_release(&coremap->c_spinlock);
+
+	/* The clock hand starts at the first user page */
+	coremap->c_clockhand = coremap->c_userpbase;
+
+	coremap->c_ncleanevictions = 0;
+	coremap->c_nclocksteps = 0;
+	coremap->c_nsecondchances = 0;
+	coremap->c_nreadahead = 0;
+	coremap->c_nramisses = 0;
+	coremap->c_nprezeroed = 0;
+	coremap->c_nzerofills = 0;
+	coremap->c_rawindow = SW_READAHEAD_MAX / 2;
+	coremap->c_rahitsseen = 0;
+
+	/* Set aside the shared zero page */
+	coremap->c_zeropage = coremap_getkpages(1);
+	if (coremap->c_zeropage == 0) {
+		panic("coremap_bootstrap: cannot allocate the zero page\n");
+	}
+	bzero((void *)PADDR_TO_KVADDR(coremap->c_zeropage), PAGE_SIZE);
 }
 
 /*
@@ -167,167 +615,177 @@ paddr_t
 coremap_getkpages(unsigned long npages) {	
 
 	paddr_t paddr;
-	unsigned long total_npages;
-	unsigned long start;
-	unsigned long end;
+	struct coremap_pool *pool;
+	int c_index;
+	int order;
+
+	/* Determine the order of the smallest block which holds npages */
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
 
-	total_npages = coremap->c_npages;
+	if (order > COREMAP_MAXORDER) {
+		return 0;
+	}
 
 	while (1) {
 		
-		start = coremap->c_kernelpbase;
 		spinlock_acquire(&coremap->c_spinlock);
-			
-		while (start < total_npages) {
-
-			/* Go through the entire coremap starting from
-			 * coremap->c_kernelpbase */
-
-			if (!coremap->c_entries[start].ce_allocated) {
-
-				/* If we encounter a free page, we see if the
-				 * pages contiguous to it are also free */
-
-				end = start+npages-1;
-				if (end >= total_npages) {
-
-					/* Break if we have reached near the end
-					 * of the coremap and have not found the
-					 * required number of contiguous free
-					 * pages. */ 
-
-					break;
-				}
-
-				while (end > start) {
-
-					/* Start from what would be the end of
-					 * the contiguous block of kernal pages
-					 * and work our way back towards the
-					 * start of the block, checking to see
-					 * if each page is free */
-
-					if (!coremap->c_entries[end].ce_allocated) {
 
-						/* If we encounter a free page,
-						 * check that its field are set
-						 * to the appropriate values */
-
-						KASSERT(coremap->c_entries[end].ce_addrspace
-						== NULL);
-						KASSERT(!coremap->c_entries[end].ce_busy);
-						KASSERT(coremap->c_entries[end].ce_next
-						== 0);
-						KASSERT(coremap->c_entries[end].ce_pgentry == NULL);
-						KASSERT(coremap->c_entries[end].ce_swapoffset == -1);
-					}
-
-					if (coremap->c_entries[end].ce_allocated) {
-
-						/* Break if we encounter a page
-						 * which is already allocated */
-
-						break;
-
-					} else {
-
-						/* Decrement the end variable if
-						 * we encounter a free page */
+		/* Prefer the pages reserved for the kernel, and only fall back
+		 * on the pages shared with user processes when those run out */
+		pool = &coremap->c_kpool;
+		c_index = coremap_allocblock(pool, order);
+		if (c_index < 0) {
+			pool = &coremap->c_upool;
+			c_index = coremap_allocblock(pool, order);
+		}
+		if (c_index < 0 &&
+		(coremap_drainmagazines() > 0 || coremap->c_nzeroed > 0)) {
+			coremap_drainzeroed();
+			c_index = coremap_allocblock(pool, order);
+		}
 
-						end--;
-					}
-				}
-			
-				if (start == end) {
+		if (c_index >= 0) {
+
+			for (int i=c_index; i<c_index+(int)npages; i++) {
+
+				/* Check that the coremap entry has the
+				 * appropriate values for a free page */
+
+				KASSERT(!coremap->c_entries[i].ce_allocated);
+				KASSERT(coremap->c_entries[i].ce_addrspace
+				== NULL);
+				KASSERT(!coremap->c_entries[i].ce_busy);
+				KASSERT(coremap->c_entries[i].ce_next == 0);
+				KASSERT(coremap->c_entries[i].ce_pgentry == NULL);
+				KASSERT(coremap->c_entries[i].ce_refcount == 0);
+				KASSERT(coremap->c_entries[i].ce_swapoffset == -1);
+				KASSERT(coremap->c_entries[i].ce_order == -1);
+
+				/* Mark each page as being allocated for the
+				 * kernel.  The ce_next of each coremap entry is
+				 * 1 if the next adjacent page forms a part of
+				 * the contiguous block of kernel pages, and 0
+				 * for the last page in the block. */
+
+				coremap->c_entries[i].ce_allocated = true;
+				coremap->c_entries[i].ce_foruser = false;
+				coremap->c_entries[i].ce_next =
+				(i < c_index+(int)npages-1) ? 1 : 0;
+			}
 
-					/* If the variable start equals the
-					 * variable end, then we have found a
-					 * contiguous block of free pages for
-					 * the kernel*/
+			/* Give back the pages at the end of the block which
+			 * we do not need */
+			coremap_freerange(pool, c_index + (int)npages,
+			(1 << order) - (int)npages);
 
-					for (unsigned i=start; i<start+npages; i++) {
+			/* Release the coremap spinlock and return the physical
+			 * address of the first page in the block of kernel
+			 * pages */
 
-						/* Mark each page as being
-						 * allocated for the kernel */
+			paddr = (paddr_t)(c_index*PAGE_SIZE);
+			spinlock_release(&coremap->c_spinlock);
+			return paddr;
+		}
 
-						coremap->c_entries[i].ce_allocated = true;
-						coremap->c_entries[i].ce_foruser =
-						false;
+		/* If we have reached this point, we cannot find a contigous
+		 * block of free kernel pages.  We have no choice but to wait
+		 * for the page daemon to create free pages for us.  If the page
+		 * daemon cannot help, we return 0. */
 
-						if (i < start+npages-1) {
+		if (!coremap_waitfree()) {
+			spinlock_release(&coremap->c_spinlock);
+			return 0;
+		}
 
-							/* Mark ce_next of each
-							 * coremap entry as
-							 * being 1 if the next
-							 * adjacent page forms a
-							 * part of the
-							 * contiguous block of
-							 * kernel pages */
+		spinlock_release(&coremap->c_spinlock);
+	}
 
-							coremap->c_entries[i].ce_next = 1;
+}
 
-						} else {
+/*
+ * coremap_getframe
+ *
+ * Takes a free user page off the free lists, or out of the pool of pages
+ * zeroed in advance, for coremap_getpage when the current CPU's magazine is
+ * empty.  Refills the magazine on the way.  Sets *zeroed if the page comes
+ * zeroed.  Returns the index of the page, or -1 if there are no free pages
+ * and the page daemon cannot make any.
+ */
+static
+int
+coremap_getframe(bool zero, bool *zeroed) {
+	int i;
 
-							/* The coremap entry
-							 * representing the last page in the
-							 * contiguous block of
-							 * kernel pages has its
-							 * ce_next marked as 0.
-							 */
+	spinlock_acquire(&coremap->c_spinlock);
 
-							coremap->c_entries[i].ce_next = 0;
-						}		
-					}
+	while (1) {
 
-	
-					/* Release the coremap spinlock and
-					 * return the physical address of the
-					 * first page in the block of kernel
-					 * pages */
-
-					paddr = (paddr_t)(start*PAGE_SIZE);
-					spinlock_release(&coremap->c_spinlock);
-					return paddr;
-				} 
-						
+		/* In the section of physical memory not reserved exclusively
+		 * for the kernel, find a free page, zeroed already if that is
+		 * what we want */
+		*zeroed = false;
+		i = -1;
+		if (zero) {
+			i = coremap_takezeroed();
+			*zeroed = i >= 0;
+		}
+		if (i < 0) {
+			i = coremap_allocblock(&coremap->c_upool, 0);
+			if (i >= 0) {
+				coremap_refill();
 			}
-
-			/* If we have reached this point, we hve not yet found a
-			 * contiguous block of free kernel pages.  We increment
-			 * start and continue searching the coremap. */
-
-			start++;
+		}
+		if (i < 0) {
+			i = coremap_takezeroed();
+			*zeroed = i >= 0;
+		}
+		if (i >= 0) {
+			break;
 		}
 
-		/* If we have reached this point, we cannot find a contigous
-		 * block of free kernel pages.  We have no choice but to wait
-		 * for the page daemon to create free pages for us. */
-
-		spinlock_release(&coremap->c_spinlock);
-
-		if (kswap->sw_diskfull) {
-
-			/* If the disk is full,there is no chance that the page
-			 * daemon can create free pages so we return 0. */
+		/* There are no free pages.  Take back the pages other CPUs
+		 * have in their magazines, or else wait for the page daemon to
+		 * evict a page, unless the swap disk is full. */
+		if (coremap_drainmagazines() > 0) {
+			continue;
+		}
+		if (!coremap_waitfree()) {
+			spinlock_release(&coremap->c_spinlock);
+			return -1;
+		}
+	}
 
-			return 0;
+	if (zero) {
+		if (*zeroed) {
+			coremap->c_nprezeroed++;
+		} else {
+			coremap->c_nzerofills++;
 		}
-		
-		/* Busy wait until the page daemon produces free pages */
+	}
 
-		while(!kswap->sw_pgevicted);
+	/* If we are running low on free pages, let the page daemon evict some
+	 * pages in the background before we run out */
+	sw_wakedaemon();
 
-	}
+	spinlock_release(&coremap->c_spinlock);
 
+	return i;
 }
 
 /*
  * coremap_getpage
  *
- * Gets pages for user processes.
+ * Gets pages for user processes.  If zero is set, the page is zero-filled,
+ * preferably by taking one of the pages the idle loop has zeroed in advance.
+ * Otherwise the caller overwrites the page anyway, and those pages are left
+ * for someone who needs them.  Pages come from the current CPU's magazine if
+ * it has any, without taking the coremap spinlock.
  */
 int
-coremap_getpage(int *pg_entry, struct addrspace *as) {
+coremap_getpage(int *pg_entry, struct addrspace *as, bool zero) {
 	
 	/* Pages used by processes are referenced by page tables.  The function
 	 * coremap_getpage takes as its input a pointer to a page table entry
@@ -339,110 +797,81 @@ coremap_getpage(int *pg_entry, struct addrspace *as) {
 	KASSERT(pg_entry != NULL);
 	KASSERT(as != NULL);
 
+	struct coremap_magazine *cm;
 	paddr_t paddr;
-	paddr_t pgvictim;
-	int c_index;
-	int result;
-	unsigned long total_npages;
-	unsigned long start;
-
-	total_npages = coremap->c_npages;
-
-	spinlock_acquire(&coremap->c_spinlock);
-	start = coremap->c_userpbase;
-
-	for (unsigned long i=start; i<total_npages; i++) {
-
-		/* In the section of physical memory not reserved exclusively
-		 * for the kernel, find a free page */
-
-		if (!coremap->c_entries[i].ce_allocated ) {
-
-			/* Check that the coremap entry corresponding to the
-			 * free physical page has the correct values */
-
-			KASSERT(coremap->c_entries[i].ce_foruser);
-			KASSERT(!coremap->c_entries[i].ce_busy);
-			KASSERT(coremap->c_entries[i].ce_next == 0);
-			KASSERT(coremap->c_entries[i].ce_pgentry == NULL);
-			KASSERT(coremap->c_entries[i].ce_swapoffset ==
-			-1);
-
-		
-			/* Mark the coremap entry as being allocated to a user
-			 * process.  The ce_addrspace and ce_foruser fields
-			 * should point to the address space and page table
-			 * entry respectively. */	
-
-			coremap->c_entries[i].ce_addrspace = as;
-			coremap->c_entries[i].ce_allocated = true;
-			coremap->c_entries[i].ce_foruser = true;
-			coremap->c_entries[i].ce_next = 0;
-
-			/* Calculate what the physical page address is based on
-			 * its index in the coremap entry */
-
-			paddr = (paddr_t)((i*PAGE_SIZE) >> 12);
-
-			/* Place the physical page address in the page table
-			 * entry and release the coremap spinlock */
-			*pg_entry &= ~PG_FRAME;
-			*pg_entry |= paddr;
-			coremap->c_entries[i].ce_pgentry = pg_entry;
-			spinlock_release(&coremap->c_spinlock);
-			return 0;
+	int i;
+	bool zeroed;
+
+	i = -1;
+	zeroed = false;
+
+	/* Try the magazine first, unless we want a zeroed page and there are
+	 * pages zeroed in advance.  A stale look at c_nzeroed only costs us
+	 * the choice of page. */
+	if (!zero || coremap->c_nzeroed == 0) {
+		cm = coremap_getmagazine();
+		spinlock_acquire(&cm->cm_lock);
+		if (cm->cm_nframes > 0) {
+			i = cm->cm_frames[--cm->cm_nframes];
+			cm->cm_nhits++;
+			if (zero) {
+				cm->cm_nzerofills++;
+			}
+		} else {
+			cm->cm_nmisses++;
+		}
+		spinlock_release(&cm->cm_lock);
+	}
 
+	if (i < 0) {
+		i = coremap_getframe(zero, &zeroed);
+		if (i < 0) {
+			return ENOMEM;
 		}
-			
 	}
 
-	/* Release the coremap spinlock and yield to another thread */
-	spinlock_release(&coremap->c_spinlock);
-	thread_yield();
+	/* Check that the coremap entry corresponding to the free physical page
+	 * has the correct values */
 
-	/* Since there are no free physical pages, we need to evict a page.
-	 * First, find a page to evict. */
-	sw_getpage(&pgvictim);
+	KASSERT(!coremap->c_entries[i].ce_allocated);
+	KASSERT(coremap->c_entries[i].ce_foruser);
+	KASSERT(!coremap->c_entries[i].ce_busy);
+	KASSERT(coremap->c_entries[i].ce_next == 0);
+	KASSERT(coremap->c_entries[i].ce_pgentry == NULL);
+	KASSERT(coremap->c_entries[i].ce_refcount == 0);
+	KASSERT(coremap->c_entries[i].ce_swapoffset == -1);
+	KASSERT(coremap->c_entries[i].ce_order == -1);
 
-	/* Check that the coremap entry corresponding to the page we selected for
-	 * eviction has the correct values. */
-	KASSERT(!spinlock_do_i_hold(&coremap->c_spinlock));
-	c_index = (int)(pgvictim/PAGE_SIZE);
-	KASSERT(coremap->c_entries[c_index].ce_allocated);
-	KASSERT(coremap->c_entries[c_index].ce_foruser);
-	KASSERT(coremap->c_entries[c_index].ce_busy);
-	KASSERT((paddr_t)((*coremap->c_entries[c_index].ce_pgentry & PG_FRAME)
-	<< 12) == pgvictim);
-		
-	/* Evict the page */
-	result = sw_evictpage(pgvictim);
-	if (result) {
-		spinlock_acquire(&coremap->c_spinlock);
-		coremap->c_entries[c_index].ce_busy = false;
-		spinlock_release(&coremap->c_spinlock);
-		return result;
-	}
+	/* Calculate what the physical page address is based on its index in
+	 * the coremap entry */
 
-	KASSERT(coremap->c_entries[c_index].ce_busy);
+	paddr = (paddr_t)((i*PAGE_SIZE) >> 12);
 
-	/* If we have successfully evicted a page, we place its address in the
-	 * page table entry */
-	spinlock_acquire(&coremap->c_spinlock);	
-	paddr = pgvictim >> 12;
+	/* Place the physical page address in the page table entry */
 	*pg_entry &= ~PG_FRAME;
-	*pg_entry |= paddr; 
-
-	/* Mark the coremap entry as being allocated for the user */
-	coremap->c_entries[c_index].ce_allocated = true;
-	coremap->c_entries[c_index].ce_addrspace = as;
-	coremap->c_entries[c_index].ce_foruser = true;
-	coremap->c_entries[c_index].ce_next = 0;
-	coremap->c_entries[c_index].ce_pgentry = pg_entry;
-	coremap->c_entries[c_index].ce_swapoffset = -1;
-	coremap->c_entries[c_index].ce_busy = false;
+	*pg_entry |= paddr;
+
+	/* Mark the coremap entry as being allocated to a user process.  The
+	 * ce_addrspace and ce_pgentry fields should point to the address space
+	 * and page table entry respectively.  The page is on no list, so
+	 * nobody else allocates it, but the clock hand may look at the entry
+	 * at any time: ce_allocated must be set last. */
+
+	coremap->c_entries[i].ce_addrspace = as;
+	coremap->c_entries[i].ce_foruser = true;
+	coremap->c_entries[i].ce_next = 0;
+	coremap->c_entries[i].ce_refcount = 1;
+	coremap->c_entries[i].ce_referenced = true;
+	coremap->c_entries[i].ce_pgentry = pg_entry;
+	membar_store_store();
+	coremap->c_entries[i].ce_allocated = true;
+
+	/* Zero the page if it did not come zeroed.  The caller has marked the
+	 * page table entry as busy, so nobody touches the page meanwhile. */
+	if (zero && !zeroed) {
+		bzero((void *)PADDR_TO_KVADDR(i * PAGE_SIZE), PAGE_SIZE);
+	}
 
-	/* Release the coremap spinlock and return 0 */
-	spinlock_release(&coremap->c_spinlock);
 	return 0;
 }
 
@@ -454,9 +883,11 @@ coremap_getpage(int *pg_entry, struct addrspace *as) {
 void
 coremap_freekpages(paddr_t paddr) {
 	int c_index;
+	int start;
 
 	spinlock_acquire(&coremap->c_spinlock);
 	c_index = (int)(paddr / PAGE_SIZE);
+	start = c_index;
 	
 	while (coremap->c_entries[c_index].ce_next != 0) {
 		
@@ -466,6 +897,7 @@ coremap_freekpages(paddr_t paddr) {
 		KASSERT(coremap->c_entries[c_index].ce_allocated);
 		KASSERT(!coremap->c_entries[c_index].ce_foruser);
 		KASSERT(!coremap->c_entries[c_index].ce_busy);
+		KASSERT(coremap->c_entries[c_index].ce_pageref == NULL);
 		KASSERT(coremap->c_entries[c_index].ce_pgentry == NULL);
 		KASSERT(coremap->c_entries[c_index].ce_swapoffset == -1);
 
@@ -492,6 +924,7 @@ coremap_freekpages(paddr_t paddr) {
 	KASSERT(coremap->c_entries[c_index].ce_allocated);
 	KASSERT(!coremap->c_entries[c_index].ce_foruser);
 	KASSERT(!coremap->c_entries[c_index].ce_busy);
+	KASSERT(coremap->c_entries[c_index].ce_pageref == NULL);
 	KASSERT(coremap->c_entries[c_index].ce_pgentry == NULL);
 	KASSERT(coremap->c_entries[c_index].ce_swapoffset == -1);
 
@@ -504,6 +937,630 @@ coremap_freekpages(paddr_t paddr) {
 
 	coremap->c_entries[c_index].ce_allocated = false;
 
+	/* Return the block of pages to the free lists.  Pages stolen before
+	 * the coremap was ready lie below c_kernelpbase and are never reused. */
+	if (start >= coremap->c_kernelpbase) {
+		coremap_freerange(coremap_pool_of(start), start,
+		c_index - start + 1);
+	}
+
+	/* Wake up anyone waiting for free pages */
+	if (coremap->c_nwaiters > 0) {
+		wchan_wakeall(coremap->c_freewchan, &coremap->c_spinlock);
+	}
+
 	/* Release the coremap spinlock */
 	spinlock_release(&coremap->c_spinlock);
 }
+
+/*
+ * coremap_freeframe
+ *
+ * Resets the coremap entry of a user page and returns the page to the current
+ * CPU's magazine or the free lists.  Called with the coremap spinlock held.
+ */
+void
+coremap_freeframe(int c_index) {
+	struct coremap_magazine *cm;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+	KASSERT(c_index >= coremap->c_userpbase);
+	KASSERT(coremap->c_entries[c_index].ce_allocated);
+	KASSERT(coremap->c_entries[c_index].ce_swapoffset == -1);
+	KASSERT(coremap->c_entries[c_index].ce_vnode == NULL);
+	KASSERT(coremap->c_entries[c_index].ce_rmap == NULL);
+
+	if (coremap->c_entries[c_index].ce_readahead) {
+
+		/* A page read in ahead of time is being freed without ever
+		 * having been used, so halve the readahead window */
+		coremap->c_entries[c_index].ce_readahead = false;
+		coremap->c_nramisses++;
+		coremap->c_rawindow /= 2;
+		if (coremap->c_rawindow < 1) {
+			coremap->c_rawindow = 1;
+		}
+	}
+
+	coremap->c_entries[c_index].ce_addrspace = NULL;
+	coremap->c_entries[c_index].ce_allocated = false;
+	coremap->c_entries[c_index].ce_foruser = true;
+	coremap->c_entries[c_index].ce_busy = false;
+	coremap->c_entries[c_index].ce_next = 0;
+	coremap->c_entries[c_index].ce_pgentry = NULL;
+	coremap->c_entries[c_index].ce_refcount = 0;
+	coremap->c_entries[c_index].ce_referenced = false;
+	coremap->c_entries[c_index].ce_swapoffset = -1;
+
+	/* Put the page in the current CPU's magazine, making room by
+	 * returning a batch to the free lists if it is full.  When free pages
+	 * are short, it goes straight back to the free lists instead. */
+	if (!coremap_plenty()) {
+		coremap_freeblock(&coremap->c_upool, c_index, 0);
+	} else {
+		cm = coremap_getmagazine();
+		spinlock_acquire(&cm->cm_lock);
+		if (cm->cm_nframes == COREMAP_MAGSIZE) {
+			for (unsigned k=0; k<COREMAP_MAGBATCH; k++) {
+				coremap_freeblock(&coremap->c_upool,
+				cm->cm_frames[--cm->cm_nframes], 0);
+			}
+			cm->cm_ndrains++;
+		}
+		cm->cm_frames[cm->cm_nframes++] = c_index;
+		cm->cm_nfrees++;
+		spinlock_release(&cm->cm_lock);
+	}
+
+	/* Wake up anyone waiting for free pages */
+	if (coremap->c_nwaiters > 0) {
+		wchan_wakeall(coremap->c_freewchan, &coremap->c_spinlock);
+	}
+}
+
+/*
+ * coremap_rmapremove
+ *
+ * Removes pg_entry from the reverse map of the page with coremap index
+ * c_index, and returns its reverse map entry for the caller to kfree once it
+ * has let go of the coremap spinlock.  The caller drops the reference count.
+ * Called with the coremap spinlock held.
+ */
+static
+struct rmap *
+coremap_rmapremove(int c_index, int *pg_entry) {
+	struct rmap **rmp;
+	struct rmap *rm;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	for (rmp = &coremap->c_entries[c_index].ce_rmap; *rmp != NULL;
+	rmp = &(*rmp)->rm_next) {
+		if ((*rmp)->rm_pgentry == pg_entry) {
+			rm = *rmp;
+			*rmp = rm->rm_next;
+			return rm;
+		}
+	}
+
+	panic("coremap_rmapremove: page table entry does not map the page\n");
+}
+
+/*
+ * coremap_sharepage
+ *
+ * Adds a reference to a user page, from pg_entry in address space as.  Used by
+ * as_copy to share a page copy-on-write between the parent and the child
+ * process.  The first time an anonymous page is shared, its owner joins the
+ * new mapping on its reverse map.  The caller must have marked the page table
+ * entry already referencing the page as busy.
+ */
+int
+coremap_sharepage(paddr_t paddr, int *pg_entry, struct addrspace *as) {
+	int c_index;
+	struct coremap_entry *ce;
+	struct rmap *rm;
+	struct rmap *owner;
+
+	/* The zero page is not counted */
+	if (paddr == coremap->c_zeropage) {
+		return 0;
+	}
+
+	c_index = (int)(paddr / PAGE_SIZE);
+	ce = &coremap->c_entries[c_index];
+
+	/* Page cache pages keep track of every mapping.  The page cannot leave
+	 * the page cache while the caller's page table entry is busy. */
+	if (ce->ce_vnode != NULL) {
+		return pagecache_share(paddr, pg_entry, as);
+	}
+
+	/* Allocate the reverse map entries up front, as we cannot do so with
+	 * the coremap spinlock held.  The one for the owner may go unused. */
+	rm = kmalloc(sizeof(struct rmap));
+	if (rm == NULL) {
+		return ENOMEM;
+	}
+	owner = kmalloc(sizeof(struct rmap));
+	if (owner == NULL) {
+		kfree(rm);
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&coremap->c_spinlock);
+
+	/* The page daemon may be looking at the page through its owner or its
+	 * reverse map.  It backs off once it finds the caller's page table
+	 * entry busy. */
+	while (ce->ce_busy) {
+		spinlock_release(&coremap->c_spinlock);
+		thread_yield();
+		spinlock_acquire(&coremap->c_spinlock);
+	}
+
+	KASSERT(ce->ce_allocated);
+	KASSERT(ce->ce_foruser);
+	KASSERT(ce->ce_refcount > 0);
+
+	if (ce->ce_rmap == NULL) {
+		KASSERT(ce->ce_refcount == 1);
+		KASSERT(ce->ce_pgentry != NULL);
+
+		owner->rm_pgentry = ce->ce_pgentry;
+		owner->rm_as = ce->ce_addrspace;
+		owner->rm_next = NULL;
+		ce->ce_rmap = owner;
+		ce->ce_addrspace = NULL;
+		ce->ce_pgentry = NULL;
+		owner = NULL;
+	}
+
+	rm->rm_pgentry = pg_entry;
+	rm->rm_as = as;
+	rm->rm_next = ce->ce_rmap;
+	ce->ce_rmap = rm;
+	ce->ce_refcount++;
+
+	spinlock_release(&coremap->c_spinlock);
+
+	if (owner != NULL) {
+		kfree(owner);
+	}
+	return 0;
+}
+
+/*
+ * coremap_claimpage
+ *
+ * Called on a write fault to a copy-on-write page.  If pg_entry is the only
+ * page table entry still referencing the page, it is the owner of the page
+ * and we return true so that the page can be written in place.
+ * Otherwise we return false and the caller must make a private copy.  The
+ * caller must have marked pg_entry as busy and must not hold the address
+ * space lock.
+ */
+bool
+coremap_claimpage(paddr_t paddr, int *pg_entry, struct addrspace *as) {
+	int c_index;
+
+	KASSERT(pg_entry != NULL);
+	KASSERT(as != NULL);
+
+	/* The zero page is never written */
+	if (paddr == coremap->c_zeropage) {
+		return false;
+	}
+
+	c_index = (int)(paddr / PAGE_SIZE);
+
+	spinlock_acquire(&coremap->c_spinlock);
+
+	KASSERT(coremap->c_entries[c_index].ce_allocated);
+	KASSERT(coremap->c_entries[c_index].ce_foruser);
+	KASSERT(coremap->c_entries[c_index].ce_refcount > 0);
+
+	/* Page cache pages are always copied, even if nobody else maps them
+	 * right now, so that the text stays in the page cache */
+	if (coremap->c_entries[c_index].ce_refcount > 1 ||
+	coremap->c_entries[c_index].ce_vnode != NULL) {
+		spinlock_release(&coremap->c_spinlock);
+		return false;
+	}
+
+	/* The last of the sharers became the owner of the page when the
+	 * others let go of it */
+	KASSERT(coremap->c_entries[c_index].ce_refcount == 1);
+	KASSERT(coremap->c_entries[c_index].ce_rmap == NULL);
+	KASSERT(coremap->c_entries[c_index].ce_addrspace == as);
+	KASSERT(coremap->c_entries[c_index].ce_pgentry == pg_entry);
+
+	spinlock_release(&coremap->c_spinlock);
+	return true;
+}
+
+/*
+ * coremap_freepage
+ *
+ * Drops the reference pg_entry holds on a user page, and frees the page once
+ * no page table entry references it anymore.  The caller must have marked
+ * pg_entry as busy and must not hold its lock.
+ */
+void
+coremap_freepage(paddr_t paddr, int *pg_entry) {
+	int c_index;
+	int sw_slot;
+	struct coremap_entry *ce;
+	struct rmap *rm;
+	struct rmap *last;
+
+	KASSERT(pg_entry != NULL);
+
+	/* Mappings of the zero page hold no reference to it */
+	if (paddr == coremap->c_zeropage) {
+		return;
+	}
+
+	c_index = (int)(paddr / PAGE_SIZE);
+	ce = &coremap->c_entries[c_index];
+	sw_slot = -1;
+	rm = NULL;
+	last = NULL;
+
+	spinlock_acquire(&coremap->c_spinlock);
+
+	/* There is a possibility that a page daemon or some other process is
+	 * attempting to evict the page.  We must wait until that is no longer
+	 * the case.  Once we hold the spinlock and the coremap entry is no
+	 * longer marked as busy, nothing can swap out the page. */
+	while (ce->ce_busy) {
+		spinlock_release(&coremap->c_spinlock);
+		thread_yield();
+		spinlock_acquire(&coremap->c_spinlock);
+	}
+
+	KASSERT(ce->ce_allocated);
+	KASSERT(ce->ce_foruser);
+	KASSERT(ce->ce_refcount > 0);
+
+	if (ce->ce_rmap != NULL) {
+
+		/* The page is in the page cache or shared.  Take pg_entry off
+		 * its reverse map. */
+		rm = coremap_rmapremove(c_index, pg_entry);
+
+		/* When a shared anonymous page is down to one mapping, that
+		 * mapping owns it again, and can write to it in place or have
+		 * it evicted like any private page */
+		if (ce->ce_vnode == NULL && ce->ce_refcount == 2) {
+			last = ce->ce_rmap;
+			KASSERT(last->rm_next == NULL);
+			ce->ce_rmap = NULL;
+			ce->ce_addrspace = last->rm_as;
+			ce->ce_pgentry = last->rm_pgentry;
+		}
+
+	} else {
+
+		/* The owner is giving up the page */
+		KASSERT(ce->ce_refcount == 1);
+		KASSERT(ce->ce_pgentry == pg_entry);
+		ce->ce_addrspace = NULL;
+		ce->ce_pgentry = NULL;
+	}
+
+	ce->ce_refcount--;
+
+	if (ce->ce_refcount == 0) {
+
+		/* Once nothing maps a page cache page, it leaves the page
+		 * cache */
+		if (ce->ce_vnode != NULL) {
+			pagecache_remove(c_index);
+		}
+
+		/* Free the physical page, along with its copy in the swap
+		 * file if it has one */
+		sw_slot = ce->ce_swapoffset;
+		ce->ce_swapoffset = -1;
+		coremap_freeframe(c_index);
+	}
+
+	spinlock_release(&coremap->c_spinlock);
+
+	if (rm != NULL) {
+		kfree(rm);
+	}
+	if (last != NULL) {
+		kfree(last);
+	}
+
+	if (sw_slot >= 0) {
+		sw_freeslot((unsigned)sw_slot);
+	}
+}
+
+/*
+ * coremap_dirtypage
+ *
+ * Called by vm_fault on the first write to a clean user page.  The copy of
+ * the page in the swap file, if any, is about to become stale, so we forget
+ * it and return its offset location for the caller to free.  Returns -1 if
+ * the page has no copy in the swap file.
+ */
+int
+coremap_dirtypage(paddr_t paddr) {
+	int c_index;
+	int sw_slot;
+
+	c_index = (int)(paddr / PAGE_SIZE);
+
+	spinlock_acquire(&coremap->c_spinlock);
+	KASSERT(coremap->c_entries[c_index].ce_allocated);
+	KASSERT(coremap->c_entries[c_index].ce_foruser);
+	sw_slot = coremap->c_entries[c_index].ce_swapoffset;
+	coremap->c_entries[c_index].ce_swapoffset = -1;
+	spinlock_release(&coremap->c_spinlock);
+
+	return sw_slot;
+}
+
+/*
+ * coremap_touchpage
+ *
+ * Called by vm_fault whenever it loads a TLB entry for a user page.  Sets the
+ * reference bit of the page so that the clock algorithm gives it a second
+ * chance.  A page in active use can go on being used through its TLB
+ * entries for a long time without faulting, as vmtlb_load only replaces
+ * entries when the TLB is full and ASIDs keep them across context switches.
+ * So when the clock hand clears the bit, sw_getpage also invalidates the
+ * page's TLB entries, and the next access comes back here.
+ *
+ * This is on every fault, so it takes no lock.  The flags are single bytes
+ * stored on their own, and the clock hand only needs to see them eventually.
+ * A page read ahead may be counted as used and as wasted both, if it is
+ * evicted as it is touched; that only nudges the readahead window.
+ */
+void
+coremap_touchpage(paddr_t paddr) {
+	struct coremap_entry *ce;
+
+	if (paddr == coremap->c_zeropage) {
+		vmstat_inc(VMS_ZEROMAP);
+		return;
+	}
+
+	ce = &coremap->c_entries[paddr / PAGE_SIZE];
+	ce->ce_referenced = true;
+
+	/* A page read in ahead of time is being used.  sw_pagein widens the
+	 * readahead window accordingly. */
+	if (ce->ce_readahead) {
+		ce->ce_readahead = false;
+		vmstat_inc(VMS_RAHIT);
+	}
+}
+
+/*
+ * coremap_getcpumask
+ *
+ * Returns the mask of CPUs which may hold TLB entries for any mapping of the
+ * user page with coremap index c_index.  The caller must hold the coremap
+ * spinlock, or have marked the page as busy, which keeps its mappings from
+ * changing.
+ */
+uint32_t
+coremap_getcpumask(int c_index) {
+	struct coremap_entry *ce;
+	struct rmap *rm;
+	uint32_t cpumask;
+
+	ce = &coremap->c_entries[c_index];
+	KASSERT(ce->ce_busy || spinlock_do_i_hold(&coremap->c_spinlock));
+
+	if (ce->ce_rmap == NULL) {
+		return as_getcpumask(ce->ce_addrspace);
+	}
+
+	cpumask = 0;
+	for (rm = ce->ce_rmap; rm != NULL; rm = rm->rm_next) {
+		cpumask |= as_getcpumask(rm->rm_as);
+	}
+
+	return cpumask;
+}
+
+/*
+ * coremap_setmapsbusy
+ *
+ * Marks every page table entry on the reverse map of the page with coremap
+ * index c_index as busy, so that the page can be evicted.  If one of them is
+ * busy already, those marked so far are released again and we return false.
+ * The page daemon must have marked the page as busy.
+ */
+bool
+coremap_setmapsbusy(int c_index) {
+	struct rmap *rm;
+	struct rmap *undo;
+
+	KASSERT(coremap->c_entries[c_index].ce_busy);
+	KASSERT(coremap->c_entries[c_index].ce_rmap != NULL);
+
+	for (rm = coremap->c_entries[c_index].ce_rmap; rm != NULL;
+	rm = rm->rm_next) {
+
+		pte_lock(rm->rm_pgentry);
+
+		if (*rm->rm_pgentry & PG_BUSY) {
+			pte_unlock(rm->rm_pgentry);
+
+			for (undo = coremap->c_entries[c_index].ce_rmap;
+			undo != rm; undo = undo->rm_next) {
+				pte_clearbusy(undo->rm_pgentry);
+			}
+			return false;
+		}
+
+		KASSERT(*rm->rm_pgentry & PG_VALID);
+		KASSERT((*rm->rm_pgentry & PG_FRAME) == c_index);
+		*rm->rm_pgentry |= PG_BUSY;
+
+		pte_unlock(rm->rm_pgentry);
+	}
+
+	return true;
+}
+
+/*
+ * coremap_clearmapsbusy
+ *
+ * Gives up on evicting the page with coremap index c_index, whose mappings
+ * coremap_setmapsbusy has marked as busy: they are marked as no longer busy,
+ * unchanged.  The page daemon clears the busy mark of the page itself.
+ */
+void
+coremap_clearmapsbusy(int c_index) {
+	struct rmap *rm;
+
+	KASSERT(coremap->c_entries[c_index].ce_busy);
+
+	for (rm = coremap->c_entries[c_index].ce_rmap; rm != NULL;
+	rm = rm->rm_next) {
+		pte_clearbusy(rm->rm_pgentry);
+	}
+}
+
+/*
+ * coremap_zeroidle
+ *
+ * Called from the idle loop.  Zeroes one free user page and puts it in the
+ * pool of pages zeroed in advance, so that coremap_getpage does not have to
+ * zero it later.  Returns false if there was nothing to do: the pool is full,
+ * or free pages are running low and are better left to the page daemon.
+ */
+bool
+coremap_zeroidle(void) {
+	int c_index;
+
+	if (!coremap_ready()) {
+		return false;
+	}
+
+	spinlock_acquire(&coremap->c_spinlock);
+
+	if (coremap->c_nzeroed >= COREMAP_NZEROPAGES ||
+	coremap->c_upool.cp_nfree <= coremap->c_nzeroed + COREMAP_NZEROPAGES) {
+		spinlock_release(&coremap->c_spinlock);
+		return false;
+	}
+
+	c_index = coremap_allocblock(&coremap->c_upool, 0);
+	if (c_index < 0) {
+		spinlock_release(&coremap->c_spinlock);
+		return false;
+	}
+
+	/* The page is on no list while we zero it, so nobody else takes it */
+	spinlock_release(&coremap->c_spinlock);
+
+	bzero((void *)PADDR_TO_KVADDR(c_index * PAGE_SIZE), PAGE_SIZE);
+
+	spinlock_acquire(&coremap->c_spinlock);
+	KASSERT(!coremap->c_entries[c_index].ce_allocated);
+	KASSERT(coremap->c_entries[c_index].ce_order == -1);
+	coremap->c_entries[c_index].ce_freenext = coremap->c_zerolist;
+	coremap->c_zerolist = c_index;
+	coremap->c_nzeroed++;
+	coremap->c_upool.cp_nfree++;
+	spinlock_release(&coremap->c_spinlock);
+
+	return true;
+}
+
+/*
+ * coremap_countpages
+ *
+ * Counts the physical pages which are free, in use by user processes and in
+ * use by the kernel.  Pages held in the magazines or zeroed in advance are
+ * free.
+ */
+void
+coremap_countpages(unsigned *nfree, unsigned *nuser, unsigned *nkernel) {
+	struct coremap_entry *ce;
+
+	*nfree = 0;
+	*nuser = 0;
+	*nkernel = 0;
+
+	spinlock_acquire(&coremap->c_spinlock);
+	for (unsigned long i=0; i<coremap->c_npages; i++) {
+		ce = &coremap->c_entries[i];
+		if (!ce->ce_allocated) {
+			(*nfree)++;
+		} else if (ce->ce_foruser) {
+			(*nuser)++;
+		} else {
+			(*nkernel)++;
+		}
+	}
+	spinlock_release(&coremap->c_spinlock);
+}
+
+/*
+ * coremap_printstats
+ *
+ * Prints the paging statistics
+ */
+void
+coremap_printstats(void) {
+	unsigned ntlbfaults, npageins, nevictions, nclocksteps, nsecondchances;
+	unsigned ncleanevictions, nreadahead, nrahits, nramisses, rawindow;
+	unsigned nzeromaps;
+	unsigned nprezeroed, nzerofills, nzeroed;
+	unsigned nmaghits, nmagmisses, nmagfrees, nmagdrains, nmagframes;
+	struct coremap_magazine *cm;
+
+	nmaghits = nmagmisses = nmagfrees = nmagdrains = nmagframes = 0;
+
+	spinlock_acquire(&coremap->c_spinlock);
+	ncleanevictions = coremap->c_ncleanevictions;
+	nreadahead = coremap->c_nreadahead;
+	nramisses = coremap->c_nramisses;
+	rawindow = coremap->c_rawindow;
+	nclocksteps = coremap->c_nclocksteps;
+	nsecondchances = coremap->c_nsecondchances;
+	nprezeroed = coremap->c_nprezeroed;
+	nzerofills = coremap->c_nzerofills;
+	nzeroed = coremap->c_nzeroed;
+	for (unsigned c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		cm = &coremap_magazines[c];
+		spinlock_acquire(&cm->cm_lock);
+		nmaghits += cm->cm_nhits;
+		nmagmisses += cm->cm_nmisses;
+		nmagfrees += cm->cm_nfrees;
+		nmagdrains += cm->cm_ndrains;
+		nmagframes += cm->cm_nframes;
+		nzerofills += cm->cm_nzerofills;
+		spinlock_release(&cm->cm_lock);
+	}
+	spinlock_release(&coremap->c_spinlock);
+
+	ntlbfaults = vmstat_count(VMS_TLBREFILL);
+	nrahits = vmstat_count(VMS_RAHIT);
+	nzeromaps = vmstat_count(VMS_ZEROMAP);
+	npageins = vmstat_count(VMS_PAGEIN);
+	nevictions = vmstat_count(VMS_EVICTION);
+
+	kprintf("vm: %u TLB faults, %u page-ins, %u evictions (%u clean)\n",
+		ntlbfaults, npageins, nevictions, ncleanevictions);
+	kprintf("vm: clock hand moved %u times, %u second chances\n",
+		nclocksteps, nsecondchances);
+	kprintf("vm: %u pages read ahead, %u hits, %u misses, window %u\n",
+		nreadahead, nrahits, nramisses, rawindow);
+	kprintf("vm: %u zero page mappings, %u pages zeroed in advance used, "
+		"%u zeroed on demand, %u in pool\n", nzeromaps, nprezeroed,
+		nzerofills, nzeroed);
+	kprintf("vm: page magazines: %u hits, %u misses, %u frees, %u drains, "
+		"%u pages held\n", nmaghits, nmagmisses, nmagfrees, nmagdrains,
+		nmagframes);
+}
@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <coremap.h>
+#include <kva.h>
 
 /*
  * Kernel malloc.
@@ -78,6 +82,11 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    The coremap entry of each page points back to its entry in that
+//    list, so that kfree can find it without searching. Only the few
+//    pages allocated before the coremap was set up have to be
+//    searched for.
+//
 
 ////////////////////////////////////////
 
@@ -125,8 +134,19 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * Besides the powers of two, there are sizes in between. Past the
+ * smallest sizes, each one is the largest multiple of 8 that still
+ * fits its number of blocks on a page. For example, 1360 fits three
+ * per page where 2048 fits two, which matters for PATH_MAX buffers
+ * (1024 bytes plus the label). Use "kh" to see how well the sizes fit
+ * what is actually being allocated.
+ */
+#define NSIZES 16
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 48, 64, 96, 128, 192,
+	256, 408, 512, 680, 816, 1024, 1360, 2048,
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
@@ -160,14 +180,122 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock protects the pages and their freelists. Most calls
+ * don't take it, though: they are served from the per-CPU magazines
+ * below, and only refilling or flushing a magazine goes to the pages.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+//    Each CPU keeps, for each block size, a small stack of free blocks
+//    (a magazine) that kmalloc and kfree use without touching
+//    kmalloc_spinlock. An empty magazine is refilled with a batch of
+//    blocks from the page freelists, and a full one gives a batch
+//    back, so the global lock is taken once per batch rather than
+//    once per call.
+//
+//    Blocks in magazines are not on their page's freelist and count as
+//    allocated, so a page can't be released while one of its blocks
+//    sits in a magazine. To bound the memory held this way, a magazine
+//    holds at most KMAG_BYTES worth of blocks, and block sizes that
+//    would get fewer than KMAG_MINBLOCKS are not cached at all. When
+//    the kernel runs out of pages, all magazines are drained.
+//
+//    Each magazine has a spinlock, which normally only its own CPU
+//    takes, so it stays in that CPU's cache. It is needed because a
+//    thread may move to another CPU after picking a magazine, and so
+//    that other CPUs can drain it. The magazine lock comes before
+//    kmalloc_spinlock.
+//
+//    Magazines are only used once the coremap is up: curcpu isn't
+//    usable before that, and kfree needs the pageref back-pointers in
+//    the coremap to find a block's size without kmalloc_spinlock.
+//
+
+#define KMAG_SIZE       16	/* most blocks a magazine holds */
+#define KMAG_BYTES      2048	/* most bytes a magazine holds */
+#define KMAG_MINBLOCKS  4	/* smallest magazine worth having */
+#define KMAG_NSIZES     11	/* block types up to 512 bytes have one */
+
+struct kmalloc_magazine {
+	struct spinlock km_lock;
+	vaddr_t km_blocks[KMAG_SIZE];	/* free blocks, most recent last */
+	unsigned km_nblocks;		/* number of blocks in km_blocks */
+	unsigned km_nallocs;		/* kmallocs served from here */
+	uint64_t km_nbytes;		/* bytes those kmallocs asked for */
+	unsigned km_nfrees;		/* kfrees taken in here */
+	unsigned km_nrefills;		/* batches fetched from the pages */
+	unsigned km_nflushes;		/* batches given back to the pages */
+};
+
+/* The magazines of each CPU, indexed by c_number and block type */
+static struct kmalloc_magazine
+kmag_magazines[TLBSHOOTDOWN_MAXCPUS][KMAG_NSIZES] = {
+	[0 ... TLBSHOOTDOWN_MAXCPUS-1] = {
+		[0 ... KMAG_NSIZES-1] = { .km_lock = SPINLOCK_INITIALIZER },
+	},
+};
+
+/*
+ * Return how many blocks of block type BLKTYPE a magazine holds, or 0
+ * if blocks of that size aren't cached.
+ */
+static
+unsigned
+kmag_capacity(unsigned blktype)
+{
+#ifdef CHECKGUARDS
+	/*
+	 * CHECKGUARDS checks the guard bands of every block not on a
+	 * freelist, and cached blocks are deadbeef. Don't cache.
+	 */
+	(void)blktype;
+	return 0;
+#else
+	unsigned capacity;
+
+	if (blktype >= KMAG_NSIZES) {
+		/* Too big to be worth caching; see KMAG_MINBLOCKS */
+		KASSERT(KMAG_BYTES / sizes[blktype] < KMAG_MINBLOCKS);
+		return 0;
+	}
+
+	capacity = KMAG_BYTES / sizes[blktype];
+	if (capacity > KMAG_SIZE) {
+		capacity = KMAG_SIZE;
+	}
+	if (capacity < KMAG_MINBLOCKS) {
+		capacity = 0;
+	}
+	return capacity;
+#endif
+}
+
+////////////////////////////////////////
+//
+// Size statistics.
+//
+//    For each block size we count the kmallocs served and the bytes
+//    they asked for, so kheap_printstats can show how much of each
+//    size is lost to internal fragmentation. Kmallocs served from a
+//    magazine are counted in the magazine, under its lock; the rest
+//    are counted here, under kmalloc_spinlock. Whole-page kmallocs
+//    are counted too.
+//
+
+struct kmalloc_sizestat {
+	unsigned ks_nallocs;		/* kmallocs served */
+	unsigned ks_npages;		/* pages they took (whole-page only) */
+	uint64_t ks_nbytes;		/* bytes they asked for */
+};
+
+static struct kmalloc_sizestat sizestats[NSIZES];
+static struct kmalloc_sizestat pagestats;
+
 ////////////////////////////////////////
 
 /*
@@ -345,6 +473,65 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Return where the back-pointer to the pageref of a kernel heap page
+ * lives: the ce_pageref field of the page's coremap entry. Returns NULL
+ * if the page has no coremap entry of its own, because the coremap is
+ * not set up (yet), or the page was taken before it was, or the address
+ * is not a kernel heap address at all.
+ */
+static
+struct pageref **
+pagerefslot(vaddr_t prpage)
+{
+	unsigned long index;
+
+	if (!coremap_ready() || prpage < MIPS_KSEG0 || prpage >= MIPS_KSEG1) {
+		return NULL;
+	}
+
+	index = (prpage - MIPS_KSEG0) / PAGE_SIZE;
+	if (index < (unsigned long)coremap->c_kernelpbase ||
+	    index >= coremap->c_npages) {
+		return NULL;
+	}
+
+	return &coremap->c_entries[index].ce_pageref;
+}
+
+/*
+ * Find the pageref of the kernel heap page holding ptraddr, or return
+ * NULL if it is not on any heap page we recognize.
+ */
+static
+struct pageref *
+findpageref(vaddr_t ptraddr)
+{
+	struct pageref **slot;
+	struct pageref *pr;
+	vaddr_t prpage;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = ptraddr & PAGE_FRAME;
+
+	slot = pagerefslot(prpage);
+	if (slot != NULL) {
+		pr = *slot;
+		KASSERT(pr == NULL || PR_PAGEADDR(pr) == prpage);
+		return pr;
+	}
+
+	/* No back-pointer; search */
+	for (pr = allbase; pr; pr = pr->next_all) {
+		if (PR_PAGEADDR(pr) == prpage) {
+			return pr;
+		}
+	}
+
+	return NULL;
+}
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -794,6 +981,129 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * Print how the per-CPU magazines of each block size are doing, summed
+ * over all CPUs.
+ */
+static
+void
+kmag_printstats(void)
+{
+	struct kmalloc_magazine *km;
+	unsigned blktype, c;
+	unsigned nblocks, nallocs, nfrees, nrefills, nflushes;
+
+	kprintf("Per-CPU magazines:\n");
+
+	for (blktype=0; blktype<KMAG_NSIZES; blktype++) {
+		if (kmag_capacity(blktype) == 0) {
+			continue;
+		}
+
+		nblocks = nallocs = nfrees = nrefills = nflushes = 0;
+		for (c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+			km = &kmag_magazines[c][blktype];
+			spinlock_acquire(&km->km_lock);
+			nblocks += km->km_nblocks;
+			nallocs += km->km_nallocs;
+			nfrees += km->km_nfrees;
+			nrefills += km->km_nrefills;
+			nflushes += km->km_nflushes;
+			spinlock_release(&km->km_lock);
+		}
+
+		kprintf("size %-4lu  %u cached, %u allocs, %u frees, "
+			"%u refills, %u flushes\n",
+			(unsigned long) sizes[blktype], nblocks, nallocs,
+			nfrees, nrefills, nflushes);
+	}
+}
+
+/*
+ * Print, for each block size, how many blocks are in use and how much
+ * of them goes unused: the part of each block beyond what was asked
+ * for (estimated from the average request) plus the tail of each page
+ * that is too small for another block.
+ */
+static
+void
+sizestats_print(void)
+{
+	struct kmalloc_sizestat stats[NSIZES], pstats;
+	unsigned npages[NSIZES], nfree[NSIZES];
+	struct kmalloc_magazine *km;
+	struct pageref *pr;
+	unsigned blktype, c;
+	unsigned perpage, tail, ninuse, avg, frag, wasted, totalwasted;
+	size_t size;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		stats[blktype] = sizestats[blktype];
+		npages[blktype] = 0;
+		nfree[blktype] = 0;
+	}
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		blktype = PR_BLOCKTYPE(pr);
+		KASSERT(blktype < NSIZES);
+		npages[blktype]++;
+		nfree[blktype] += pr->nfree;
+	}
+	pstats = pagestats;
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Blocks in magazines are free, though their pages count them not */
+	for (c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		for (blktype=0; blktype<KMAG_NSIZES; blktype++) {
+			km = &kmag_magazines[c][blktype];
+			spinlock_acquire(&km->km_lock);
+			stats[blktype].ks_nallocs += km->km_nallocs;
+			stats[blktype].ks_nbytes += km->km_nbytes;
+			nfree[blktype] += km->km_nblocks;
+			spinlock_release(&km->km_lock);
+		}
+	}
+
+	kprintf("Size classes:\n");
+
+	totalwasted = 0;
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		if (npages[blktype] == 0 && stats[blktype].ks_nallocs == 0) {
+			continue;
+		}
+
+		size = sizes[blktype];
+		perpage = PAGE_SIZE / size;
+		tail = PAGE_SIZE - perpage * size;
+		ninuse = npages[blktype] * perpage - nfree[blktype];
+		avg = frag = 0;
+		if (stats[blktype].ks_nallocs > 0) {
+			avg = stats[blktype].ks_nbytes /
+				stats[blktype].ks_nallocs;
+			frag = 100 - stats[blktype].ks_nbytes * 100 /
+				((uint64_t)stats[blktype].ks_nallocs * size);
+		}
+		wasted = ninuse * (size - avg) + npages[blktype] * tail;
+		totalwasted += wasted;
+
+		kprintf("size %-4lu  %u pages, %u in use, %u allocs, "
+			"avg %u bytes, %u%% internal, %u bytes wasted\n",
+			(unsigned long) size, npages[blktype], ninuse,
+			stats[blktype].ks_nallocs, avg, frag, wasted);
+	}
+
+	avg = frag = 0;
+	if (pstats.ks_nallocs > 0) {
+		avg = pstats.ks_nbytes / pstats.ks_nallocs;
+		frag = 100 - pstats.ks_nbytes * 100 /
+			((uint64_t)pstats.ks_npages * PAGE_SIZE);
+	}
+	kprintf("pages      %u allocs, %u pages, avg %u bytes, "
+		"%u%% internal\n",
+		pstats.ks_nallocs, pstats.ks_npages, avg, frag);
+	kprintf("Subpage bytes wasted: %u\n", totalwasted);
+}
+
 /*
  * Print the whole heap.
  */
@@ -812,6 +1122,9 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmag_printstats();
+	sizestats_print();
 }
 
 ////////////////////////////////////////
@@ -867,47 +1180,55 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take the first block off the freelist of page PR, which must have a
+ * free block.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_popblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
 
-	checksubpages();
+	return retptr;
+}
+
+/*
+ * Take a free block of block type BLKTYPE from whichever page has
+ * one. Returns NULL if none does.
+ */
+static
+void *
+subpage_takeblock(unsigned blktype)
+{
+	struct pageref *pr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
@@ -916,56 +1237,309 @@ subpage_kmalloc(size_t sz
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
+			return subpage_popblock(pr);
+		}
+	}
 
-		doalloc: /* comes here after getting a whole fresh page */
+	return NULL;
+}
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+/*
+ * Put the block at BLOCKADDR back on the freelist of its page PR. The
+ * block must already be deadbeefed. If that frees the whole page,
+ * release it; this drops kmalloc_spinlock for a while. Returns the
+ * number of pages released.
+ */
+static
+unsigned
+subpage_putblock(struct pageref *pr, vaddr_t blockaddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
+	offset = blockaddr - prpage;
+	KASSERT(offset + sizes[blktype] <= PAGE_SIZE);
+	KASSERT(offset % sizes[blktype] == 0);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)blockaddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
 #endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree < PAGE_SIZE / sizes[blktype]) {
+		return 0;
+	}
+
+	/* Whole page is free. */
+	remove_lists(pr, blktype);
+	if (pagerefslot(prpage) != NULL) {
+		*pagerefslot(prpage) = NULL;
+	}
+	freepageref(pr);
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	free_kpages(prpage);
+	spinlock_acquire(&kmalloc_spinlock);
+	return 1;
+}
+
+/*
+ * Give NBLOCKS deadbeefed blocks back to their pages. Returns the
+ * number of pages that became free and were released.
+ */
+static
+unsigned
+subpage_putblocks(const vaddr_t *blocks, unsigned nblocks)
+{
+	struct pageref *pr;
+	unsigned i, npages;
+
+	npages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<nblocks; i++) {
+		pr = findpageref(blocks[i]);
+		KASSERT(pr != NULL);
+		npages += subpage_putblock(pr, blocks[i]);
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	return npages;
+}
+
+////////////////////////////////////////
+
+/*
+ * Return the magazine of the current CPU for block type BLKTYPE, or
+ * NULL if there isn't one to use. We may be moved to another CPU right
+ * after, but then we just use that CPU's magazine, under its lock.
+ */
+static
+struct kmalloc_magazine *
+kmag_get(unsigned blktype)
+{
+	unsigned num;
+
+	if (kmag_capacity(blktype) == 0 || !coremap_ready()) {
+		return NULL;
+	}
+
+	num = curcpu->c_number;
+	KASSERT(num < TLBSHOOTDOWN_MAXCPUS);
+	return &kmag_magazines[num][blktype];
+}
+
+/*
+ * Take a free block of block type BLKTYPE from the current CPU's
+ * magazine, refilling it from the pages if it is empty, for a kmalloc
+ * of REQSZ bytes. Returns NULL if there is no magazine or the pages
+ * have no free blocks either.
+ */
+static
+void *
+kmag_alloc(unsigned blktype, size_t reqsz)
+{
+	struct kmalloc_magazine *km;
+	void *block;
+
+	km = kmag_get(blktype);
+	if (km == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&km->km_lock);
+
+	if (km->km_nblocks == 0) {
+		spinlock_acquire(&kmalloc_spinlock);
+		while (km->km_nblocks < kmag_capacity(blktype) / 2) {
+			block = subpage_takeblock(blktype);
+			if (block == NULL) {
+				break;
+			}
+			km->km_blocks[km->km_nblocks++] = (vaddr_t)block;
+		}
+		spinlock_release(&kmalloc_spinlock);
+
+		if (km->km_nblocks == 0) {
+			spinlock_release(&km->km_lock);
+			return NULL;
+		}
+		km->km_nrefills++;
+	}
 
-			checksubpages();
+	block = (void *)km->km_blocks[--km->km_nblocks];
+	km->km_nallocs++;
+	km->km_nbytes += reqsz;
+
+	spinlock_release(&km->km_lock);
+	return block;
+}
+
+/*
+ * Put the deadbeefed block at BLOCKADDR, of block type BLKTYPE, in the
+ * current CPU's magazine. If the magazine is full, the older half of it
+ * goes back to the pages first. Returns false if there is no magazine.
+ */
+static
+bool
+kmag_free(unsigned blktype, vaddr_t blockaddr)
+{
+	struct kmalloc_magazine *km;
+	vaddr_t flush[KMAG_SIZE];
+	unsigned capacity, nflush, i;
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+	km = kmag_get(blktype);
+	if (km == NULL) {
+		return false;
+	}
+	capacity = kmag_capacity(blktype);
+	nflush = 0;
+
+	spinlock_acquire(&km->km_lock);
+
+	if (km->km_nblocks == capacity) {
+		nflush = capacity / 2;
+		for (i=0; i<nflush; i++) {
+			flush[i] = km->km_blocks[i];
+		}
+		for (i=nflush; i<capacity; i++) {
+			km->km_blocks[i - nflush] = km->km_blocks[i];
 		}
+		km->km_nblocks -= nflush;
+		km->km_nflushes++;
 	}
 
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
+	km->km_blocks[km->km_nblocks++] = blockaddr;
+	km->km_nfrees++;
+
+	spinlock_release(&km->km_lock);
+
+	/* Give the flushed blocks back without holding the magazine. */
+	if (nflush > 0) {
+		subpage_putblocks(flush, nflush);
+	}
+
+	return true;
+}
+
+/*
+ * Empty the magazines of all CPUs into the pages. Returns the number
+ * of pages that became free and were released.
+ */
+static
+unsigned
+kmag_drain(void)
+{
+	struct kmalloc_magazine *km;
+	vaddr_t blocks[KMAG_SIZE];
+	unsigned c, blktype, nblocks, i, npages;
+
+	npages = 0;
+
+	for (c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		for (blktype=0; blktype<KMAG_NSIZES; blktype++) {
+			km = &kmag_magazines[c][blktype];
+
+			spinlock_acquire(&km->km_lock);
+			nblocks = km->km_nblocks;
+			for (i=0; i<nblocks; i++) {
+				blocks[i] = km->km_blocks[i];
+			}
+			km->km_nblocks = 0;
+			spinlock_release(&km->km_lock);
+
+			if (nblocks > 0) {
+				npages += subpage_putblocks(blocks, nblocks);
+			}
+		}
+	}
+
+	return npages;
+}
+
+/*
+ * Get NPAGES pages for the kernel heap. If there are none, blocks
+ * sitting in the magazines may be all that holds some heap pages, so
+ * drain the magazines and try again.
+ */
+static
+vaddr_t
+kmalloc_getpages(unsigned long npages)
+{
+	vaddr_t address;
+
+	address = alloc_kpages(npages);
+	if (address == 0 && kmag_drain() > 0) {
+		address = alloc_kpages(npages);
+	}
+	return address;
+}
+
+////////////////////////////////////////
+
+/*
+ * Get a fresh page, carve it into free blocks of block type BLKTYPE
+ * and return its pageref. Returns NULL if out of memory.
+ *
+ * We release the spinlock while getting the page. This avoids
+ * deadlock if alloc_kpages needs to come back here. Note that this
+ * means things can change behind our back...
+ */
+static
+struct pageref *
+subpage_newpage(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+
+	volatile int i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
+	prpage = kmalloc_getpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
+		spinlock_acquire(&kmalloc_spinlock);
 		return NULL;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
@@ -981,6 +1555,7 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
+		spinlock_acquire(&kmalloc_spinlock);
 		return NULL;
 	}
 
@@ -1011,8 +1586,82 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	if (pagerefslot(prpage) != NULL) {
+		KASSERT(*pagerefslot(prpage) == NULL);
+		*pagerefslot(prpage) = pr;
+	}
+
+	return pr;
+}
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're allocating from
+	void *retptr;		// our result
+	size_t reqsz;		// size the caller asked for
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+	reqsz = sz;
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+	sz = sizes[blktype];
+
+	retptr = kmag_alloc(blktype, reqsz);
+	if (retptr == NULL) {
+		spinlock_acquire(&kmalloc_spinlock);
+
+		checksubpages();
+
+		retptr = subpage_takeblock(blktype);
+		if (retptr == NULL) {
+			/* No page of the right size available. */
+			pr = subpage_newpage(blktype);
+			if (pr == NULL) {
+				spinlock_release(&kmalloc_spinlock);
+				return NULL;
+			}
+			retptr = subpage_popblock(pr);
+		}
+		sizestats[blktype].ks_nallocs++;
+		sizestats[blktype].ks_nbytes += reqsz;
+
+		checksubpages();
+
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+
+	return retptr;
 }
 
 /*
@@ -1025,10 +1674,9 @@ subpage_kfree(void *ptr)
 {
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
+	struct pageref **slot;	// where the back-pointer to pr lives
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1059,34 +1707,40 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
+	/*
+	 * If the page has a back-pointer, we can look at its pageref
+	 * without kmalloc_spinlock: while the block is allocated the
+	 * page can't be released, and a page that isn't ours stays
+	 * that way until the caller frees it.
+	 */
+	slot = pagerefslot(ptraddr & PAGE_FRAME);
+	if (slot != NULL) {
+		pr = *slot;
+	}
+	else {
+		spinlock_acquire(&kmalloc_spinlock);
+		pr = findpageref(ptraddr);
+		spinlock_release(&kmalloc_spinlock);
 	}
-
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
 	offset = ptraddr - prpage;
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	/*
+	 * Check for proper positioning and alignment. The sizes need
+	 * not divide the page, so also check we aren't in the tail.
+	 */
+	if (offset + sizes[blktype] > PAGE_SIZE ||
+	    offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -1102,54 +1756,11 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	if (kmag_free(blktype, ptraddr)) {
+		return 0;
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
-
+	subpage_putblocks(&ptraddr, 1);
 	return 0;
 }
 
@@ -1177,18 +1788,36 @@ kmalloc(size_t sz)
 #endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+	if (checksz > LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
+
+		/*
+		 * Map more than one page into kseg2, so that we don't
+		 * need a contiguous run of physical pages. Fall back on
+		 * one if that fails, or until the VM system is up.
+		 */
+		address = 0;
+		if (npages > 1) {
+			address = kva_alloc(npages);
+		}
+		if (address == 0) {
+			address = kmalloc_getpages(npages);
+		}
 		if (address==0) {
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
+		spinlock_acquire(&kmalloc_spinlock);
+		pagestats.ks_nallocs++;
+		pagestats.ks_npages += npages;
+		pagestats.ks_nbytes += sz;
+		spinlock_release(&kmalloc_spinlock);
+
 		return (void *)address;
 	}
 
@@ -1210,6 +1839,8 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
+	} else if (kva_owns((vaddr_t)ptr)) {
+		kva_free((vaddr_t)ptr);
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
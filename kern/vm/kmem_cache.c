@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches.  See kmem_cache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+/* Alignment of objects within a slab */
+#define KMEM_ALIGN 8
+
+/* Number of completely free slabs a cache holds on to before it starts
+ * giving pages back */
+#define KMEM_MAXEMPTY 1
+
+/*
+ * Each slab is one page.  It starts with a struct kmem_slab, and the rest
+ * is carved into objects, each followed by a struct kmem_bufctl.  The
+ * bufctl links the object into its slab's freelist, and records whether
+ * the object has been constructed yet.  (The link can't be kept in the
+ * object itself, as a free object keeps its constructed state.)
+ */
+struct kmem_bufctl {
+	struct kmem_bufctl *kb_next;	/* next free object in the slab */
+	bool kb_constructed;		/* constructor has run */
+};
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;	/* cache the slab belongs to */
+	struct kmem_slab *ks_next;	/* next slab on the same list */
+	struct kmem_slab *ks_prev;	/* previous slab on the same list */
+	struct kmem_bufctl *ks_freelist; /* free objects */
+	unsigned ks_nfree;		/* number of free objects */
+};
+
+/*
+ * A cache keeps its slabs on three lists, according to how many of their
+ * objects are free.  Objects are handed out from partly used slabs first,
+ * so that completely free ones can go back to the VM system.
+ */
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size */
+	size_t kc_bufctloffset;		/* offset of the bufctl in an object */
+	size_t kc_stride;		/* object and bufctl, aligned */
+	size_t kc_firstoffset;		/* offset of the first object */
+	unsigned kc_perslab;		/* objects per slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects the rest */
+	struct kmem_slab *kc_partial;	/* slabs with some objects free */
+	struct kmem_slab *kc_full;	/* slabs with no objects free */
+	struct kmem_slab *kc_empty;	/* slabs with every object free */
+	unsigned kc_nslabs;		/* slabs in the cache */
+	unsigned kc_nempty;		/* slabs on kc_empty */
+	unsigned kc_ninuse;		/* objects handed out */
+	unsigned kc_nallocs;		/* objects ever handed out */
+	unsigned kc_nctors;		/* constructor calls */
+
+	struct kmem_cache *kc_next;	/* on the list of all caches */
+};
+
+/* The list of all caches, for statistics */
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+/*
+ * kmem_bufctl
+ *
+ * Returns the bufctl of object number N in a slab
+ */
+static
+struct kmem_bufctl *
+kmem_bufctl(struct kmem_cache *kc, struct kmem_slab *slab, unsigned n)
+{
+	return (struct kmem_bufctl *)((vaddr_t)slab + kc->kc_firstoffset +
+		n * kc->kc_stride + kc->kc_bufctloffset);
+}
+
+/*
+ * kmem_slablist
+ *
+ * Returns the list on which a slab with NFREE free objects belongs.
+ * Called with the cache lock held.
+ */
+static
+struct kmem_slab **
+kmem_slablist(struct kmem_cache *kc, unsigned nfree)
+{
+	if (nfree == 0) {
+		return &kc->kc_full;
+	} else if (nfree == kc->kc_perslab) {
+		return &kc->kc_empty;
+	} else {
+		return &kc->kc_partial;
+	}
+}
+
+/*
+ * kmem_slab_insert
+ *
+ * Puts a slab at the head of a list.  Called with the cache lock held.
+ */
+static
+void
+kmem_slab_insert(struct kmem_cache *kc, struct kmem_slab **list,
+		 struct kmem_slab *slab)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	slab->ks_prev = NULL;
+	slab->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = slab;
+	}
+	*list = slab;
+
+	if (list == &kc->kc_empty) {
+		kc->kc_nempty++;
+	}
+}
+
+/*
+ * kmem_slab_remove
+ *
+ * Takes a slab off the list it is on.  Called with the cache lock held.
+ */
+static
+void
+kmem_slab_remove(struct kmem_cache *kc, struct kmem_slab **list,
+		 struct kmem_slab *slab)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	if (slab->ks_prev != NULL) {
+		slab->ks_prev->ks_next = slab->ks_next;
+	} else {
+		KASSERT(*list == slab);
+		*list = slab->ks_next;
+	}
+	if (slab->ks_next != NULL) {
+		slab->ks_next->ks_prev = slab->ks_prev;
+	}
+	slab->ks_next = slab->ks_prev = NULL;
+
+	if (list == &kc->kc_empty) {
+		KASSERT(kc->kc_nempty > 0);
+		kc->kc_nempty--;
+	}
+}
+
+/*
+ * kmem_slab_move
+ *
+ * Moves a slab whose number of free objects went from OLDNFREE to its
+ * current count onto the right list.  Called with the cache lock held.
+ */
+static
+void
+kmem_slab_move(struct kmem_cache *kc, struct kmem_slab *slab,
+	       unsigned oldnfree)
+{
+	struct kmem_slab **from, **to;
+
+	from = kmem_slablist(kc, oldnfree);
+	to = kmem_slablist(kc, slab->ks_nfree);
+	if (from != to) {
+		kmem_slab_remove(kc, from, slab);
+		kmem_slab_insert(kc, to, slab);
+	}
+}
+
+/*
+ * kmem_slab_create
+ *
+ * Gets a page and lays it out as a slab of unconstructed free objects.
+ * Returns NULL if out of memory.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	struct kmem_bufctl *kb;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	slab = (struct kmem_slab *)page;
+	slab->ks_cache = kc;
+	slab->ks_next = slab->ks_prev = NULL;
+	slab->ks_freelist = NULL;
+	slab->ks_nfree = kc->kc_perslab;
+
+	/* Link the objects in address order */
+	for (i = kc->kc_perslab; i-- > 0; ) {
+		kb = kmem_bufctl(kc, slab, i);
+		kb->kb_constructed = false;
+		kb->kb_next = slab->ks_freelist;
+		slab->ks_freelist = kb;
+	}
+
+	return slab;
+}
+
+/*
+ * kmem_slab_destroy
+ *
+ * Runs the destructor on the constructed objects of a slab which has
+ * left its cache, and gives the page back.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+	struct kmem_bufctl *kb;
+	unsigned i;
+
+	KASSERT(slab->ks_nfree == kc->kc_perslab);
+
+	for (i=0; i<kc->kc_perslab; i++) {
+		kb = kmem_bufctl(kc, slab, i);
+		if (kb->kb_constructed && kc->kc_dtor != NULL) {
+			kc->kc_dtor((char *)kb - kc->kc_bufctloffset);
+		}
+	}
+
+	slab->ks_cache = NULL;
+	free_kpages((vaddr_t)slab);
+}
+
+/*
+ * kmem_cache_create
+ *
+ * Creates an object cache
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_bufctloffset = ROUNDUP(size, sizeof(void *));
+	kc->kc_stride = ROUNDUP(kc->kc_bufctloffset +
+				sizeof(struct kmem_bufctl), KMEM_ALIGN);
+	kc->kc_firstoffset = ROUNDUP(sizeof(struct kmem_slab), KMEM_ALIGN);
+	kc->kc_perslab = (PAGE_SIZE - kc->kc_firstoffset) / kc->kc_stride;
+	KASSERT(kc->kc_perslab > 0);
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_empty = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nempty = 0;
+	kc->kc_ninuse = 0;
+	kc->kc_nallocs = 0;
+	kc->kc_nctors = 0;
+
+	spinlock_acquire(&kmem_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_lock);
+
+	return kc;
+}
+
+/*
+ * kmem_cache_alloc
+ *
+ * Hands out an object from a cache, constructing it if it has never been
+ * used.  Returns NULL if out of memory or the constructor failed.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	struct kmem_bufctl *kb;
+	unsigned oldnfree;
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	slab = kc->kc_partial != NULL ? kc->kc_partial : kc->kc_empty;
+	if (slab == NULL) {
+		/* Get a new slab without the lock, as that may sleep.  If
+		 * someone else gets one meanwhile we keep both. */
+		spinlock_release(&kc->kc_lock);
+		slab = kmem_slab_create(kc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kmem_slab_insert(kc, &kc->kc_empty, slab);
+		kc->kc_nslabs++;
+		slab = kc->kc_partial != NULL ? kc->kc_partial : kc->kc_empty;
+	}
+
+	KASSERT(slab->ks_nfree > 0);
+	oldnfree = slab->ks_nfree;
+	kb = slab->ks_freelist;
+	slab->ks_freelist = kb->kb_next;
+	slab->ks_nfree--;
+	kmem_slab_move(kc, slab, oldnfree);
+
+	kc->kc_ninuse++;
+	kc->kc_nallocs++;
+
+	spinlock_release(&kc->kc_lock);
+
+	obj = (char *)kb - kc->kc_bufctloffset;
+
+	if (!kb->kb_constructed) {
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor(obj);
+			if (result) {
+				kmem_cache_free(kc, obj);
+				return NULL;
+			}
+		}
+		kb->kb_constructed = true;
+
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nctors++;
+		spinlock_release(&kc->kc_lock);
+	}
+
+	return obj;
+}
+
+/*
+ * kmem_cache_free
+ *
+ * Puts an object back in its cache.  If that leaves more completely free
+ * slabs than the cache holds on to, the slab goes back to the VM system.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *slab;
+	struct kmem_bufctl *kb;
+	vaddr_t offset;
+	unsigned oldnfree;
+	bool release;
+
+	KASSERT(obj != NULL);
+
+	slab = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(slab->ks_cache == kc);
+
+	offset = (vaddr_t)obj - (vaddr_t)slab;
+	if (offset < kc->kc_firstoffset ||
+	    (offset - kc->kc_firstoffset) % kc->kc_stride != 0 ||
+	    (offset - kc->kc_firstoffset) / kc->kc_stride >= kc->kc_perslab) {
+		panic("kmem_cache_free: %s: invalid object %p\n",
+		      kc->kc_name, obj);
+	}
+	kb = (struct kmem_bufctl *)((char *)obj + kc->kc_bufctloffset);
+
+	spinlock_acquire(&kc->kc_lock);
+
+	oldnfree = slab->ks_nfree;
+	KASSERT(oldnfree < kc->kc_perslab);
+	kb->kb_next = slab->ks_freelist;
+	slab->ks_freelist = kb;
+	slab->ks_nfree++;
+	kmem_slab_move(kc, slab, oldnfree);
+
+	KASSERT(kc->kc_ninuse > 0);
+	kc->kc_ninuse--;
+
+	release = false;
+	if (slab->ks_nfree == kc->kc_perslab &&
+	    kc->kc_nempty > KMEM_MAXEMPTY) {
+		kmem_slab_remove(kc, &kc->kc_empty, slab);
+		kc->kc_nslabs--;
+		release = true;
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	/* Destruct and free without the lock, as that may sleep */
+	if (release) {
+		kmem_slab_destroy(kc, slab);
+	}
+}
+
+/*
+ * kmem_cache_printstats
+ *
+ * Prints the pages and objects of each cache
+ */
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+
+	spinlock_acquire(&kmem_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("%-16s %4zu bytes, %3u/page: %u pages (%u free), "
+			"%u in use, %u allocs, %u constructed\n",
+			kc->kc_name, kc->kc_size, kc->kc_perslab,
+			kc->kc_nslabs, kc->kc_nempty, kc->kc_ninuse,
+			kc->kc_nallocs, kc->kc_nctors);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_lock);
+}
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel virtual allocator.  See kva.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
+#include <mips/tlb.h>
+#include <coremap.h>
+#include <vmtlb.h>
+#include <vmstat.h>
+#include <vm.h>
+#include <kva.h>
+
+/* States of a page which is not mapped.  A mapped page has a TLB entry
+ * instead, in which the TLB ignores the bits of KVA_SWBITS. */
+#define KVA_FREE	0x00000000	/* free */
+#define KVA_RESERVED	0x00000002	/* being mapped by kva_alloc */
+#define KVA_DIRTY	0x00000004	/* freed, may still be in a TLB */
+#define KVA_FLUSHING	0x00000006	/* freed, TLBs being flushed */
+
+/* Set in the entry of every page of an allocation but the last */
+#define KVA_MORE	0x00000001
+
+#define KVA_SWBITS	0x000000ff
+
+/* The table of the arena.  kva_ptes[i] describes the page at MIPS_KSEG2 +
+ * i * PAGE_SIZE.  Protected by kva_lock. */
+static struct spinlock kva_lock = SPINLOCK_INITIALIZER;
+static uint32_t *kva_ptes;
+static unsigned kva_npages;
+static unsigned kva_cursor;		/* where the next search starts */
+static unsigned kva_nfree;		/* free pages */
+static unsigned kva_ndirty;		/* dirty or flushing pages */
+
+/* Held while flushing, so that a flush only frees what it flushed */
+static struct lock *kva_flushlock;
+
+/* Statistics, protected by kva_lock */
+static unsigned kva_nallocs;		/* allocations */
+static unsigned kva_nallocpages;	/* pages in those allocations */
+static unsigned kva_nflushes;		/* TLB flushes freeing dirty pages */
+static unsigned kva_nfailures;		/* allocations which found no room */
+
+/*
+ * kva_findrun
+ *
+ * Looks for npages free pages in a row, next-fit.  On success sets *first to
+ * the first of them and moves the cursor past them.
+ */
+static
+bool
+kva_findrun(unsigned npages, unsigned *first)
+{
+	unsigned i, n, run;
+
+	KASSERT(spinlock_do_i_hold(&kva_lock));
+
+	if (npages > kva_nfree) {
+		return false;
+	}
+
+	/* Go round from the cursor, and on past it far enough to catch a run
+	 * which started just before it.  Runs do not wrap around. */
+	run = 0;
+	for (n=0; n<kva_npages + npages; n++) {
+		i = (kva_cursor + n) % kva_npages;
+		if (i == 0 || kva_ptes[i] != KVA_FREE) {
+			run = 0;
+		}
+		if (kva_ptes[i] != KVA_FREE) {
+			continue;
+		}
+		if (++run == npages) {
+			*first = i + 1 - npages;
+			kva_cursor = (i + 1) % kva_npages;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * kva_flush
+ *
+ * Flushes the TLB of every CPU and makes the dirty pages free.  oldflushes
+ * is kva_nflushes as the caller last saw it; if someone else has flushed
+ * since, we need not.  Returns false if there was nothing to flush.
+ */
+static
+bool
+kva_flush(unsigned oldflushes)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX + 1];
+	unsigned i, n;
+
+	lock_acquire(kva_flushlock);
+
+	spinlock_acquire(&kva_lock);
+	if (kva_nflushes != oldflushes) {
+		spinlock_release(&kva_lock);
+		lock_release(kva_flushlock);
+		return true;
+	}
+	n = 0;
+	for (i=0; i<kva_npages; i++) {
+		if (kva_ptes[i] == KVA_DIRTY) {
+			kva_ptes[i] = KVA_FLUSHING;
+			n++;
+		}
+	}
+	spinlock_release(&kva_lock);
+
+	if (n == 0) {
+		lock_release(kva_flushlock);
+		return false;
+	}
+
+	/* More mappings than TLBSHOOTDOWN_MAX flush the whole TLB, so the
+	 * contents of ts do not matter */
+	bzero(ts, sizeof(ts));
+	execute_tlbshootdown((uint32_t)-1, ts, TLBSHOOTDOWN_MAX + 1);
+
+	spinlock_acquire(&kva_lock);
+	for (i=0; i<kva_npages; i++) {
+		if (kva_ptes[i] == KVA_FLUSHING) {
+			kva_ptes[i] = KVA_FREE;
+		}
+	}
+	KASSERT(kva_ndirty >= n);
+	kva_ndirty -= n;
+	kva_nfree += n;
+	kva_nflushes++;
+	spinlock_release(&kva_lock);
+
+	lock_release(kva_flushlock);
+	return true;
+}
+
+/*
+ * kva_bootstrap
+ *
+ * Sets up the arena, with one page for each physical page
+ */
+void
+kva_bootstrap(void)
+{
+	uint32_t *ptes;
+	unsigned npages;
+
+	KASSERT(coremap_ready());
+
+	npages = coremap->c_npages;
+	if (npages > (0 - (vaddr_t)MIPS_KSEG2) / PAGE_SIZE) {
+		npages = (0 - (vaddr_t)MIPS_KSEG2) / PAGE_SIZE;
+	}
+
+	/* The arena is not up yet, so this comes from kseg0 */
+	ptes = kmalloc(npages * sizeof(uint32_t));
+	if (ptes == NULL) {
+		panic("kva_bootstrap: Out of memory\n");
+	}
+	for (unsigned i=0; i<npages; i++) {
+		ptes[i] = KVA_FREE;
+	}
+
+	kva_flushlock = lock_create("kva flush");
+	if (kva_flushlock == NULL) {
+		panic("kva_bootstrap: Out of memory\n");
+	}
+
+	spinlock_acquire(&kva_lock);
+	kva_npages = npages;
+	kva_nfree = npages;
+	kva_ndirty = 0;
+	kva_cursor = 0;
+	kva_ptes = ptes;
+	spinlock_release(&kva_lock);
+}
+
+/*
+ * kva_owns
+ *
+ * Returns whether addr lies in the arena
+ */
+bool
+kva_owns(vaddr_t addr)
+{
+	return addr >= MIPS_KSEG2 &&
+		(addr - MIPS_KSEG2) / PAGE_SIZE < kva_npages;
+}
+
+/*
+ * kva_unmap
+ *
+ * Undoes a kva_alloc which could only map the first nmapped of its npages
+ * pages.  Nothing has used the pages, so they are in no TLB and are free
+ * again at once.
+ */
+static
+void
+kva_unmap(unsigned first, unsigned nmapped, unsigned npages)
+{
+	uint32_t pte;
+
+	for (unsigned i=first; i<first+npages; i++) {
+		spinlock_acquire(&kva_lock);
+		pte = kva_ptes[i];
+		kva_ptes[i] = KVA_FREE;
+		spinlock_release(&kva_lock);
+
+		if (i < first + nmapped) {
+			KASSERT(pte & TLBLO_VALID);
+			coremap_freekpages(pte & TLBLO_PPAGE);
+		}
+		else {
+			KASSERT(pte == KVA_RESERVED);
+		}
+	}
+
+	spinlock_acquire(&kva_lock);
+	kva_nfree += npages;
+	spinlock_release(&kva_lock);
+}
+
+/*
+ * kva_alloc
+ *
+ * Allocates npages pages mapped at consecutive addresses in kseg2, and
+ * returns the address of the first.  The physical pages are gotten one at a
+ * time, so need not be contiguous.  Returns 0 if we run out of memory or of
+ * address space.
+ */
+vaddr_t
+kva_alloc(unsigned npages)
+{
+	unsigned first, i, oldflushes;
+	paddr_t paddr;
+
+	KASSERT(npages > 0);
+
+	if (kva_ptes == NULL) {
+		return 0;
+	}
+
+	/* Reserve the addresses, flushing the dirty ones free if need be */
+	spinlock_acquire(&kva_lock);
+	while (!kva_findrun(npages, &first)) {
+		oldflushes = kva_nflushes;
+		spinlock_release(&kva_lock);
+
+		if (!kva_flush(oldflushes)) {
+			spinlock_acquire(&kva_lock);
+			kva_nfailures++;
+			spinlock_release(&kva_lock);
+			return 0;
+		}
+
+		spinlock_acquire(&kva_lock);
+	}
+	for (i=first; i<first+npages; i++) {
+		kva_ptes[i] = KVA_RESERVED;
+	}
+	kva_nfree -= npages;
+	spinlock_release(&kva_lock);
+
+	/* Map each page.  The entries are global, so that they match any
+	 * ASID, and writable. */
+	for (i=0; i<npages; i++) {
+		paddr = coremap_getkpages(1);
+		if (paddr == 0) {
+			kva_unmap(first, i, npages);
+			return 0;
+		}
+
+		spinlock_acquire(&kva_lock);
+		KASSERT(kva_ptes[first + i] == KVA_RESERVED);
+		kva_ptes[first + i] = paddr | TLBLO_GLOBAL | TLBLO_VALID |
+			TLBLO_DIRTY | (i < npages - 1 ? KVA_MORE : 0);
+		spinlock_release(&kva_lock);
+	}
+
+	spinlock_acquire(&kva_lock);
+	kva_nallocs++;
+	kva_nallocpages += npages;
+	spinlock_release(&kva_lock);
+
+	return MIPS_KSEG2 + first * PAGE_SIZE;
+}
+
+/*
+ * kva_free
+ *
+ * Frees an allocation made by kva_alloc.  Its physical pages go back to the
+ * coremap; its addresses stay dirty until the next flush.
+ */
+void
+kva_free(vaddr_t addr)
+{
+	unsigned i;
+	uint32_t pte;
+
+	KASSERT(kva_owns(addr));
+
+	i = (addr - MIPS_KSEG2) / PAGE_SIZE;
+
+	spinlock_acquire(&kva_lock);
+	if (addr % PAGE_SIZE != 0 || !(kva_ptes[i] & TLBLO_VALID) ||
+	    (i > 0 && (kva_ptes[i - 1] & KVA_MORE))) {
+		panic("kva_free: invalid address %p\n", (void *)addr);
+	}
+	spinlock_release(&kva_lock);
+
+	do {
+		spinlock_acquire(&kva_lock);
+		pte = kva_ptes[i];
+		KASSERT(pte & TLBLO_VALID);
+		kva_ptes[i] = KVA_DIRTY;
+		kva_ndirty++;
+		spinlock_release(&kva_lock);
+
+		coremap_freekpages(pte & TLBLO_PPAGE);
+		i++;
+	} while (pte & KVA_MORE);
+}
+
+/*
+ * kva_fault
+ *
+ * Loads the TLB entry for a page in the arena.  Returns EFAULT if the page
+ * is not mapped, which makes the kernel panic.
+ */
+int
+kva_fault(int faulttype, vaddr_t faultaddress)
+{
+	uint32_t pte;
+
+	if (!kva_owns(faultaddress)) {
+		return EFAULT;
+	}
+
+	/* The arena is always mapped writable */
+	if (faulttype == VM_FAULT_READONLY) {
+		return EFAULT;
+	}
+
+	/* No lock: the page can only go away under whoever is using it */
+	pte = kva_ptes[(faultaddress - MIPS_KSEG2) / PAGE_SIZE];
+	if (!(pte & TLBLO_VALID)) {
+		return EFAULT;
+	}
+
+	vmtlb_load(faultaddress & TLBHI_VPAGE, pte & ~KVA_SWBITS);
+	vmstat_inc(VMS_TLBREFILL);
+
+	return 0;
+}
+
+/*
+ * kva_printstats
+ *
+ * Prints how much of the arena is in use, and the allocation and flush
+ * counters
+ */
+void
+kva_printstats(void)
+{
+	spinlock_acquire(&kva_lock);
+	kprintf("kva: %u/%u pages in use, %u dirty, %u allocs (%u pages), "
+		"%u flushes, %u failures\n",
+		kva_npages - kva_nfree - kva_ndirty, kva_npages, kva_ndirty,
+		kva_nallocs, kva_nallocpages, kva_nflushes, kva_nfailures);
+	spinlock_release(&kva_lock);
+}
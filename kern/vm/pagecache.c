@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Page cache for the text of executables and for mapped files.  See
+ * pagecache.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <stat.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+/* pc_buckets[i] is the coremap index of the first page in hash chain i, or
+ * -1 if the chain is empty.  Protected by the coremap spinlock. */
+static int pc_buckets[PC_NBUCKETS];
+
+/* Statistics, protected by the coremap spinlock */
+static unsigned pc_npages;		/* pages in the page cache */
+static unsigned pc_ninserts;		/* pages entered */
+static unsigned pc_nhits;		/* faults which found the page cached */
+static unsigned pc_nevictions;		/* pages evicted */
+static unsigned pc_nwritebacks;		/* pages written back on eviction */
+
+/*
+ * pc_hash
+ *
+ * Returns the hash chain of the page of vnode vn at file offset foffset
+ */
+static
+unsigned
+pc_hash(struct vnode *vn, off_t foffset)
+{
+	return ((uintptr_t)vn / sizeof(void *) +
+		(unsigned)(foffset / PAGE_SIZE)) % PC_NBUCKETS;
+}
+
+/*
+ * pc_lookup
+ *
+ * Returns the coremap index of the page of vnode vn at file offset foffset,
+ * or -1 if it is not in the page cache.  Called with the coremap spinlock
+ * held.
+ */
+static
+int
+pc_lookup(struct vnode *vn, off_t foffset)
+{
+	int c_index;
+	struct coremap_entry *ce;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	c_index = pc_buckets[pc_hash(vn, foffset)];
+	while (c_index >= 0) {
+		ce = &coremap->c_entries[c_index];
+		if (ce->ce_vnode == vn && ce->ce_foffset == foffset) {
+			return c_index;
+		}
+		c_index = ce->ce_hashnext;
+	}
+
+	return -1;
+}
+
+/*
+ * pagecache_bootstrap
+ *
+ * Sets up the empty page cache
+ */
+void
+pagecache_bootstrap(void)
+{
+	for (unsigned i=0; i<PC_NBUCKETS; i++) {
+		pc_buckets[i] = -1;
+	}
+}
+
+/*
+ * pagecache_map
+ *
+ * Maps the page of vnode vn at file offset foffset with pg_entry, if it is in
+ * the page cache.  The caller must have marked pg_entry as busy and valid.
+ * Returns false if the page is not in the page cache, in which case the
+ * caller reads it in itself.
+ */
+bool
+pagecache_map(struct vnode *vn, off_t foffset, int *pg_entry,
+	      struct addrspace *as)
+{
+	struct rmap *rm;
+	struct coremap_entry *ce;
+	int c_index;
+
+	KASSERT(*pg_entry & PG_BUSY);
+	KASSERT(*pg_entry & PG_VALID);
+
+	/* Allocate the reverse map entry up front, as we cannot do so with the
+	 * coremap spinlock held.  If there is no memory for it, the caller
+	 * simply gets a private page. */
+	rm = kmalloc(sizeof(struct rmap));
+	if (rm == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&coremap->c_spinlock);
+
+	/* A page being evicted is as good as gone */
+	c_index = pc_lookup(vn, foffset);
+	if (c_index < 0 || coremap->c_entries[c_index].ce_busy) {
+		spinlock_release(&coremap->c_spinlock);
+		kfree(rm);
+		return false;
+	}
+
+	ce = &coremap->c_entries[c_index];
+	KASSERT(ce->ce_allocated);
+	KASSERT(ce->ce_refcount > 0);
+
+	rm->rm_pgentry = pg_entry;
+	rm->rm_as = as;
+	rm->rm_next = ce->ce_rmap;
+	ce->ce_rmap = rm;
+	ce->ce_refcount++;
+	ce->ce_referenced = true;
+
+	*pg_entry &= ~PG_FRAME;
+	*pg_entry |= c_index;
+
+	pc_nhits++;
+
+	spinlock_release(&coremap->c_spinlock);
+	return true;
+}
+
+/*
+ * pagecache_insert
+ *
+ * Enters the page at paddr in the page cache as the page of vnode vn at file
+ * offset foffset.  The page must have just been read in by the caller, who
+ * owns it through pg_entry and must have marked pg_entry as busy.  If the
+ * page is already in the page cache, because another process read it in at
+ * the same time, we return EEXIST; if there is no memory for the reverse map,
+ * ENOMEM.  Either way the page is left private to the caller.
+ */
+int
+pagecache_insert(struct vnode *vn, off_t foffset, paddr_t paddr,
+		 int *pg_entry, struct addrspace *as)
+{
+	struct rmap *rm;
+	struct coremap_entry *ce;
+	int c_index;
+	unsigned bucket;
+
+	KASSERT(*pg_entry & PG_BUSY);
+
+	rm = kmalloc(sizeof(struct rmap));
+	if (rm == NULL) {
+		return ENOMEM;
+	}
+
+	c_index = (int)(paddr / PAGE_SIZE);
+	ce = &coremap->c_entries[c_index];
+
+	spinlock_acquire(&coremap->c_spinlock);
+
+	KASSERT(ce->ce_allocated);
+	KASSERT(ce->ce_foruser);
+	KASSERT(ce->ce_pgentry == pg_entry);
+	KASSERT(ce->ce_refcount == 1);
+	KASSERT(ce->ce_vnode == NULL);
+	KASSERT(ce->ce_swapoffset == -1);
+
+	/* The page daemon may be looking at the page.  It backs off, since
+	 * pg_entry is busy, but leave the page alone. */
+	if (ce->ce_busy || pc_lookup(vn, foffset) >= 0) {
+		spinlock_release(&coremap->c_spinlock);
+		kfree(rm);
+		return EEXIST;
+	}
+
+	/* The page no longer has a single owner.  Its one mapping so far goes
+	 * on the reverse map. */
+	ce->ce_addrspace = NULL;
+	ce->ce_pgentry = NULL;
+	rm->rm_pgentry = pg_entry;
+	rm->rm_as = as;
+	rm->rm_next = NULL;
+	ce->ce_rmap = rm;
+
+	ce->ce_vnode = vn;
+	ce->ce_foffset = foffset;
+	bucket = pc_hash(vn, foffset);
+	ce->ce_hashnext = pc_buckets[bucket];
+	pc_buckets[bucket] = c_index;
+
+	pc_npages++;
+	pc_ninserts++;
+
+	spinlock_release(&coremap->c_spinlock);
+	return 0;
+}
+
+/*
+ * pagecache_share
+ *
+ * Adds pg_entry, in address space as, to the mappings of the page cache page
+ * at paddr.  The caller must have marked another page table entry mapping the
+ * page as busy, so that the page cannot be evicted in the meantime.
+ */
+int
+pagecache_share(paddr_t paddr, int *pg_entry, struct addrspace *as)
+{
+	struct rmap *rm;
+	struct coremap_entry *ce;
+
+	rm = kmalloc(sizeof(struct rmap));
+	if (rm == NULL) {
+		return ENOMEM;
+	}
+
+	ce = &coremap->c_entries[paddr / PAGE_SIZE];
+
+	spinlock_acquire(&coremap->c_spinlock);
+
+	/* The page daemon may be going through the reverse map.  It backs off
+	 * once it finds the caller's page table entry busy. */
+	while (ce->ce_busy) {
+		spinlock_release(&coremap->c_spinlock);
+		thread_yield();
+		spinlock_acquire(&coremap->c_spinlock);
+	}
+
+	KASSERT(ce->ce_vnode != NULL);
+	KASSERT(ce->ce_refcount > 0);
+
+	rm->rm_pgentry = pg_entry;
+	rm->rm_as = as;
+	rm->rm_next = ce->ce_rmap;
+	ce->ce_rmap = rm;
+	ce->ce_refcount++;
+
+	spinlock_release(&coremap->c_spinlock);
+	return 0;
+}
+
+/*
+ * pagecache_remove
+ *
+ * Takes the page with coremap index c_index out of the page cache.  Nothing
+ * may map the page anymore.  Called with the coremap spinlock held.
+ */
+void
+pagecache_remove(int c_index)
+{
+	struct coremap_entry *ce;
+	int *prevp;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	ce = &coremap->c_entries[c_index];
+	KASSERT(ce->ce_vnode != NULL);
+	KASSERT(ce->ce_refcount == 0);
+	KASSERT(ce->ce_rmap == NULL);
+
+	prevp = &pc_buckets[pc_hash(ce->ce_vnode, ce->ce_foffset)];
+	while (*prevp != c_index) {
+		KASSERT(*prevp >= 0);
+		prevp = &coremap->c_entries[*prevp].ce_hashnext;
+	}
+	*prevp = ce->ce_hashnext;
+
+	ce->ce_vnode = NULL;
+	ce->ce_foffset = 0;
+	ce->ce_hashnext = -1;
+
+	pc_npages--;
+}
+
+/*
+ * pagecache_writeback
+ *
+ * Writes the page cache page with coremap index c_index back to its file if
+ * any page table entry mapping it is dirty.  Called by the page daemon once
+ * coremap_setmapsbusy has marked the mappings busy and their TLB entries are
+ * gone, so nobody can write to the page while we do.  The daemon must not
+ * wait for the file system: whoever holds the VFS lock may be waiting for
+ * the daemon to free a page.  If the lock is taken, we return EBUSY and the
+ * page is left for another time.
+ */
+int
+pagecache_writeback(int c_index)
+{
+	struct coremap_entry *ce;
+	struct rmap *rm;
+	bool dirty;
+	int result;
+
+	ce = &coremap->c_entries[c_index];
+	KASSERT(ce->ce_busy);
+
+	dirty = false;
+	for (rm = ce->ce_rmap; rm != NULL; rm = rm->rm_next) {
+		if (*rm->rm_pgentry & PG_DIRTY) {
+			dirty = true;
+		}
+	}
+	if (!dirty) {
+		return 0;
+	}
+
+	if (!vfs_biglock_tryacquire()) {
+		return EBUSY;
+	}
+	result = pagecache_writepage(ce->ce_vnode, ce->ce_foffset,
+				     (paddr_t)c_index * PAGE_SIZE);
+	vfs_biglock_release();
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&coremap->c_spinlock);
+	pc_nwritebacks++;
+	spinlock_release(&coremap->c_spinlock);
+
+	return 0;
+}
+
+/*
+ * pagecache_finishevict
+ *
+ * Completes the eviction of the page cache page with coremap index c_index,
+ * whose mappings coremap_setmapsbusy has marked as busy, and which is clean or
+ * has been written back: every page table entry mapping the page is cleared
+ * and reads the page from the file again on the next fault.  The page daemon
+ * frees the page itself.
+ */
+void
+pagecache_finishevict(int c_index)
+{
+	struct rmap *rmap;
+	struct rmap *rm;
+
+	/* Take the page out of the page cache first, so that the processes we
+	 * wake up below do not find it there again */
+	spinlock_acquire(&coremap->c_spinlock);
+	KASSERT(coremap->c_entries[c_index].ce_busy);
+	rmap = coremap->c_entries[c_index].ce_rmap;
+	coremap->c_entries[c_index].ce_rmap = NULL;
+	coremap->c_entries[c_index].ce_refcount = 0;
+	pagecache_remove(c_index);
+	pc_nevictions++;
+	spinlock_release(&coremap->c_spinlock);
+
+	while (rmap != NULL) {
+		rm = rmap;
+		rmap = rm->rm_next;
+
+		*rm->rm_pgentry = PG_BUSY;
+		pte_clearbusy(rm->rm_pgentry);
+		kfree(rm);
+	}
+}
+
+/*
+ * pagecache_writepage
+ *
+ * Writes the page at paddr to vnode vn at file offset foffset.  Only the part
+ * of the page within the file is written: a mapping may extend past the end
+ * of the file, but writing to it does not make the file longer.
+ */
+int
+pagecache_writepage(struct vnode *vn, off_t foffset, paddr_t paddr)
+{
+	struct stat st;
+	struct iovec iov;
+	struct uio ku;
+	size_t len;
+	int result;
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		return result;
+	}
+
+	if (foffset >= st.st_size) {
+		return 0;
+	}
+	len = PAGE_SIZE;
+	if (st.st_size - foffset < PAGE_SIZE) {
+		len = st.st_size - foffset;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), len, foffset,
+		  UIO_WRITE);
+	result = VOP_WRITE(vn, &ku);
+	if (result) {
+		return result;
+	}
+
+	return ku.uio_resid == 0 ? 0 : EIO;
+}
+
+/*
+ * pagecache_printstats
+ *
+ * Prints the page cache statistics
+ */
+void
+pagecache_printstats(void)
+{
+	unsigned npages, ninserts, nhits, nevictions, nwritebacks;
+
+	spinlock_acquire(&coremap->c_spinlock);
+	npages = pc_npages;
+	ninserts = pc_ninserts;
+	nhits = pc_nhits;
+	nevictions = pc_nevictions;
+	nwritebacks = pc_nwritebacks;
+	spinlock_release(&coremap->c_spinlock);
+
+	kprintf("vm: page cache holds %u pages; %u read in, %u shared, "
+		"%u evicted, %u written back\n", npages, ninserts, nhits,
+		nevictions, nwritebacks);
+}
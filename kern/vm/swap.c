@@ -33,18 +33,23 @@
 #include <cpu.h>
 #include <clock.h>
 #include <spinlock.h>
+#include <wchan.h>
 #include <synch.h>
-#include <bitmap.h>
 #include <vfs.h>
 #include <vm.h>
 #include <uio.h>
 #include <vnode.h>
 #include <coremap.h>
+#include <pagecache.h>
 #include <addrspace.h>
 #include <thread.h>
 #include <kern/fcntl.h>
 #include <kern/errno.h>
+#include <stat.h>
 #include <lamebus/lhd.h>
+#include <swapmap.h>
+#include <swapio.h>
+#include <vmstat.h>
 #include <swap.h>
 
 struct swap *kswap;
@@ -57,6 +62,8 @@ struct swap *kswap;
 void
 sw_bootstrap(void) {
 
+	struct stat st;
+	unsigned nslots;
 	int result;
 
 	/* Allocate space for the kernel swap structure */
@@ -65,13 +72,6 @@ sw_bootstrap(void) {
 		panic("kmalloc in sw_bootstrap failed\n");
 	}
 
-	/* Create the bitmap for tracking the offset locations available in the
-	 * swap file */
-	kswap->sw_diskoffset = bitmap_create((unsigned)SWAPFILE_SIZE);
-	if (kswap->sw_diskoffset == NULL) {
-		panic("bitmap_create in sw_bootstrap failed\n");
-	}
-
 	/* Create a swap file */
 	char swap_file_name[]="lhd0raw:";
 	result = vfs_open(swap_file_name, O_RDWR, 0, &kswap->sw_vn);
@@ -79,81 +79,271 @@ sw_bootstrap(void) {
 		panic("vfs_open in sw_bootstrap failed\n");
 	}
 
-	/* Create the tlbshootdown structure */
-	kswap->sw_ts = kmalloc(sizeof(const struct tlbshootdown));
-	if (kswap->sw_ts == NULL) {
+	/* Size the slot map from the swap disk.  The size of a raw disk is its
+	 * d_blocks times its block size.  Slot numbers are kept in the frame
+	 * bits of swapped out page table entries, which bounds how many we
+	 * can use. */
+	result = VOP_STAT(kswap->sw_vn, &st);
+	if (result) {
+		panic("VOP_STAT in sw_bootstrap failed\n");
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots > PG_FRAME + 1) {
+		nslots = PG_FRAME + 1;
+	}
+	if (nslots == 0) {
+		panic("sw_bootstrap: swap disk is smaller than a page\n");
+	}
+	swapmap_bootstrap(nslots);
+
+	/* No slot is shared yet */
+	kswap->sw_slotrefs = kmalloc(nslots * sizeof(uint16_t));
+	if (kswap->sw_slotrefs == NULL) {
 		panic("kmalloc in sw_bootstrap failed\n");
 	}
+	for (unsigned i=0; i<nslots; i++) {
+		kswap->sw_slotrefs[i] = 0;
+	}
+	spinlock_init(&kswap->sw_slotlock);
 
-	/* Create the lock which ensures updates to the offset locations in the
-	 * swap file are made atomically */
-	kswap->sw_disklock = lock_create("swap disk lock");
-	if (kswap->sw_disklock == NULL) {
-		panic("lock_create in sw_bootstrap failed\n");
+	kswap->sw_diskfull = false;
+
+	/* Set the free page watermarks of the page daemon based on the number
+	 * of pages available to user processes */
+	kswap->sw_lowater = coremap->c_upool.cp_npages / SW_LOWATER_DIV;
+	if (kswap->sw_lowater < SW_LOWATER_MIN) {
+		kswap->sw_lowater = SW_LOWATER_MIN;
+	}
+	kswap->sw_hiwater = coremap->c_upool.cp_npages / SW_HIWATER_DIV;
+	if (kswap->sw_hiwater < SW_HIWATER_MIN) {
+		kswap->sw_hiwater = SW_HIWATER_MIN;
 	}
 
-	/* Create the lock which protects sw_ts */
-	kswap->sw_tlbshootdown_lock = lock_create("swap tlbshootdown lock");
-	if (kswap->sw_tlbshootdown_lock == NULL) {
-		panic("lock_create in sw_bootstrap failed\n");
+	/* Create the wait channel the page daemon sleeps on */
+	kswap->sw_daemonwchan = wchan_create("page daemon");
+	if (kswap->sw_daemonwchan == NULL) {
+		panic("wchan_create in sw_bootstrap failed\n");
 	}
 
-	/* Create the semaphore which is used to communicate when tlbshootdowns
-	 * are complete */
-	kswap->sw_tlbshootdown_sem = sem_create("sw tlbshootdown sem", 0);
-	if (kswap->sw_tlbshootdown_sem == NULL) {
-		panic("sem_create in sw_bootstrap failed\n");
+	kswap->sw_nwriting = 0;
+	kswap->sw_evictfailed = false;
+
+	/* Start the swap I/O threads */
+	swapio_bootstrap();
+
+	/* Create the page daemon.  It sets kswap->sw_daemon once it is
+	 * running. */
+	kswap->sw_daemon = NULL;
+	result = thread_fork("page daemon", NULL, evicting, NULL, 0);
+	if (result) {
+		panic("thread_fork in sw_bootstrap failed\n");
 	}
 
-	kswap->sw_pgevicted = false;
+}
 
-	/* Create the page daemon... except that the page daemon is not working
-	 * right now so we comment it out.  :) */
-//	thread_fork("Page eviction thread", NULL, evicting, NULL, 0);
+/*
+ * Page replacement policy.  By default victims are chosen with the clock
+ * (second-chance) algorithm.  Define RANDOM_REPLACEMENT to pick victims at
+ * random instead, e.g. to compare fault rates between the two policies.
+ */
+#undef RANDOM_REPLACEMENT
 
+/*
+ * sw_evictable
+ *
+ * Returns whether the page represented by a coremap entry can be considered
+ * for eviction.  The page must be allocated to a user process and must not be
+ * in the process of being evicted already.  Pages in the page cache, and
+ * anonymous pages shared copy-on-write, can be evicted however many page
+ * tables map them, as their reverse map tells us where all of them are.
+ * Called with the coremap spinlock held.
+ */
+static
+bool
+sw_evictable(struct coremap_entry *ce) {
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	if (!ce->ce_allocated || ce->ce_busy || !ce->ce_foruser) {
+		return false;
+	}
+
+	return ce->ce_rmap != NULL || ce->ce_pgentry != NULL;
+}
+
+/*
+ * Pages whose reference bit the clock hand has cleared.  A page keeps being
+ * used through its TLB entries without faulting, so they are invalidated,
+ * once the coremap spinlock is released, for the next access to set the bit
+ * again.
+ */
+struct sw_refclear {
+	struct tlbshootdown rc_ts[TLBSHOOTDOWN_MAX];	/* pages, by paddr */
+	unsigned rc_npages;				/* number of pages */
+	uint32_t rc_cpumask;				/* CPUs to send to */
+};
+
+/*
+ * sw_selectvictim
+ *
+ * Selects a page for eviction and marks its coremap entry as busy.  Returns
+ * the index of the coremap entry, or -1 if no page can be evicted right now.
+ * Pages given a second chance are added to rc.  When rc is full, the sweep
+ * stops and -1 is returned, for the caller to invalidate their TLB entries
+ * and call us again.  Called with the coremap spinlock held.
+ */
+static
+int
+sw_selectvictim(struct sw_refclear *rc) {
+	int c_index;
+	struct coremap_entry *ce;
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+#ifdef RANDOM_REPLACEMENT
+
+	(void)rc;
+
+	/* Randomly select a page which isn't reserved for the kernel */
+	c_index = coremap->c_userpbase + (int)(random() % (coremap->c_npages -
+	coremap->c_userpbase));
+	ce = &coremap->c_entries[c_index];
+	if (!sw_evictable(ce)) {
+		return -1;
+	}
+
+#else
+
+	unsigned long nsteps;
+	unsigned long maxsteps;
+
+	/* Sweep the clock hand over the user pages.  A page whose reference
+	 * bit is set gets a second chance: we clear the bit and move on.  Two
+	 * full sweeps are enough to find a victim if one exists, since the
+	 * first sweep clears every reference bit it passes. */
+	maxsteps = 2 * (coremap->c_npages - coremap->c_userpbase);
+
+	for (nsteps = 0; nsteps < maxsteps; nsteps++) {
+		c_index = coremap->c_clockhand;
+		ce = &coremap->c_entries[c_index];
+
+		/* Advance the clock hand, wrapping around at the end of the
+		 * coremap */
+		coremap->c_clockhand++;
+		if (coremap->c_clockhand >= (int)coremap->c_npages) {
+			coremap->c_clockhand = coremap->c_userpbase;
+		}
+		coremap->c_nclocksteps++;
+
+		if (!sw_evictable(ce)) {
+			continue;
+		}
+
+		if (ce->ce_referenced) {
+			if (rc->rc_npages == TLBSHOOTDOWN_MAX) {
+				/* Come back to this page next time */
+				coremap->c_clockhand = c_index;
+				return -1;
+			}
+
+			ce->ce_referenced = false;
+			coremap->c_nsecondchances++;
+
+			rc->rc_ts[rc->rc_npages].ts_vaddr = 0;
+			rc->rc_ts[rc->rc_npages].ts_asid = 0;
+			rc->rc_ts[rc->rc_npages].ts_paddr =
+			(paddr_t)(c_index*PAGE_SIZE);
+			rc->rc_npages++;
+			rc->rc_cpumask |= coremap_getcpumask(c_index);
+			continue;
+		}
+
+		break;
+	}
+
+	if (nsteps == maxsteps) {
+		return -1;
+	}
+
+#endif
+
+	/* Mark the coremap entry as being busy */
+	ce->ce_busy = true;
+
+	return c_index;
 }
 
 /*
  * sw_getpage
  *
- * Picks a page for eviction
+ * Picks a page for eviction.  Returns false if no page can be evicted at the
+ * moment.  The page is not yet removed from the TLBs; sw_evictpages does that
+ * for a whole batch of pages at once.
  */
-void
+bool
 sw_getpage(paddr_t *paddr) {
 	int c_index;
+	bool rcfull;
 	paddr_t evicted_paddr;
+	struct sw_refclear rc;
 
 	while(1) {
+		rc.rc_npages = 0;
+		rc.rc_cpumask = 0;
+
 		/* Acquire the coremap spinlock */
 		spinlock_acquire(&coremap->c_spinlock);
 	
-		/* For simplicity sake, we randomly select a page which isn't
-		 * reserved for the kernel to be evicted */
-		c_index = coremap->c_userpbase + (int)(random() % (coremap->c_npages -
-		coremap->c_userpbase));
-
-		/* If the coremap entry indicates that the physical page is
-		 * free, or that it is already being evicted, or that it is
-		 * resreved for the kernel, then the page we selected cannot be
-		 * evicted.  We must try again later. */
-		if (!coremap->c_entries[c_index].ce_allocated ||
-		coremap->c_entries[c_index].ce_busy ||
-		!coremap->c_entries[c_index].ce_foruser) {
-			spinlock_release(&coremap->c_spinlock);
-			thread_yield();
-			continue;
+		/* Select a page which isn't reserved for the kernel to be
+		 * evicted */
+		c_index = sw_selectvictim(&rc);
+
+		/* Release the coremap spinlock */
+		spinlock_release(&coremap->c_spinlock);
+
+		/* Invalidate the TLB entries of the pages given a second
+		 * chance, with one round of shootdowns by physical address */
+		rcfull = rc.rc_npages == TLBSHOOTDOWN_MAX;
+		if (rc.rc_npages > 0) {
+			execute_tlbshootdown(rc.rc_cpumask, rc.rc_ts,
+			rc.rc_npages);
+		}
+
+		/* If no page can be evicted at the moment, the caller must try
+		 * again later, unless the sweep only stopped to get rid of the
+		 * TLB entries */
+		if (c_index < 0) {
+			if (rcfull) {
+				continue;
+			}
+			return false;
 
 		} else {
 
-			/* Mark the coremap entry as being busy */
-			coremap->c_entries[c_index].ce_busy = true;
-			
-			/* Release the coremap spinlock */
-			spinlock_release(&coremap->c_spinlock);
+			if (coremap->c_entries[c_index].ce_rmap != NULL) {
 
-			/* Acquire the lock in the address space which contains
-			 * the page table entry pointing to the physical page */
-			lock_acquire(coremap->c_entries[c_index].ce_addrspace->as_lock);
+				/* The page is in the page cache or shared.
+				 * Mark every page table entry mapping it as
+				 * busy, unless one of them is busy already. */
+				if (!coremap_setmapsbusy(c_index)) {
+					spinlock_acquire(&coremap->c_spinlock);
+					coremap->c_entries[c_index].ce_busy =
+					false;
+					spinlock_release(&coremap->c_spinlock);
+					thread_yield();
+					continue;
+				}
+
+				vmstat_inc(VMS_EVICTION);
+
+				*paddr = (paddr_t)(c_index*PAGE_SIZE);
+				return true;
+			}
+
+			/* Acquire the lock of the page table entry pointing
+			 * to the physical page.  The page has a single owner,
+			 * and keeps it while the coremap entry is busy: as_copy
+			 * waits for us before sharing the page. */
+			pte_lock(coremap->c_entries[c_index].ce_pgentry);
 
 			if (*coremap->c_entries[c_index].ce_pgentry & PG_BUSY ||
 			*coremap->c_entries[c_index].ce_pgentry &
@@ -161,10 +351,10 @@ sw_getpage(paddr_t *paddr) {
 
 				/* If the page table entry is marked as busy or
 				 * as swapped, we cannot evict the page.  We
-				 * release the address lock and mark the coremap
-				 * entry as not being busy. */
+				 * release the page table entry lock and mark
+				 * the coremap entry as not being busy. */
 
-				lock_release(coremap->c_entries[c_index].ce_addrspace->as_lock);
+				pte_unlock(coremap->c_entries[c_index].ce_pgentry);
 				spinlock_acquire(&coremap->c_spinlock);
 				coremap->c_entries[c_index].ce_busy = false;
 				spinlock_release(&coremap->c_spinlock);
@@ -189,232 +379,742 @@ sw_getpage(paddr_t *paddr) {
 				(paddr_t)((*coremap->c_entries[c_index].ce_pgentry
 				& PG_FRAME) << 12);
 				KASSERT(evicted_paddr == (paddr_t)(c_index*PAGE_SIZE));
-	
-				/* Execute the tlbshootdown */
-				execute_tlbshootdown(evicted_paddr);
 
-				/* Release the address space lock */
-				lock_release(coremap->c_entries[c_index].ce_addrspace->as_lock);
+				/* Release the page table entry lock */
+				pte_unlock(coremap->c_entries[c_index].ce_pgentry);
+
+				vmstat_inc(VMS_EVICTION);
 
 				/* Set the value of paddr to the page we wish to
 				 * evict */
 				*paddr = evicted_paddr;
 
-				break;
+				return true;
 
 			} else {
 				panic("sw_getpage should not get here\n");
 			}
 		}			
 	}
+}
+
+/*
+ * sw_shareslot
+ *
+ * Adds n references to swap slot sw_offset, which is about to be held by n
+ * more page table entries than the one it was allocated for
+ */
+static
+void
+sw_shareslot(unsigned sw_offset, unsigned n) {
 
+	if (n == 0) {
+		return;
+	}
 
+	spinlock_acquire(&kswap->sw_slotlock);
+	KASSERT(kswap->sw_slotrefs[sw_offset] + n <= SW_MAXSLOTREFS);
+	kswap->sw_slotrefs[sw_offset] += n;
+	spinlock_release(&kswap->sw_slotlock);
 }
 
 /*
- * sw_evictpage
+ * sw_finishevict
  *
- * Performs the actual page eviction
+ * Completes the eviction of a page by pointing the page table entries which
+ * referenced it at swap slot sw_slot, or clearing them if sw_slot is -1, and
+ * waking up any threads which have been waiting for the page eviction to be
+ * completed.  A page shared copy-on-write leaves every one of its mappings
+ * holding a reference to the same swap slot.
  */
-int
-sw_evictpage(paddr_t paddr) {
+static
+void
+sw_finishevict(int c_index, int sw_slot) {
+	struct coremap_entry *ce;
+	struct rmap *rmap;
+	struct rmap *rm;
+	unsigned nmaps;
+	int new_entry;
+
+	ce = &coremap->c_entries[c_index];
+	new_entry = sw_slot >= 0 ? (PG_SWAP | sw_slot) : 0;
+
+	if (ce->ce_rmap == NULL) {
+		*ce->ce_pgentry = new_entry | PG_BUSY;
+		pte_clearbusy(ce->ce_pgentry);
+		return;
+	}
+
+	/* Nobody else changes the reverse map of a busy page, but take it
+	 * off under the spinlock for the clock hand's sake */
+	spinlock_acquire(&coremap->c_spinlock);
+	KASSERT(ce->ce_busy);
+	KASSERT(ce->ce_vnode == NULL);
+	rmap = ce->ce_rmap;
+	nmaps = ce->ce_refcount;
+	ce->ce_rmap = NULL;
+	ce->ce_refcount = 0;
+	spinlock_release(&coremap->c_spinlock);
+
+	/* The swap slot must count all of its holders before any of them can
+	 * let go of it */
+	if (sw_slot >= 0) {
+		sw_shareslot((unsigned)sw_slot, nmaps - 1);
+	}
+
+	while (rmap != NULL) {
+		rm = rmap;
+		rmap = rm->rm_next;
+
+		*rm->rm_pgentry = new_entry | PG_BUSY;
+		pte_clearbusy(rm->rm_pgentry);
+		kfree(rm);
+	}
+}
+
+/*
+ * sw_abortevict
+ *
+ * Gives up on evicting a page.  The page table entries which reference it are
+ * marked as no longer busy, unchanged, which wakes up any threads waiting on
+ * them.  The caller clears the busy mark of the page itself.
+ */
+static
+void
+sw_abortevict(int c_index) {
+
+	if (coremap->c_entries[c_index].ce_rmap != NULL) {
+		coremap_clearmapsbusy(c_index);
+	} else {
+		pte_clearbusy(coremap->c_entries[c_index].ce_pgentry);
+	}
+}
+
+/*
+ * sw_evictdone
+ *
+ * Completes the eviction of a page once its outcome is known.  If the page
+ * was evicted, it is freed, which wakes up anyone waiting for a free page.
+ * If its file was busy, it is simply left for now.  Otherwise the eviction
+ * failed, for instance because the swap disk is full; we wake up the threads
+ * waiting for free pages so that they can fail too, and tell the page daemon
+ * to back off.  Called with the coremap spinlock held.
+ */
+static
+void
+sw_evictdone(int c_index, int result) {
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+	KASSERT(coremap->c_entries[c_index].ce_busy);
+
+	if (result == 0) {
+		coremap_freeframe(c_index);
+		return;
+	}
+
+	coremap->c_entries[c_index].ce_busy = false;
+
+	if (result != EBUSY) {
+		kswap->sw_evictfailed = true;
+		wchan_wakeall(coremap->c_freewchan, &coremap->c_spinlock);
+	}
+}
 
-	struct iovec iov;
-	struct uio ku;
+/*
+ * sw_writedone
+ *
+ * Called from a swap I/O thread when the write of a cluster of dirty pages
+ * completes.  Finishes the eviction of each page, clearing the busy flag of
+ * its page table entry, and frees the pages which made it to disk.
+ */
+static
+void
+sw_writedone(struct swapio *sio) {
 	int c_index;
+
+	for (unsigned i=0; i<sio->sio_npages; i++) {
+		c_index = (int)(sio->sio_paddrs[i] / PAGE_SIZE);
+
+		if (sio->sio_result) {
+
+			/* If we were unable to write the contents of the pages
+			 * to disk, we free the offset locations and wake up any
+			 * thread wishing to access the data in the pages. */
+			sw_freeslot(sio->sio_slot + i);
+			sw_abortevict(c_index);
+
+		} else {
+
+			/* We have successfully evicted the page.  We set the
+			 * swap flag in the page table entry.  In place of the
+			 * page frame in the page table entry, we place the
+			 * offset in the swap file where the page contents are
+			 * stored. */
+			sw_finishevict(c_index, (int)(sio->sio_slot + i));
+		}
+	}
+
+	spinlock_acquire(&coremap->c_spinlock);
+	for (unsigned i=0; i<sio->sio_npages; i++) {
+		sw_evictdone((int)(sio->sio_paddrs[i] / PAGE_SIZE),
+		sio->sio_result);
+	}
+	KASSERT(kswap->sw_nwriting >= sio->sio_npages);
+	kswap->sw_nwriting -= sio->sio_npages;
+	sw_wakedaemon();
+	spinlock_release(&coremap->c_spinlock);
+}
+
+/*
+ * sw_writecluster
+ *
+ * Starts writing the dirty pages with coremap indices c_indices[0..npages-1]
+ * to contiguous offset locations in the swap file, with a single request to
+ * the swap I/O threads.  If there is no run of free offset locations long
+ * enough for all of them, the cluster is split in halves.  sw_writedone
+ * completes the eviction of the pages once the write is done.
+ */
+static
+void
+sw_writecluster(int *c_indices, unsigned npages) {
+	struct swapio *sio;
+	unsigned first;
+	unsigned half;
 	int result;
-	unsigned sw_offset;
 
-	c_index = (int)(paddr/PAGE_SIZE);
-	
-	if (*coremap->c_entries[c_index].ce_pgentry & PG_DIRTY) {
-
-		/* If the page is dirty, we need to write its contents to disk.
-		 * In our current implementation, all pages are assumed to be
-		 * dirty so sw_evictpage should always execute this branch of
-		 * the code. */
-
-		/* Determine if there is space in the swap file to write the
-		 * page contents to disk */
-		lock_acquire(kswap->sw_disklock);
-		result = bitmap_alloc(kswap->sw_diskoffset, &sw_offset);
-		lock_release(kswap->sw_disklock);
-		if (result) {
+	KASSERT(npages > 0 && npages <= SW_CLUSTER);
+
+	/* Determine if there is space in the swap file to write the page
+	 * contents to disk */
+	result = swapmap_alloc(npages, &first);
+
+	if (result && npages > 1) {
+
+		/* The swap file is too fragmented for the whole cluster.  Try
+		 * writing each half separately. */
+		half = npages / 2;
+		sw_writecluster(c_indices, half);
+		sw_writecluster(c_indices + half, npages - half);
+		return;
+	}
+
+	if (result) {
+
+		/* If the disk is full, we mark the disk as being full and wake
+		 * up any thread waiting to access the page. */
+		kswap->sw_diskfull = true;
+		vmstat_inc(VMS_SWAPFULL);
+		sw_abortevict(c_indices[0]);
+
+		spinlock_acquire(&coremap->c_spinlock);
+		sw_evictdone(c_indices[0], ENOMEM);
+		spinlock_release(&coremap->c_spinlock);
+		return;
+	}
+
+	kswap->sw_diskfull = false;
+
+	/* Until the write completes, the pages count as good as free for the
+	 * page daemon's watermarks */
+	spinlock_acquire(&coremap->c_spinlock);
+	kswap->sw_nwriting += npages;
+	spinlock_release(&coremap->c_spinlock);
+
+	sio = swapio_alloc(UIO_WRITE, first);
+	for (unsigned i=0; i<npages; i++) {
+		swapio_addpage(sio, (paddr_t)(c_indices[i] * PAGE_SIZE));
+	}
+	swapio_start(sio, sw_writedone);
+}
+
+/*
+ * sw_clusterbefore
+ *
+ * Returns whether the page with coremap index a should be written before the
+ * page with coremap index b in a cluster
+ */
+static
+bool
+sw_clusterbefore(int a, int b) {
+	struct coremap_entry *ca = &coremap->c_entries[a];
+	struct coremap_entry *cb = &coremap->c_entries[b];
+
+	if (ca->ce_addrspace != cb->ce_addrspace) {
+		return (uintptr_t)ca->ce_addrspace < (uintptr_t)cb->ce_addrspace;
+	}
+	return (uintptr_t)ca->ce_pgentry < (uintptr_t)cb->ce_pgentry;
+}
+
+/*
+ * sw_isdirty
+ *
+ * Returns whether any page table entry mapping the page with coremap index
+ * c_index is dirty.  The page daemon must have marked them all as busy.
+ */
+static
+bool
+sw_isdirty(int c_index) {
+	struct rmap *rm;
+
+	if (coremap->c_entries[c_index].ce_rmap == NULL) {
+		return *coremap->c_entries[c_index].ce_pgentry & PG_DIRTY;
+	}
 
-			/* If the disk is full, we mark the coremap entry as not
-			 * being busy and we wake up any thread waiting to
-			 * access the page.  We also mark the disk as being
-			 * full. */
-
-			kswap->sw_diskfull = true;
-			lock_acquire(coremap->c_entries[c_index].ce_addrspace->as_lock);
-			*coremap->c_entries[c_index].ce_pgentry &= ~PG_BUSY;
-			cv_signal(coremap->c_entries[c_index].ce_addrspace->as_cv,
-			coremap->c_entries[c_index].ce_addrspace->as_lock);
-			lock_release(coremap->c_entries[c_index].ce_addrspace->as_lock);
-			return ENOMEM;
+	for (rm = coremap->c_entries[c_index].ce_rmap; rm != NULL;
+	rm = rm->rm_next) {
+		if (*rm->rm_pgentry & PG_DIRTY) {
+			return true;
 		}
+	}
 
-		kswap->sw_diskfull = false;
+	return false;
+}
 
-		/* Write the contents of the page to the swap file */
-		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
-		(off_t)(sw_offset*PAGE_SIZE), UIO_WRITE);
-		result = kswap->sw_vn->vn_ops->vop_write(kswap->sw_vn, &ku);
-		if (result) {
+/*
+ * sw_evictpages
+ *
+ * Performs the actual eviction of a batch of pages selected by sw_getpage.
+ * Clean pages are evicted without any disk I/O and freed right away.  Dirty
+ * pages are written to the swap file together, to contiguous offset
+ * locations, by the swap I/O threads, and freed once the write completes.
+ */
+void
+sw_evictpages(paddr_t *paddrs, unsigned npages) {
+	struct tlbshootdown ts[SW_CLUSTER];
+	int dirty[SW_CLUSTER];
+	unsigned ndirty;
+	uint32_t cpumask;
+	int c_index;
+	int sw_slot;
+	int result;
 
-			/* If we were unable to write the contents of the page
-			 * to disk, we mark the coremap entry as not being busy
-			 * and wake up any thread wishing to access the data in
-			 * the page. */
-
-			lock_acquire(coremap->c_entries[c_index].ce_addrspace->as_lock);
-			*coremap->c_entries[c_index].ce_pgentry &= ~PG_BUSY;
-			cv_signal(coremap->c_entries[c_index].ce_addrspace->as_cv,
-			coremap->c_entries[c_index].ce_addrspace->as_lock);
-			lock_release(coremap->c_entries[c_index].ce_addrspace->as_lock);
-			return result;
+	KASSERT(npages <= SW_CLUSTER);
+
+	/* Invalidate the TLB entries for all of the pages with a single round
+	 * of shootdowns, sent to every CPU which has run one of the address
+	 * spaces involved.  The coremap does not record the virtual address of
+	 * a page, so the entries are found by physical address.  Until this is
+	 * done, a process may still write to a page through a writable TLB
+	 * entry, so the page contents must not be written out before. */
+	cpumask = 0;
+	for (unsigned i=0; i<npages; i++) {
+		c_index = (int)(paddrs[i]/PAGE_SIZE);
+		cpumask |= coremap_getcpumask(c_index);
+		ts[i].ts_vaddr = 0;
+		ts[i].ts_asid = 0;
+		ts[i].ts_paddr = paddrs[i];
+	}
+	execute_tlbshootdown(cpumask, ts, npages);
+
+	ndirty = 0;
+
+	for (unsigned i=0; i<npages; i++) {
+
+		c_index = (int)(paddrs[i]/PAGE_SIZE);
+		KASSERT(coremap->c_entries[c_index].ce_busy);
+
+		if (coremap->c_entries[c_index].ce_vnode != NULL) {
+
+			/* Page cache pages go back to their file rather than
+			 * the swap file, if they are dirty at all.  Every
+			 * process mapping the page reads it from the file
+			 * again when it needs it. */
+			result = pagecache_writeback(c_index);
+			if (result) {
+				sw_abortevict(c_index);
+			} else {
+				pagecache_finishevict(c_index);
+			}
+
+			spinlock_acquire(&coremap->c_spinlock);
+			if (result == 0) {
+				coremap->c_ncleanevictions++;
+			}
+			sw_evictdone(c_index, result);
+			spinlock_release(&coremap->c_spinlock);
+			continue;
 		}
 
-		/* We have successfully evicted the page.  We set the swap flag
-		 * in the page table entry.  In place of the page frame in the
-		 * page table entry, we place the offset in the swap file where
-		 * the page table contents are stored.*/
-		lock_acquire(coremap->c_entries[c_index].ce_addrspace->as_lock);
-		*coremap->c_entries[c_index].ce_pgentry = PG_SWAP |
-		(int)(sw_offset);
+		if (sw_isdirty(c_index)) {
 
-		/* We wake up any threads which have been waiting for the page
-		 * eviction to be completed */
-		cv_signal(coremap->c_entries[c_index].ce_addrspace->as_cv,
-		coremap->c_entries[c_index].ce_addrspace->as_lock);
-		lock_release(coremap->c_entries[c_index].ce_addrspace->as_lock);
+			/* If the page is dirty, we need to write its contents
+			 * to disk.  A dirty page never has a stale copy in the
+			 * swap file. */
+			KASSERT(coremap->c_entries[c_index].ce_swapoffset == -1);
+			dirty[ndirty] = c_index;
+			ndirty++;
+			continue;
+		}
 
-	} else {
+		/* If the page is clean, it does not need to be written.  If it
+		 * was paged in from the swap file, the copy there is still
+		 * current and the page table entries can point to it again.
+		 * Otherwise the page has never been written and will simply be
+		 * zero-filled, or read from the executable, again on the next
+		 * fault. */
+
+		spinlock_acquire(&coremap->c_spinlock);
+		sw_slot = coremap->c_entries[c_index].ce_swapoffset;
+		coremap->c_entries[c_index].ce_swapoffset = -1;
+		coremap->c_ncleanevictions++;
+		spinlock_release(&coremap->c_spinlock);
 
-		panic("All pages are assumed dirty for now...\n");
+		sw_finishevict(c_index, sw_slot);
 
-	} 
+		spinlock_acquire(&coremap->c_spinlock);
+		sw_evictdone(c_index, 0);
+		spinlock_release(&coremap->c_spinlock);
+	}
 
-	return 0;
+	/* Sort the dirty pages by address space and page table entry, so that
+	 * neighbouring pages of a region end up in contiguous offset locations
+	 * in the swap file where sw_pagein can read them back together */
+	for (unsigned i=1; i<ndirty; i++) {
+		for (unsigned j=i; j>0 && sw_clusterbefore(dirty[j], dirty[j-1]);
+		j--) {
+			c_index = dirty[j];
+			dirty[j] = dirty[j-1];
+			dirty[j-1] = c_index;
+		}
+	}
+
+	if (ndirty > 0) {
+		sw_writecluster(dirty, ndirty);
+	}
+}
+
+/*
+ * sw_freeslot
+ *
+ * Drops a reference to an offset location in the swap file, and marks it as
+ * free once nothing refers to it anymore.  A slot nobody shares has a single
+ * holder, who frees it without taking the slot lock.
+ */
+void
+sw_freeslot(unsigned sw_offset) {
+
+	if (kswap->sw_slotrefs[sw_offset] > 0) {
+		spinlock_acquire(&kswap->sw_slotlock);
+		if (kswap->sw_slotrefs[sw_offset] > 0) {
+			kswap->sw_slotrefs[sw_offset]--;
+			spinlock_release(&kswap->sw_slotlock);
+			return;
+		}
+		spinlock_release(&kswap->sw_slotlock);
+	}
+
+	swapmap_free(sw_offset);
+	kswap->sw_diskfull = false;
+}
+
+/*
+ * sw_pagein_release
+ *
+ * Restores the page table entries ptes[0..n-1], which sw_pagein marked as
+ * busy for readahead, to their saved values and wakes up anyone waiting on
+ * them
+ */
+static
+void
+sw_pagein_release(int **ptes, unsigned n, int *saved_entries) {
+
+	for (unsigned i=0; i<n; i++) {
+		*ptes[i] = saved_entries[i] | PG_BUSY;
+		pte_clearbusy(ptes[i]);
+	}
 }
 
 /*
  * sw_pagein
  *
- * Performs a page in if the page table entry indicates that the contents of the
- * page are on disk
+ * Performs a page in if the page table entry for vaddr indicates that the
+ * contents of the page are on disk.  Neighbouring pages below vtop, the end
+ * of the region, which are stored next to the page in the swap file are read
+ * in along with it.  The caller must have marked the page table entry as busy
+ * and must not hold its lock.
  */
 int
-sw_pagein(int *pg_entry, struct addrspace *as) {
+sw_pagein(struct addrspace *as, vaddr_t vaddr, vaddr_t vtop) {
 	paddr_t paddr;
-	off_t sw_offset;
+	unsigned sw_slot;
+	unsigned window;
+	unsigned nrahits;
+	unsigned n;
 	int result;
-	int saved_entry;
-	struct uio ku;
-	struct iovec iov;
+	int *ptes[SW_READAHEAD_MAX];
+	int saved_entries[SW_READAHEAD_MAX];
+	struct swapio *sio;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT(vaddr < vtop);
+
+	result = as_getpte(as, vaddr, false, &ptes[0]);
+	KASSERT(result == 0 && ptes[0] != NULL);
+	KASSERT(*ptes[0] & PG_SWAP);
+	KASSERT(*ptes[0] & PG_BUSY);
 
 	/* Obtain the location in the swap file where the page contents are
 	 * stored */
-	sw_offset = (off_t)((*pg_entry & PG_FRAME) * PAGE_SIZE);
-	saved_entry = *pg_entry;
+	sw_slot = (unsigned)(*ptes[0] & PG_FRAME);
+
+	/* Widen the readahead window by one page for each page read ahead
+	 * which got used since we last looked.  Those are counted per CPU on
+	 * the fault path, which takes no lock. */
+	spinlock_acquire(&coremap->c_spinlock);
+	nrahits = vmstat_count(VMS_RAHIT);
+	coremap->c_rawindow += nrahits - coremap->c_rahitsseen;
+	if (coremap->c_rawindow > SW_READAHEAD_MAX) {
+		coremap->c_rawindow = SW_READAHEAD_MAX;
+	}
+	coremap->c_rahitsseen = nrahits;
+	window = coremap->c_rawindow;
+	spinlock_release(&coremap->c_spinlock);
+
+	/* Read ahead the pages following the faulting page in the same region
+	 * whose contents are stored in the offset locations following
+	 * sw_slot, up to the size of the readahead window.  The page daemon
+	 * writes neighbouring pages of a region to contiguous offset
+	 * locations, so sequential access patterns tend to find them there.
+	 * We mark the pages as busy so that they are left alone while we read
+	 * them in. */
+	n = 1;
+	while (n < window && vaddr + n * PAGE_SIZE < vtop) {
+		as_getpte(as, vaddr + n * PAGE_SIZE, false, &ptes[n]);
+		if (ptes[n] == NULL) {
+			break;
+		}
 
-	/* Obtain a new page */
-	result = coremap_getpage(pg_entry, as);
-	if (result) {
-		*pg_entry = saved_entry;
-		return result;
+		pte_lock(ptes[n]);
+		if (!(*ptes[n] & PG_SWAP) || (*ptes[n] & PG_BUSY) ||
+		(unsigned)(*ptes[n] & PG_FRAME) != sw_slot + n) {
+			pte_unlock(ptes[n]);
+			break;
+		}
+		*ptes[n] |= PG_BUSY;
+		pte_unlock(ptes[n]);
+		n++;
 	}
-	
-	paddr = (*pg_entry & PG_FRAME) << 12;
 
-	/* Read the page contents from the swap file into the new page */
-	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
-	sw_offset, UIO_READ);
-	result = kswap->sw_vn->vn_ops->vop_read(kswap->sw_vn, &ku);
+	for (unsigned i=0; i<n; i++) {
+		saved_entries[i] = *ptes[i];
+	}
+
+	/* Obtain a new page for each page we read in.  If we run out of pages
+	 * while getting pages for the readahead, we read in fewer pages. */
+	for (unsigned i=0; i<n; i++) {
+		result = coremap_getpage(ptes[i], as, false);
+		if (result) {
+			*ptes[i] = saved_entries[i];
+			sw_pagein_release(ptes + i + 1, n - i - 1,
+			saved_entries + i + 1);
+			if (i == 0) {
+				return result;
+			}
+			n = i;
+			break;
+		}
+
+	}
+
+	/* Read the page contents from the swap file into the new pages with a
+	 * single read.  It goes ahead of any eviction writes waiting for the
+	 * swap I/O threads. */
+	sio = swapio_alloc(UIO_READ, sw_slot);
+	for (unsigned i=0; i<n; i++) {
+		swapio_addpage(sio, (paddr_t)((*ptes[i] & PG_FRAME) << 12));
+	}
+	result = swapio_run(sio);
 	if (result) {
-		*pg_entry = saved_entry;
+
+		/* Give back the new pages and restore the page table
+		 * entries */
+		for (unsigned i=0; i<n; i++) {
+			paddr = (*ptes[i] & PG_FRAME) << 12;
+			coremap_freepage(paddr, ptes[i]);
+		}
+		*ptes[0] = saved_entries[0];
+		sw_pagein_release(ptes + 1, n - 1, saved_entries + 1);
 		return result;
 	}
 
-	/* Mark the offset location in the swap file as being free, now that the
-	 * data is in memory */
-	lock_acquire(kswap->sw_disklock);
-	bitmap_unmark(kswap->sw_diskoffset, (unsigned)(sw_offset/PAGE_SIZE));
-	lock_release(kswap->sw_disklock);
+	/* Keep the offset locations in the swap file allocated, since they
+	 * still hold a copy of the pages.  As long as the pages stay clean,
+	 * they can be evicted again without writing them to disk.  The pages
+	 * we read ahead are not marked as referenced, so that the clock
+	 * algorithm evicts them first if they turn out not to be needed. */
+	spinlock_acquire(&coremap->c_spinlock);
+	for (unsigned i=0; i<n; i++) {
+		paddr = (*ptes[i] & PG_FRAME) << 12;
+		coremap->c_entries[paddr/PAGE_SIZE].ce_swapoffset =
+		(int)(sw_slot + i);
+		if (i > 0) {
+			coremap->c_entries[paddr/PAGE_SIZE].ce_readahead = true;
+			coremap->c_entries[paddr/PAGE_SIZE].ce_referenced =
+			false;
+		}
+	}
+	coremap->c_nreadahead += n - 1;
+	spinlock_release(&coremap->c_spinlock);
+	vmstat_add(VMS_PAGEIN, n);
+
+	/* Unset the swap flag in the page table entry and mark it as being
+	 * valid.  The page is clean until the process writes to it. */
+	*ptes[0] &= ~PG_SWAP;
+	*ptes[0] |= PG_VALID;
+
+	/* Do the same for the pages we read ahead, and wake up anyone who
+	 * faulted on them in the meantime */
+	for (unsigned i=1; i<n; i++) {
+		*ptes[i] &= ~PG_SWAP;
+		*ptes[i] |= PG_VALID;
+		pte_clearbusy(ptes[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * sw_wakedaemon
+ *
+ * Wakes up the page daemon if the number of free user pages has dropped below
+ * the low watermark, or if anyone is waiting for free pages.  Called with the
+ * coremap spinlock held.
+ */
+void
+sw_wakedaemon(void) {
 
-	/* Unset the swap flag in the page table entry */
-	*pg_entry &= ~PG_SWAP;
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
 
-	/* Mark the page table entry as being valid and dirty */
-	*pg_entry |= PG_VALID;
-	*pg_entry |= PG_DIRTY;
+	if (kswap == NULL) {
+		return;
+	}
 
-	return 0;
+	if (coremap->c_upool.cp_nfree < kswap->sw_lowater ||
+	coremap->c_nwaiters > 0) {
+		wchan_wakeone(kswap->sw_daemonwchan, &coremap->c_spinlock);
+	}
+}
+
+/*
+ * sw_daemon_needed
+ *
+ * Returns whether the page daemon has work to do: the free user pages have
+ * dropped below the low watermark, or a thread is waiting for a free page.
+ * Pages being written out count as free, since they will be soon, and a
+ * waiting thread gets one of them.  Called with the coremap spinlock held.
+ */
+static
+bool
+sw_daemon_needed(void) {
+
+	KASSERT(spinlock_do_i_hold(&coremap->c_spinlock));
+
+	return coremap->c_upool.cp_nfree + kswap->sw_nwriting <
+	kswap->sw_lowater ||
+	(coremap->c_nwaiters > 0 && kswap->sw_nwriting == 0);
+}
+
+/*
+ * sw_daemon_done
+ *
+ * Returns whether the page daemon has freed enough pages, or started writing
+ * enough out, and can go back to sleep
+ */
+static
+bool
+sw_daemon_done(void) {
+	bool done;
+
+	spinlock_acquire(&coremap->c_spinlock);
+	done = coremap->c_upool.cp_nfree + kswap->sw_nwriting >=
+	kswap->sw_hiwater &&
+	(coremap->c_nwaiters == 0 || kswap->sw_nwriting > 0);
+	spinlock_release(&coremap->c_spinlock);
+
+	return done;
 }
 
 /*
  * evicting
  *
- * Code which the page daemon runs
+ * Code which the page daemon runs.  The page daemon sleeps until the number of
+ * free user pages drops below the low watermark or a thread is waiting for a
+ * free page, and then evicts pages until the number of free pages is back up
+ * to the high watermark.  It does not wait for its writes to the swap file:
+ * the swap I/O threads free the pages as the writes complete.
  */
 void
 evicting(void *p, unsigned long arg) {
 
 	(void)p;
 	(void)arg;
-	paddr_t pgvictim;
-	int result;
+	paddr_t pgvictims[SW_CLUSTER];
+	unsigned nvictims;
+	bool failed;
 	int c_index;
 
-	while(1) {
-
-		/* Set kswap->sw_pgevicted as false to indicate the page daemon
-		 * has not yet evicted a page */
-		kswap->sw_pgevicted = false;
+	kswap->sw_daemon = curthread;
 
-		/* Select a page to evict */
-		sw_getpage(&pgvictim);
+	while(1) {
 
-		/* Check that the coremap entry corresponding to the page
-		 * selected for eviction has the appropriate values */
-		KASSERT(!spinlock_do_i_hold(&coremap->c_spinlock));
-		c_index = (int)(pgvictim/PAGE_SIZE);
-		KASSERT(coremap->c_entries[c_index].ce_allocated);
-		KASSERT(coremap->c_entries[c_index].ce_foruser);
-		KASSERT(coremap->c_entries[c_index].ce_busy);
-		KASSERT((paddr_t)((*coremap->c_entries[c_index].ce_pgentry &
-		PG_FRAME) << 12) == pgvictim);
+		/* Sleep until there is work to do */
+		spinlock_acquire(&coremap->c_spinlock);
+		while (!sw_daemon_needed()) {
+			wchan_sleep(kswap->sw_daemonwchan, &coremap->c_spinlock);
+		}
 
-		/* Evict the page */
-		result = sw_evictpage(pgvictim);
-		if (result) {
-			spinlock_acquire(&coremap->c_spinlock);
-			coremap->c_entries[c_index].ce_busy = false;
-			spinlock_release(&coremap->c_spinlock);
-			clocksleep(1);
+		/* Free pages held in the CPUs' page magazines are not counted
+		 * as free.  Put them back on the free lists before evicting
+		 * anything, as that may be all we need. */
+		if (coremap_drainmagazines() > 0 &&
+		coremap->c_nwaiters > 0) {
+			wchan_wakeall(coremap->c_freewchan, &coremap->c_spinlock);
 		}
+		spinlock_release(&coremap->c_spinlock);
 
-		/* Mark the coremap entry as being free */
-		spinlock_acquire(&coremap->c_spinlock);
-		coremap->c_entries[c_index].ce_allocated = false;
-		coremap->c_entries[c_index].ce_addrspace = NULL;
+		while (!sw_daemon_done()) {
+
+			/* Select a batch of pages to evict.  If every user
+			 * page is busy or shared right now, let other threads
+			 * run and try again. */
+			nvictims = 0;
+			while (nvictims < SW_CLUSTER &&
+			sw_getpage(&pgvictims[nvictims])) {
+
+				/* Check that the coremap entry corresponding
+				 * to the page selected for eviction has the
+				 * appropriate values */
+				KASSERT(!spinlock_do_i_hold(&coremap->c_spinlock));
+				c_index = (int)(pgvictims[nvictims]/PAGE_SIZE);
+				KASSERT(coremap->c_entries[c_index].ce_allocated);
+				KASSERT(coremap->c_entries[c_index].ce_foruser);
+				KASSERT(coremap->c_entries[c_index].ce_busy);
+				KASSERT(coremap->c_entries[c_index].ce_rmap !=
+				NULL ||
+				(paddr_t)((*coremap->c_entries[c_index].ce_pgentry &
+				PG_FRAME) << 12) == pgvictims[nvictims]);
+
+				nvictims++;
+			}
 
-		if (c_index >= coremap->c_userpbase) {
-			coremap->c_entries[c_index].ce_foruser = true;
+			if (nvictims == 0) {
+				thread_yield();
+				continue;
+			}
 
-		} else {
-			coremap->c_entries[c_index].ce_foruser = false;
-		}
+			/* Evict the pages */
+			sw_evictpages(pgvictims, nvictims);
 
-		coremap->c_entries[c_index].ce_next = 0;
-		coremap->c_entries[c_index].ce_pgentry = NULL;
-		coremap->c_entries[c_index].ce_swapoffset = -1;
-		coremap->c_entries[c_index].ce_busy = false;
-		spinlock_release(&coremap->c_spinlock);
-		kswap->sw_pgevicted = true;
-		clocksleep(1);
+			/* If an eviction failed, for instance because the swap
+			 * disk is full, back off for a while */
+			spinlock_acquire(&coremap->c_spinlock);
+			failed = kswap->sw_evictfailed;
+			kswap->sw_evictfailed = false;
+			spinlock_release(&coremap->c_spinlock);
 
+			if (failed) {
+				clocksleep(1);
+			}
+		}
 	}
-
 }
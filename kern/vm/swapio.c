@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Asynchronous swap I/O.  See swapio.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <swapio.h>
+
+#if SW_CLUSTER > SWAPIO_MAXPAGES || SW_READAHEAD_MAX > SWAPIO_MAXPAGES
+#error "SWAPIO_MAXPAGES is too small for a swap cluster or readahead"
+#endif
+
+/* The request pool, the queue and the statistics, protected by swapio_lock.
+ * The queue runs from swapio_head to swapio_tail; swapio_lastread is the last
+ * read in it, after which the next read is queued, or NULL if it holds no
+ * reads. */
+static struct spinlock swapio_lock = SPINLOCK_INITIALIZER;
+static struct swapio swapio_pool[SWAPIO_NREQUESTS];
+static struct swapio *swapio_freelist;
+static struct swapio *swapio_head;
+static struct swapio *swapio_tail;
+static struct swapio *swapio_lastread;
+static unsigned swapio_nqueued;
+
+/* I/O threads sleep on swapio_workwchan until there is a request in the
+ * queue, and threads needing a request on swapio_freewchan until there is
+ * one in the pool */
+static struct wchan *swapio_workwchan;
+static struct wchan *swapio_freewchan;
+
+/* Statistics */
+static unsigned swapio_nreads;		/* read requests */
+static unsigned swapio_nwrites;		/* write requests */
+static unsigned swapio_npagesread;	/* pages read */
+static unsigned swapio_npageswritten;	/* pages written */
+static unsigned swapio_nerrors;		/* failed transfers */
+static unsigned swapio_nallocwaits;	/* sleeps for a free request */
+static unsigned swapio_maxqueued;	/* longest the queue has been */
+
+/*
+ * swapio_transfer
+ *
+ * Carries out the transfer for a request
+ */
+static
+int
+swapio_transfer(struct swapio *sio)
+{
+	struct iovec iov[SWAPIO_MAXPAGES];
+	struct uio ku;
+	int result;
+
+	for (unsigned i=0; i<sio->sio_npages; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(sio->sio_paddrs[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = sio->sio_npages;
+	ku.uio_offset = (off_t)sio->sio_slot * PAGE_SIZE;
+	ku.uio_resid = sio->sio_npages * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = sio->sio_rw;
+	ku.uio_space = NULL;
+
+	if (sio->sio_rw == UIO_READ) {
+		result = VOP_READ(kswap->sw_vn, &ku);
+	} else {
+		result = VOP_WRITE(kswap->sw_vn, &ku);
+	}
+	if (result == 0 && ku.uio_resid > 0) {
+		result = EIO;
+	}
+
+	return result;
+}
+
+/*
+ * swapio_free
+ *
+ * Returns a request to the pool
+ */
+static
+void
+swapio_free(struct swapio *sio)
+{
+	spinlock_acquire(&swapio_lock);
+	sio->sio_next = swapio_freelist;
+	swapio_freelist = sio;
+	wchan_wakeone(swapio_freewchan, &swapio_lock);
+	spinlock_release(&swapio_lock);
+}
+
+/*
+ * swapio_thread
+ *
+ * Code which the I/O threads run.  Takes requests off the queue and carries
+ * them out, one at a time.
+ */
+static
+void
+swapio_thread(void *p, unsigned long arg)
+{
+	struct swapio *sio;
+
+	(void)p;
+	(void)arg;
+
+	while (1) {
+		spinlock_acquire(&swapio_lock);
+		while (swapio_head == NULL) {
+			wchan_sleep(swapio_workwchan, &swapio_lock);
+		}
+		sio = swapio_head;
+		swapio_head = sio->sio_next;
+		if (swapio_head == NULL) {
+			swapio_tail = NULL;
+		}
+		if (swapio_lastread == sio) {
+			swapio_lastread = NULL;
+		}
+		swapio_nqueued--;
+		spinlock_release(&swapio_lock);
+
+		sio->sio_result = swapio_transfer(sio);
+
+		spinlock_acquire(&swapio_lock);
+		if (sio->sio_rw == UIO_READ) {
+			swapio_nreads++;
+			swapio_npagesread += sio->sio_npages;
+		} else {
+			swapio_nwrites++;
+			swapio_npageswritten += sio->sio_npages;
+		}
+		if (sio->sio_result) {
+			swapio_nerrors++;
+		}
+		spinlock_release(&swapio_lock);
+
+		if (sio->sio_done != NULL) {
+			sio->sio_done(sio);
+			swapio_free(sio);
+		} else {
+			V(sio->sio_sem);
+		}
+	}
+}
+
+/*
+ * swapio_bootstrap
+ *
+ * Sets up the request pool and starts the I/O threads
+ */
+void
+swapio_bootstrap(void)
+{
+	int result;
+
+	swapio_workwchan = wchan_create("swap I/O queue");
+	swapio_freewchan = wchan_create("swap I/O requests");
+	if (swapio_workwchan == NULL || swapio_freewchan == NULL) {
+		panic("swapio_bootstrap: wchan_create failed\n");
+	}
+
+	swapio_freelist = NULL;
+	for (unsigned i=0; i<SWAPIO_NREQUESTS; i++) {
+		swapio_pool[i].sio_sem = sem_create("swap I/O", 0);
+		if (swapio_pool[i].sio_sem == NULL) {
+			panic("swapio_bootstrap: sem_create failed\n");
+		}
+		swapio_pool[i].sio_next = swapio_freelist;
+		swapio_freelist = &swapio_pool[i];
+	}
+	swapio_head = NULL;
+	swapio_tail = NULL;
+	swapio_lastread = NULL;
+	swapio_nqueued = 0;
+
+	for (unsigned i=0; i<SWAPIO_NTHREADS; i++) {
+		result = thread_fork("swap I/O", NULL, swapio_thread, NULL, 0);
+		if (result) {
+			panic("swapio_bootstrap: thread_fork failed\n");
+		}
+	}
+}
+
+/*
+ * swapio_alloc
+ *
+ * Gets a request for a transfer starting at a swap slot, sleeping until one
+ * is free
+ */
+struct swapio *
+swapio_alloc(enum uio_rw rw, unsigned slot)
+{
+	struct swapio *sio;
+
+	spinlock_acquire(&swapio_lock);
+	while (swapio_freelist == NULL) {
+		swapio_nallocwaits++;
+		wchan_sleep(swapio_freewchan, &swapio_lock);
+	}
+	sio = swapio_freelist;
+	swapio_freelist = sio->sio_next;
+	spinlock_release(&swapio_lock);
+
+	sio->sio_rw = rw;
+	sio->sio_slot = slot;
+	sio->sio_npages = 0;
+	sio->sio_result = 0;
+	sio->sio_done = NULL;
+	sio->sio_next = NULL;
+
+	return sio;
+}
+
+/*
+ * swapio_addpage
+ *
+ * Adds a page to a request, for the slot after the last one
+ */
+void
+swapio_addpage(struct swapio *sio, paddr_t paddr)
+{
+	KASSERT(sio->sio_npages < SWAPIO_MAXPAGES);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	sio->sio_paddrs[sio->sio_npages++] = paddr;
+}
+
+/*
+ * swapio_start
+ *
+ * Queues a request, reads after any other reads but ahead of all writes.
+ * done is called from an I/O thread once the request completes, or if it is
+ * NULL, the caller waits for it with swapio_run.
+ */
+void
+swapio_start(struct swapio *sio, void (*done)(struct swapio *sio))
+{
+	KASSERT(sio->sio_npages > 0);
+
+	sio->sio_done = done;
+
+	spinlock_acquire(&swapio_lock);
+
+	if (sio->sio_rw == UIO_READ) {
+		if (swapio_lastread == NULL) {
+			sio->sio_next = swapio_head;
+			swapio_head = sio;
+		} else {
+			sio->sio_next = swapio_lastread->sio_next;
+			swapio_lastread->sio_next = sio;
+		}
+		if (sio->sio_next == NULL) {
+			swapio_tail = sio;
+		}
+		swapio_lastread = sio;
+	} else {
+		sio->sio_next = NULL;
+		if (swapio_tail == NULL) {
+			swapio_head = sio;
+		} else {
+			swapio_tail->sio_next = sio;
+		}
+		swapio_tail = sio;
+	}
+
+	swapio_nqueued++;
+	if (swapio_nqueued > swapio_maxqueued) {
+		swapio_maxqueued = swapio_nqueued;
+	}
+
+	wchan_wakeone(swapio_workwchan, &swapio_lock);
+	spinlock_release(&swapio_lock);
+}
+
+/*
+ * swapio_run
+ *
+ * Queues a request and waits for it to complete.  Frees the request and
+ * returns the outcome of the transfer.
+ */
+int
+swapio_run(struct swapio *sio)
+{
+	int result;
+
+	swapio_start(sio, NULL);
+	P(sio->sio_sem);
+
+	result = sio->sio_result;
+	swapio_free(sio);
+
+	return result;
+}
+
+/*
+ * swapio_printstats
+ *
+ * Prints the swap I/O statistics
+ */
+void
+swapio_printstats(void)
+{
+	unsigned nreads, nwrites, npagesread, npageswritten;
+	unsigned nerrors, nallocwaits, maxqueued;
+
+	spinlock_acquire(&swapio_lock);
+	nreads = swapio_nreads;
+	nwrites = swapio_nwrites;
+	npagesread = swapio_npagesread;
+	npageswritten = swapio_npageswritten;
+	nerrors = swapio_nerrors;
+	nallocwaits = swapio_nallocwaits;
+	maxqueued = swapio_maxqueued;
+	spinlock_release(&swapio_lock);
+
+	kprintf("vm: swap I/O: %u reads (%u pages), %u writes (%u pages), "
+		"%u failed\n", nreads, npagesread, nwrites, npageswritten,
+		nerrors);
+	kprintf("vm: swap I/O: at most %u requests queued, %u waits for a "
+		"free request\n", maxqueued, nallocwaits);
+}
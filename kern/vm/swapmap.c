@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap slot allocator.  See swapmap.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <swapmap.h>
+
+#define SM_WORDBITS 32
+#define SM_FULLWORD 0xffffffff
+
+/* The slot map.  Bit n of sm_map is set if slot n is in use or cached.
+ * Protected by sm_lock. */
+static struct spinlock sm_lock = SPINLOCK_INITIALIZER;
+static uint32_t *sm_map;
+static unsigned sm_nslots;
+static unsigned sm_cursor;		/* where the next search starts */
+static unsigned sm_nfree;		/* free slots in the map */
+
+/* Statistics, protected by sm_lock */
+static unsigned sm_nruns;		/* runs allocated from the map */
+static unsigned sm_nrunslots;		/* slots in those runs */
+static unsigned sm_nrefills;		/* batches moved into caches */
+static unsigned sm_ndrains;		/* batches moved back to the map */
+static unsigned sm_nfailures;		/* allocations which found no room */
+
+/* The slot cache of each CPU, indexed by c_number.  Each is protected by its
+ * own lock, since any CPU may drain it when the slot map runs dry. */
+static struct sm_cache {
+	struct spinlock sc_lock;
+	unsigned sc_slots[SM_CACHESIZE];
+	unsigned sc_nslots;
+	unsigned sc_nhits;		/* slots allocated from the cache */
+	unsigned sc_nfrees;		/* slots freed into the cache */
+} sm_caches[TLBSHOOTDOWN_MAXCPUS];
+
+/*
+ * sm_isset
+ *
+ * Returns whether a slot is marked as in use in the slot map
+ */
+static
+bool
+sm_isset(unsigned slot)
+{
+	return (sm_map[slot / SM_WORDBITS] &
+		((uint32_t)1 << (slot % SM_WORDBITS))) != 0;
+}
+
+/*
+ * sm_mark
+ *
+ * Marks a free slot as in use.  Called with the slot map lock held.
+ */
+static
+void
+sm_mark(unsigned slot)
+{
+	KASSERT(!sm_isset(slot));
+	sm_map[slot / SM_WORDBITS] |= (uint32_t)1 << (slot % SM_WORDBITS);
+	sm_nfree--;
+}
+
+/*
+ * sm_unmark
+ *
+ * Marks a slot in use as free.  Called with the slot map lock held.
+ */
+static
+void
+sm_unmark(unsigned slot)
+{
+	KASSERT(sm_isset(slot));
+	sm_map[slot / SM_WORDBITS] &= ~((uint32_t)1 << (slot % SM_WORDBITS));
+	sm_nfree++;
+}
+
+/*
+ * sm_getcache
+ *
+ * Returns the slot cache of the current CPU.  We may be moved to another CPU
+ * right after, but then we simply use that CPU's cache, under its lock.
+ */
+static
+struct sm_cache *
+sm_getcache(void)
+{
+	unsigned num = curcpu->c_number;
+
+	KASSERT(num < TLBSHOOTDOWN_MAXCPUS);
+	return &sm_caches[num];
+}
+
+/*
+ * sm_allocrun
+ *
+ * Allocates nslots contiguous slots from the slot map, next-fit, and sets
+ * *first to the first of them.  Runs do not wrap around the end of the disk.
+ * Returns ENOSPC if there is no free run long enough.  Called with the slot
+ * map lock held.
+ */
+static
+int
+sm_allocrun(unsigned nslots, unsigned *first)
+{
+	unsigned slot;
+	unsigned run;
+	unsigned nscanned;
+
+	KASSERT(spinlock_do_i_hold(&sm_lock));
+
+	if (nslots > sm_nfree) {
+		return ENOSPC;
+	}
+
+	/* Starting at the cursor, look at every slot once, and then at the
+	 * first few again, for runs which started just before the cursor */
+	slot = sm_cursor;
+	run = 0;
+	nscanned = 0;
+	while (nscanned < sm_nslots + nslots) {
+		if (slot >= sm_nslots) {
+			slot = 0;
+			run = 0;
+		}
+
+		/* Skip over words with no free slot */
+		if (slot % SM_WORDBITS == 0 &&
+		sm_map[slot / SM_WORDBITS] == SM_FULLWORD) {
+			slot += SM_WORDBITS;
+			nscanned += SM_WORDBITS;
+			run = 0;
+			continue;
+		}
+
+		if (sm_isset(slot)) {
+			run = 0;
+		} else if (++run == nslots) {
+			*first = slot + 1 - nslots;
+			for (unsigned i=*first; i<=slot; i++) {
+				sm_mark(i);
+			}
+			sm_cursor = slot + 1 < sm_nslots ? slot + 1 : 0;
+			return 0;
+		}
+
+		slot++;
+		nscanned++;
+	}
+
+	return ENOSPC;
+}
+
+/*
+ * sm_drainall
+ *
+ * Gives the slots cached by every CPU back to the slot map.  Returns false if
+ * there were none.
+ */
+static
+bool
+sm_drainall(void)
+{
+	struct sm_cache *sc;
+	bool drained;
+
+	drained = false;
+	for (unsigned c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		sc = &sm_caches[c];
+		spinlock_acquire(&sc->sc_lock);
+		if (sc->sc_nslots > 0) {
+			spinlock_acquire(&sm_lock);
+			while (sc->sc_nslots > 0) {
+				sm_unmark(sc->sc_slots[--sc->sc_nslots]);
+			}
+			sm_ndrains++;
+			spinlock_release(&sm_lock);
+			drained = true;
+		}
+		spinlock_release(&sc->sc_lock);
+	}
+
+	return drained;
+}
+
+/*
+ * sm_allocone
+ *
+ * Allocates a single slot from the current CPU's cache, refilling the cache
+ * with a batch from the slot map if it is empty
+ */
+static
+int
+sm_allocone(unsigned *slot)
+{
+	struct sm_cache *sc;
+	unsigned s;
+
+	sc = sm_getcache();
+	spinlock_acquire(&sc->sc_lock);
+
+	if (sc->sc_nslots > 0) {
+		sc->sc_nhits++;
+	} else {
+		spinlock_acquire(&sm_lock);
+		while (sc->sc_nslots < SM_CACHEBATCH &&
+		sm_allocrun(1, &s) == 0) {
+			sc->sc_slots[sc->sc_nslots++] = s;
+		}
+		if (sc->sc_nslots > 0) {
+			sm_nrefills++;
+		}
+		spinlock_release(&sm_lock);
+
+		if (sc->sc_nslots == 0) {
+			spinlock_release(&sc->sc_lock);
+			return ENOSPC;
+		}
+	}
+
+	*slot = sc->sc_slots[--sc->sc_nslots];
+
+	spinlock_release(&sc->sc_lock);
+	return 0;
+}
+
+/*
+ * swapmap_bootstrap
+ *
+ * Sets up the allocator for a swap disk of nslots slots, all of them free
+ */
+void
+swapmap_bootstrap(unsigned nslots)
+{
+	unsigned nwords;
+
+	KASSERT(nslots > 0);
+
+	nwords = DIVROUNDUP(nslots, SM_WORDBITS);
+	sm_map = kmalloc(nwords * sizeof(uint32_t));
+	if (sm_map == NULL) {
+		panic("swapmap_bootstrap: Out of memory\n");
+	}
+	for (unsigned i=0; i<nwords; i++) {
+		sm_map[i] = 0;
+	}
+
+	/* Mark the bits past the last slot as in use, so that the last word
+	 * looks full once every real slot in it is */
+	for (unsigned i=nslots; i<nwords * SM_WORDBITS; i++) {
+		sm_map[i / SM_WORDBITS] |= (uint32_t)1 << (i % SM_WORDBITS);
+	}
+
+	sm_nslots = nslots;
+	sm_nfree = nslots;
+	sm_cursor = 0;
+
+	for (unsigned c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		spinlock_init(&sm_caches[c].sc_lock);
+		sm_caches[c].sc_nslots = 0;
+		sm_caches[c].sc_nhits = 0;
+		sm_caches[c].sc_nfrees = 0;
+	}
+}
+
+/*
+ * swapmap_alloc
+ *
+ * Allocates nslots contiguous slots and sets *first to the first of them.
+ * Single slots come from the current CPU's cache.  If the slot map has no
+ * room, the caches of all CPUs are drained into it and we try once more.
+ */
+int
+swapmap_alloc(unsigned nslots, unsigned *first)
+{
+	bool drained;
+	int result;
+
+	KASSERT(nslots > 0);
+
+	drained = false;
+	while (1) {
+		if (nslots == 1) {
+			result = sm_allocone(first);
+		} else {
+			spinlock_acquire(&sm_lock);
+			result = sm_allocrun(nslots, first);
+			if (result == 0) {
+				sm_nruns++;
+				sm_nrunslots += nslots;
+			}
+			spinlock_release(&sm_lock);
+		}
+
+		if (result == 0 || drained || !sm_drainall()) {
+			break;
+		}
+		drained = true;
+	}
+
+	if (result) {
+		spinlock_acquire(&sm_lock);
+		sm_nfailures++;
+		spinlock_release(&sm_lock);
+	}
+
+	return result;
+}
+
+/*
+ * swapmap_free
+ *
+ * Frees a slot into the current CPU's cache.  If the cache is full, a batch
+ * of it goes back to the slot map first.
+ */
+void
+swapmap_free(unsigned slot)
+{
+	struct sm_cache *sc;
+
+	KASSERT(slot < sm_nslots);
+
+	sc = sm_getcache();
+	spinlock_acquire(&sc->sc_lock);
+
+	if (sc->sc_nslots == SM_CACHESIZE) {
+		spinlock_acquire(&sm_lock);
+		for (unsigned i=0; i<SM_CACHEBATCH; i++) {
+			sm_unmark(sc->sc_slots[--sc->sc_nslots]);
+		}
+		sm_ndrains++;
+		spinlock_release(&sm_lock);
+	}
+
+	sc->sc_slots[sc->sc_nslots++] = slot;
+	sc->sc_nfrees++;
+
+	spinlock_release(&sc->sc_lock);
+}
+
+/*
+ * swapmap_printstats
+ *
+ * Prints the swap space statistics.  Fragmentation is measured on the slot
+ * map alone, as the share of its free slots which lie outside its largest
+ * free extent; cached slots count as in use there.
+ */
+void
+swapmap_printstats(void)
+{
+	struct sm_cache *sc;
+	unsigned ncached, nhits, nfrees;
+	unsigned nfree, nextents, largest, run;
+	unsigned nruns, nrunslots, nrefills, ndrains, nfailures;
+
+	ncached = nhits = nfrees = 0;
+	for (unsigned c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		sc = &sm_caches[c];
+		spinlock_acquire(&sc->sc_lock);
+		ncached += sc->sc_nslots;
+		nhits += sc->sc_nhits;
+		nfrees += sc->sc_nfrees;
+		spinlock_release(&sc->sc_lock);
+	}
+
+	spinlock_acquire(&sm_lock);
+	nextents = 0;
+	largest = 0;
+	run = 0;
+	for (unsigned i=0; i<sm_nslots; i++) {
+		if (sm_isset(i)) {
+			run = 0;
+			continue;
+		}
+		if (run == 0) {
+			nextents++;
+		}
+		run++;
+		if (run > largest) {
+			largest = run;
+		}
+	}
+	nfree = sm_nfree;
+	nruns = sm_nruns;
+	nrunslots = sm_nrunslots;
+	nrefills = sm_nrefills;
+	ndrains = sm_ndrains;
+	nfailures = sm_nfailures;
+	spinlock_release(&sm_lock);
+
+	kprintf("vm: swap %u of %u slots free, %u of them cached by CPUs\n",
+		nfree + ncached, sm_nslots, ncached);
+	kprintf("vm: swap %u free extents, largest %u slots, %u%% fragmented\n",
+		nextents, largest,
+		nfree == 0 ? 0 : 100 - largest * 100 / nfree);
+	kprintf("vm: swap %u runs allocated (%u slots), %u single slots from "
+		"caches, %u frees into caches\n", nruns, nrunslots, nhits,
+		nfrees);
+	kprintf("vm: swap %u cache refills, %u drains, %u allocations failed\n",
+		nrefills, ndrains, nfailures);
+}
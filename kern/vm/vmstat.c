@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VM event counters.  See vmstat.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <coremap.h>
+#include <vmstat.h>
+
+/* The counters of each CPU, indexed by c_number.  Each is only written by
+ * its own CPU, with interrupts off; readers add them up without locking and
+ * may miss an event in flight. */
+static struct vmstat_cpu {
+	unsigned vc_counts[VMS_NEVENTS];
+} __attribute__((__aligned__(VMS_CACHELINE))) vmstats[TLBSHOOTDOWN_MAXCPUS];
+
+/*
+ * vmstat_add
+ *
+ * Counts n occurrences of an event on the current CPU
+ */
+void
+vmstat_add(unsigned event, unsigned n)
+{
+	int spl;
+
+	KASSERT(event < VMS_NEVENTS);
+
+	/* Stay on this CPU while we count */
+	spl = splhigh();
+	KASSERT(curcpu->c_number < TLBSHOOTDOWN_MAXCPUS);
+	vmstats[curcpu->c_number].vc_counts[event] += n;
+	splx(spl);
+}
+
+/*
+ * vmstat_inc
+ *
+ * Counts one occurrence of an event on the current CPU
+ */
+void
+vmstat_inc(unsigned event)
+{
+	vmstat_add(event, 1);
+}
+
+/*
+ * vmstat_count
+ *
+ * Returns the total count of an event over all CPUs
+ */
+unsigned
+vmstat_count(unsigned event)
+{
+	unsigned total;
+
+	KASSERT(event < VMS_NEVENTS);
+
+	total = 0;
+	for (unsigned c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		total += vmstats[c].vc_counts[event];
+	}
+
+	return total;
+}
+
+/*
+ * vmstat_get
+ *
+ * Fills in a vmstat structure with the event counters and the current page
+ * counts
+ */
+void
+vmstat_get(struct vmstat *vs)
+{
+	unsigned nfree, nuser, nkernel;
+
+	vs->vms_faults_read = vmstat_count(VMS_FAULTREAD);
+	vs->vms_faults_write = vmstat_count(VMS_FAULTWRITE);
+	vs->vms_faults_readonly = vmstat_count(VMS_FAULTREADONLY);
+	vs->vms_zerofills = vmstat_count(VMS_ZEROFILL);
+	vs->vms_pageins = vmstat_count(VMS_PAGEIN);
+	vs->vms_evictions = vmstat_count(VMS_EVICTION);
+	vs->vms_swapfull = vmstat_count(VMS_SWAPFULL);
+	vs->vms_shootdowns = vmstat_count(VMS_SHOOTDOWN);
+	vs->vms_tlbrefills = vmstat_count(VMS_TLBREFILL);
+	vs->vms_zeromaps = vmstat_count(VMS_ZEROMAP);
+	vs->vms_rahits = vmstat_count(VMS_RAHIT);
+
+	coremap_countpages(&nfree, &nuser, &nkernel);
+	vs->vms_totalpages = nfree + nuser + nkernel;
+	vs->vms_freepages = nfree;
+	vs->vms_userpages = nuser;
+	vs->vms_kernelpages = nkernel;
+}
+
+/*
+ * vmstat_print
+ *
+ * Prints the event counters and the current page counts
+ */
+void
+vmstat_print(void)
+{
+	struct vmstat vs;
+
+	vmstat_get(&vs);
+
+	kprintf("vmstat: faults: %u read, %u write, %u read-only\n",
+		vs.vms_faults_read, vs.vms_faults_write,
+		vs.vms_faults_readonly);
+	kprintf("vmstat: %u zero-fill faults, %u page-ins, %u evictions, "
+		"%u swap full\n", vs.vms_zerofills, vs.vms_pageins,
+		vs.vms_evictions, vs.vms_swapfull);
+	kprintf("vmstat: %u TLB refills (%u of the zero page), "
+		"%u shootdowns sent\n", vs.vms_tlbrefills, vs.vms_zeromaps,
+		vs.vms_shootdowns);
+	kprintf("vmstat: %u pages read ahead used\n", vs.vms_rahits);
+	kprintf("vmstat: %u pages: %u free, %u user, %u kernel\n",
+		vs.vms_totalpages, vs.vms_freepages, vs.vms_userpages,
+		vs.vms_kernelpages);
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-CPU TLB management.  See vmtlb.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <vmtlb.h>
+
+/* The TLB state of each CPU, indexed by c_number.  Each entry is only
+ * touched by its own CPU, with interrupts off; vmtlb_printstats reads the
+ * counters of the others without synchronization. */
+static struct vmtlb vmtlbs[TLBSHOOTDOWN_MAXCPUS];
+
+/* One more than the highest CPU number seen so far */
+static unsigned vmtlb_ncpus;
+
+/*
+ * vmtlb_get
+ *
+ * Returns the TLB state of the current CPU.  Interrupts must be off.
+ */
+static
+struct vmtlb *
+vmtlb_get(void)
+{
+	unsigned num = curcpu->c_number;
+
+	KASSERT(num < TLBSHOOTDOWN_MAXCPUS);
+	if (num >= vmtlb_ncpus) {
+		vmtlb_ncpus = num + 1;
+	}
+	return &vmtlbs[num];
+}
+
+/*
+ * vmtlb_clearslot
+ *
+ * Invalidates TLB slot i and returns it to the free stack
+ */
+static
+void
+vmtlb_clearslot(struct vmtlb *vt, unsigned i)
+{
+	tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if (vt->vt_used[i]) {
+		vt->vt_used[i] = false;
+		vt->vt_free[vt->vt_nfree++] = i;
+	}
+}
+
+/*
+ * vmtlb_bootstrap
+ *
+ * Marks every TLB slot of every CPU as free
+ */
+void
+vmtlb_bootstrap(void)
+{
+	unsigned c, i;
+
+	for (c=0; c<TLBSHOOTDOWN_MAXCPUS; c++) {
+		for (i=0; i<NUM_TLB; i++) {
+			vmtlbs[c].vt_used[i] = false;
+
+			/* Hand out low slots first */
+			vmtlbs[c].vt_free[i] = NUM_TLB - 1 - i;
+		}
+		vmtlbs[c].vt_nfree = NUM_TLB;
+		vmtlbs[c].vt_hand = 0;
+		vmtlbs[c].vt_nrefills = 0;
+		vmtlbs[c].vt_nevictions = 0;
+		vmtlbs[c].vt_nduplicates = 0;
+	}
+}
+
+/*
+ * vmtlb_load
+ *
+ * Loads a translation into the TLB of the current CPU
+ */
+void
+vmtlb_load(uint32_t ehi, uint32_t elo)
+{
+	struct vmtlb *vt;
+	int i;
+	int spl;
+
+	spl = splhigh();
+	vt = vmtlb_get();
+
+	/* Never load a second entry for the same page */
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		vt->vt_nduplicates++;
+	}
+	else if (vt->vt_nfree > 0) {
+		i = vt->vt_free[--vt->vt_nfree];
+		KASSERT(!vt->vt_used[i]);
+		vt->vt_used[i] = true;
+	}
+	else {
+		i = vt->vt_hand;
+		vt->vt_hand = (vt->vt_hand + 1) % NUM_TLB;
+		vt->vt_nevictions++;
+	}
+
+	vt->vt_nrefills++;
+	tlb_write(ehi, elo, i);
+
+	splx(spl);
+}
+
+/*
+ * vmtlb_invalidate
+ *
+ * Removes the entry for the page and ASID in ehi from the TLB of the current
+ * CPU
+ */
+void
+vmtlb_invalidate(uint32_t ehi)
+{
+	int i;
+	int spl;
+
+	spl = splhigh();
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		vmtlb_clearslot(vmtlb_get(), i);
+	}
+
+	splx(spl);
+}
+
+/*
+ * vmtlb_invalidate_paddr
+ *
+ * Removes every entry mapping paddr from the TLB of the current CPU.  Only
+ * the slots in use need to be looked at.
+ */
+void
+vmtlb_invalidate_paddr(paddr_t paddr)
+{
+	struct vmtlb *vt;
+	uint32_t ehi, elo;
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	vt = vmtlb_get();
+
+	for (i=0; i<NUM_TLB; i++) {
+		if (!vt->vt_used[i]) {
+			continue;
+		}
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_PPAGE) == paddr) {
+			vmtlb_clearslot(vt, i);
+		}
+	}
+
+	splx(spl);
+}
+
+/*
+ * vmtlb_flush
+ *
+ * Removes every entry from the TLB of the current CPU
+ */
+void
+vmtlb_flush(void)
+{
+	struct vmtlb *vt;
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	vt = vmtlb_get();
+
+	for (i=0; i<NUM_TLB; i++) {
+		if (vt->vt_used[i]) {
+			vmtlb_clearslot(vt, i);
+		}
+	}
+	KASSERT(vt->vt_nfree == NUM_TLB);
+
+	splx(spl);
+}
+
+/*
+ * vmtlb_printstats
+ *
+ * Prints the TLB counters of each CPU
+ */
+void
+vmtlb_printstats(void)
+{
+	unsigned c;
+
+	for (c=0; c<vmtlb_ncpus; c++) {
+		kprintf("cpu%u: tlb: %u refills, %u evictions, "
+			"%u duplicates, %u free slots\n", c,
+			vmtlbs[c].vt_nrefills, vmtlbs[c].vt_nevictions,
+			vmtlbs[c].vt_nduplicates, vmtlbs[c].vt_nfree);
+	}
+}
@@ -150,6 +150,8 @@ int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
+/* mmap - see sys/mman.h */
+/* munmap - see sys/mman.h */
 
 /*
  * These are not themselves system calls, but wrapper routines in libc.